@@ -0,0 +1,20 @@
+/*
+ *  The OpenDiamond Platform for Interactive Search
+ *
+ *  Copyright (c) 2012 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  This software is distributed under the terms of the Eclipse Public
+ *  License, Version 1.0 which can be found in the file named LICENSE.
+ *  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+ *  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+ */
+
+// diamond-filter-host: runs filters built with LF_SHARED()
+
+#include "lf_priv.h"
+
+int main(void) {
+  lf_host_main();
+  return 0;
+}
@@ -0,0 +1,519 @@
+/*
+ *  The OpenDiamond Platform for Interactive Search
+ *
+ *  Copyright (c) 2012 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  This software is distributed under the terms of the Eclipse Public
+ *  License, Version 1.0 which can be found in the file named LICENSE.
+ *  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+ *  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+ */
+
+#include <glib.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#include "lib_filter.h"
+
+#define ISA_ENV "DIAMOND_KERNEL_ISA"
+
+/*
+ * Each implementation provides the innermost loops; the public functions
+ * validate arguments and handle the parts that don't vectorize.
+ */
+struct kernels {
+  const char *isa;
+  /* Store count bin indexes for the pixels at src. */
+  void (*bin_indexes)(const uint8_t *src, size_t count, unsigned shift,
+		      unsigned bits, uint32_t *idx);
+  size_t (*count_in_range)(const uint8_t *src, size_t count,
+			   const uint8_t lo[3], const uint8_t hi[3]);
+  /* acc[i] += add[i] - sub[i] */
+  void (*column_update)(uint32_t *acc, const uint32_t *add,
+			const uint32_t *sub, size_t count);
+  float (*l2)(const float *a, const float *b, size_t dim);
+  float (*dot)(const float *a, const float *b, size_t dim);
+};
+
+
+/* Scalar */
+
+static void bin_indexes_scalar(const uint8_t *src, size_t count,
+			       unsigned shift, unsigned bits, uint32_t *idx) {
+  size_t i;
+
+  for (i = 0; i < count; i++, src += 4) {
+    idx[i] = ((uint32_t) (src[0] >> shift) << (2 * bits)) |
+      ((uint32_t) (src[1] >> shift) << bits) | (src[2] >> shift);
+  }
+}
+
+static size_t count_in_range_scalar(const uint8_t *src, size_t count,
+				    const uint8_t lo[3], const uint8_t hi[3]) {
+  size_t i;
+  size_t n = 0;
+
+  for (i = 0; i < count; i++, src += 4) {
+    n += src[0] >= lo[0] && src[0] <= hi[0] &&
+      src[1] >= lo[1] && src[1] <= hi[1] &&
+      src[2] >= lo[2] && src[2] <= hi[2];
+  }
+  return n;
+}
+
+static void column_update_scalar(uint32_t *acc, const uint32_t *add,
+				 const uint32_t *sub, size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    acc[i] += add[i] - sub[i];
+  }
+}
+
+static float l2_scalar(const float *a, const float *b, size_t dim) {
+  float sum = 0;
+  size_t i;
+
+  for (i = 0; i < dim; i++) {
+    float d = a[i] - b[i];
+    sum += d * d;
+  }
+  return sum;
+}
+
+static float dot_scalar(const float *a, const float *b, size_t dim) {
+  float sum = 0;
+  size_t i;
+
+  for (i = 0; i < dim; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+static const struct kernels scalar_kernels = {
+  .isa = "scalar",
+  .bin_indexes = bin_indexes_scalar,
+  .count_in_range = count_in_range_scalar,
+  .column_update = column_update_scalar,
+  .l2 = l2_scalar,
+  .dot = dot_scalar,
+};
+
+
+#ifdef HAVE_X86_KERNELS
+
+/*
+ * The SIMD implementations are compiled with per-function target
+ * attributes, so the library itself needs no special compiler flags and
+ * runs on any x86 CPU.  Loops handle whole vectors and leave the
+ * remainder to the scalar code.
+ */
+
+/* SSE4.2 */
+
+#define SSE42 __attribute__((target("sse4.2")))
+
+static SSE42 void bin_indexes_sse42(const uint8_t *src, size_t count,
+				    unsigned shift, unsigned bits,
+				    uint32_t *idx) {
+  const __m128i mask = _mm_set1_epi32(0xff >> shift);
+  const __m128i sh = _mm_cvtsi32_si128(shift);
+  const __m128i bsh = _mm_cvtsi32_si128(bits);
+  const __m128i b2sh = _mm_cvtsi32_si128(2 * bits);
+  size_t i;
+
+  for (i = 0; i + 4 <= count; i += 4) {
+    __m128i px = _mm_loadu_si128((const __m128i *) (src + 4 * i));
+    __m128i r = _mm_and_si128(_mm_srl_epi32(px, sh), mask);
+    __m128i g = _mm_and_si128(_mm_srl_epi32(_mm_srli_epi32(px, 8), sh),
+			      mask);
+    __m128i b = _mm_and_si128(_mm_srl_epi32(_mm_srli_epi32(px, 16), sh),
+			      mask);
+    __m128i v = _mm_or_si128(_mm_or_si128(_mm_sll_epi32(r, b2sh),
+					  _mm_sll_epi32(g, bsh)), b);
+    _mm_storeu_si128((__m128i *) (idx + i), v);
+  }
+  bin_indexes_scalar(src + 4 * i, count - i, shift, bits, idx + i);
+}
+
+static SSE42 size_t count_in_range_sse42(const uint8_t *src, size_t count,
+					 const uint8_t lo[3],
+					 const uint8_t hi[3]) {
+  /* The unused byte always passes */
+  const __m128i vlo = _mm_set1_epi32(lo[0] | lo[1] << 8 | lo[2] << 16);
+  const __m128i vhi = _mm_set1_epi32(hi[0] | hi[1] << 8 | hi[2] << 16 |
+				     0xffu << 24);
+  const __m128i ones = _mm_set1_epi32(-1);
+  size_t i;
+  size_t n = 0;
+
+  for (i = 0; i + 4 <= count; i += 4) {
+    __m128i px = _mm_loadu_si128((const __m128i *) (src + 4 * i));
+    __m128i in = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(px, vlo), px),
+			       _mm_cmpeq_epi8(_mm_min_epu8(px, vhi), px));
+    int bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(in, ones)));
+    n += __builtin_popcount(bits);
+  }
+  return n + count_in_range_scalar(src + 4 * i, count - i, lo, hi);
+}
+
+static SSE42 void column_update_sse42(uint32_t *acc, const uint32_t *add,
+				      const uint32_t *sub, size_t count) {
+  size_t i;
+
+  for (i = 0; i + 4 <= count; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (acc + i));
+    __m128i p = _mm_loadu_si128((const __m128i *) (add + i));
+    __m128i m = _mm_loadu_si128((const __m128i *) (sub + i));
+    a = _mm_add_epi32(a, _mm_sub_epi32(p, m));
+    _mm_storeu_si128((__m128i *) (acc + i), a);
+  }
+  column_update_scalar(acc + i, add + i, sub + i, count - i);
+}
+
+static SSE42 float hsum_sse42(__m128 v) {
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+  return _mm_cvtss_f32(v);
+}
+
+static SSE42 float l2_sse42(const float *a, const float *b, size_t dim) {
+  __m128 sum = _mm_setzero_ps();
+  size_t i;
+
+  for (i = 0; i + 4 <= dim; i += 4) {
+    __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+  }
+  return hsum_sse42(sum) + l2_scalar(a + i, b + i, dim - i);
+}
+
+static SSE42 float dot_sse42(const float *a, const float *b, size_t dim) {
+  __m128 sum = _mm_setzero_ps();
+  size_t i;
+
+  for (i = 0; i + 4 <= dim; i += 4) {
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i),
+				     _mm_loadu_ps(b + i)));
+  }
+  return hsum_sse42(sum) + dot_scalar(a + i, b + i, dim - i);
+}
+
+static const struct kernels sse42_kernels = {
+  .isa = "sse4.2",
+  .bin_indexes = bin_indexes_sse42,
+  .count_in_range = count_in_range_sse42,
+  .column_update = column_update_sse42,
+  .l2 = l2_sse42,
+  .dot = dot_sse42,
+};
+
+
+/* AVX2 */
+
+#define AVX2 __attribute__((target("avx2")))
+
+static AVX2 void bin_indexes_avx2(const uint8_t *src, size_t count,
+				  unsigned shift, unsigned bits,
+				  uint32_t *idx) {
+  const __m256i mask = _mm256_set1_epi32(0xff >> shift);
+  const __m128i sh = _mm_cvtsi32_si128(shift);
+  const __m128i bsh = _mm_cvtsi32_si128(bits);
+  const __m128i b2sh = _mm_cvtsi32_si128(2 * bits);
+  size_t i;
+
+  for (i = 0; i + 8 <= count; i += 8) {
+    __m256i px = _mm256_loadu_si256((const __m256i *) (src + 4 * i));
+    __m256i r = _mm256_and_si256(_mm256_srl_epi32(px, sh), mask);
+    __m256i g = _mm256_and_si256(
+	_mm256_srl_epi32(_mm256_srli_epi32(px, 8), sh), mask);
+    __m256i b = _mm256_and_si256(
+	_mm256_srl_epi32(_mm256_srli_epi32(px, 16), sh), mask);
+    __m256i v = _mm256_or_si256(_mm256_or_si256(
+	_mm256_sll_epi32(r, b2sh), _mm256_sll_epi32(g, bsh)), b);
+    _mm256_storeu_si256((__m256i *) (idx + i), v);
+  }
+  bin_indexes_scalar(src + 4 * i, count - i, shift, bits, idx + i);
+}
+
+static AVX2 size_t count_in_range_avx2(const uint8_t *src, size_t count,
+				       const uint8_t lo[3],
+				       const uint8_t hi[3]) {
+  const __m256i vlo = _mm256_set1_epi32(lo[0] | lo[1] << 8 | lo[2] << 16);
+  const __m256i vhi = _mm256_set1_epi32(hi[0] | hi[1] << 8 | hi[2] << 16 |
+					0xffu << 24);
+  const __m256i ones = _mm256_set1_epi32(-1);
+  size_t i;
+  size_t n = 0;
+
+  for (i = 0; i + 8 <= count; i += 8) {
+    __m256i px = _mm256_loadu_si256((const __m256i *) (src + 4 * i));
+    __m256i in = _mm256_and_si256(
+	_mm256_cmpeq_epi8(_mm256_max_epu8(px, vlo), px),
+	_mm256_cmpeq_epi8(_mm256_min_epu8(px, vhi), px));
+    int bits = _mm256_movemask_ps(
+	_mm256_castsi256_ps(_mm256_cmpeq_epi32(in, ones)));
+    n += __builtin_popcount(bits);
+  }
+  return n + count_in_range_scalar(src + 4 * i, count - i, lo, hi);
+}
+
+static AVX2 void column_update_avx2(uint32_t *acc, const uint32_t *add,
+				    const uint32_t *sub, size_t count) {
+  size_t i;
+
+  for (i = 0; i + 8 <= count; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (acc + i));
+    __m256i p = _mm256_loadu_si256((const __m256i *) (add + i));
+    __m256i m = _mm256_loadu_si256((const __m256i *) (sub + i));
+    a = _mm256_add_epi32(a, _mm256_sub_epi32(p, m));
+    _mm256_storeu_si256((__m256i *) (acc + i), a);
+  }
+  column_update_scalar(acc + i, add + i, sub + i, count - i);
+}
+
+static AVX2 float hsum_avx2(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),
+			_mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+static AVX2 float l2_avx2(const float *a, const float *b, size_t dim) {
+  __m256 sum = _mm256_setzero_ps();
+  size_t i;
+
+  for (i = 0; i + 8 <= dim; i += 8) {
+    __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(d, d));
+  }
+  return hsum_avx2(sum) + l2_scalar(a + i, b + i, dim - i);
+}
+
+static AVX2 float dot_avx2(const float *a, const float *b, size_t dim) {
+  __m256 sum = _mm256_setzero_ps();
+  size_t i;
+
+  for (i = 0; i + 8 <= dim; i += 8) {
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+					   _mm256_loadu_ps(b + i)));
+  }
+  return hsum_avx2(sum) + dot_scalar(a + i, b + i, dim - i);
+}
+
+static const struct kernels avx2_kernels = {
+  .isa = "avx2",
+  .bin_indexes = bin_indexes_avx2,
+  .count_in_range = count_in_range_avx2,
+  .column_update = column_update_avx2,
+  .l2 = l2_avx2,
+  .dot = dot_avx2,
+};
+
+#endif /* HAVE_X86_KERNELS */
+
+
+/* Dispatch */
+
+static const struct kernels *kernels;
+
+static bool kernels_supported(const struct kernels *k) {
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (k == &avx2_kernels) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (k == &sse42_kernels) {
+    return __builtin_cpu_supports("sse4.2");
+  }
+#endif
+  return k == &scalar_kernels;
+}
+
+static const struct kernels *find_kernels(const char *isa) {
+  static const struct kernels *const all[] = {
+#ifdef HAVE_X86_KERNELS
+    &avx2_kernels,
+    &sse42_kernels,
+#endif
+    &scalar_kernels,
+  };
+  unsigned i;
+
+  for (i = 0; i < G_N_ELEMENTS(all); i++) {
+    if ((isa == NULL || !strcmp(isa, all[i]->isa)) &&
+	kernels_supported(all[i])) {
+      return all[i];
+    }
+  }
+  return NULL;
+}
+
+static const struct kernels *get_kernels(void) {
+  const struct kernels *k = g_atomic_pointer_get(&kernels);
+
+  if (k == NULL) {
+    const char *isa = getenv(ISA_ENV);
+
+    if (isa != NULL && *isa != 0) {
+      k = find_kernels(isa);
+      if (k == NULL) {
+	g_warning("Kernel implementation \"%s\" not available", isa);
+      }
+    }
+    if (k == NULL) {
+      k = find_kernels(NULL);
+    }
+    g_atomic_pointer_set(&kernels, (gpointer) k);
+  }
+  return k;
+}
+
+const char *lf_kernel_isa(void) {
+  return get_kernels()->isa;
+}
+
+int lf_kernel_select(const char *isa) {
+  const struct kernels *k = find_kernels(isa);
+
+  if (k == NULL) {
+    return ENOTSUP;
+  }
+  g_atomic_pointer_set(&kernels, (gpointer) k);
+  return 0;
+}
+
+
+/* Kernels */
+
+#define HISTOGRAM_CHUNK 256
+
+int lf_rgb_histogram(const void *pixels, size_t count, unsigned bins,
+		     uint32_t *hist) {
+  const struct kernels *k = get_kernels();
+  const uint8_t *src = pixels;
+  uint32_t idx[HISTOGRAM_CHUNK];
+  unsigned bits;
+
+  if (bins == 0 || bins > 256 || (bins & (bins - 1))) {
+    return EINVAL;
+  }
+  bits = g_bit_storage(bins) - 1;
+
+  /*
+   * Compute the bin indexes a chunk at a time, then increment the bins
+   * serially; there is no efficient vector scatter-increment.
+   */
+  while (count > 0) {
+    size_t n = MIN(count, HISTOGRAM_CHUNK);
+    size_t i;
+
+    k->bin_indexes(src, n, 8 - bits, bits, idx);
+    for (i = 0; i < n; i++) {
+      hist[idx[i]]++;
+    }
+    src += 4 * n;
+    count -= n;
+  }
+  return 0;
+}
+
+size_t lf_count_in_range(const void *pixels, size_t count,
+			 const uint8_t lo[3], const uint8_t hi[3]) {
+  return get_kernels()->count_in_range(pixels, count, lo, hi);
+}
+
+/* Sums of one channel of a row over every window of width win_width. */
+static void row_sums(const uint8_t *src, size_t width, size_t win_width,
+		     uint32_t *out) {
+  uint32_t sum = 0;
+  size_t x;
+
+  for (x = 0; x < win_width; x++) {
+    sum += src[4 * x];
+  }
+  out[0] = sum;
+  for (x = win_width; x < width; x++) {
+    sum += src[4 * x] - src[4 * (x - win_width)];
+    out[x - win_width + 1] = sum;
+  }
+}
+
+int lf_window_sums(const void *pixels, size_t width, size_t height,
+		   size_t stride, unsigned channel, size_t win_width,
+		   size_t win_height, uint32_t *out) {
+  const struct kernels *k = get_kernels();
+  const uint8_t *src = (const uint8_t *) pixels + channel;
+  size_t out_width = width - win_width + 1;
+  uint32_t *rows;
+  uint32_t *acc;
+  uint32_t *cur;
+  size_t y;
+
+  if (channel > 2 || win_width == 0 || win_height == 0 ||
+      win_width > width || win_height > height) {
+    return EINVAL;
+  }
+
+  /*
+   * Separable box sum: horizontal sums of each row, kept in a ring of
+   * win_height rows, and a running vertical sum that adds the newest row
+   * and subtracts the one leaving the window.
+   */
+  rows = g_new(uint32_t, (win_height + 2) * out_width);
+  acc = rows + win_height * out_width;
+  cur = acc + out_width;
+  memset(acc, 0, out_width * sizeof(*acc));
+  for (y = 0; y < height; y++) {
+    uint32_t *slot = rows + (y % win_height) * out_width;
+
+    row_sums(src + y * stride, width, win_width, cur);
+    if (y < win_height) {
+      memset(slot, 0, out_width * sizeof(*slot));
+    }
+    k->column_update(acc, cur, slot, out_width);
+    memcpy(slot, cur, out_width * sizeof(*slot));
+    if (y + 1 >= win_height) {
+      memcpy(out + (y + 1 - win_height) * out_width, acc,
+	     out_width * sizeof(*out));
+    }
+  }
+  g_free(rows);
+  return 0;
+}
+
+void lf_l2_distances(const float *query, const float *vectors,
+		     size_t count, size_t dim, float *out) {
+  const struct kernels *k = get_kernels();
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    out[i] = k->l2(query, vectors + i * dim, dim);
+  }
+}
+
+void lf_cosine_similarities(const float *query, const float *vectors,
+			    size_t count, size_t dim, float *out) {
+  const struct kernels *k = get_kernels();
+  float qnorm = sqrtf(k->dot(query, query, dim));
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    const float *v = vectors + i * dim;
+    float norm = qnorm * sqrtf(k->dot(v, v, dim));
+
+    out[i] = norm > 0 ? k->dot(query, v, dim) / norm : 0;
+  }
+}
@@ -17,12 +17,22 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "lib_filter.h"
 
 extern struct lf_state {
   const char *filter_name;
   FILE *in;
   FILE *out;
+  // Running in diamond-filter-host, where an object handle is shared by
+  // several filters
+  bool host_mode;
+  // Incremented for each filter evaluation in host mode
+  unsigned eval_generation;
+  // The server says whether it is tracing each object
+  bool spans;
+  // Report spans of the current evaluation to the server
+  bool sampled;
 } lf_state;
 
 lf_obj_handle_t lf_obj_handle_new(void);
@@ -31,4 +41,13 @@ void lf_obj_handle_free(lf_obj_handle_t obj);
 void lf_start_output(void);
 void lf_end_output(void);
 
+// Return the start time of a span, in ns of CLOCK_MONOTONIC
+uint64_t lf_span_begin(void);
+// Record a span of the current evaluation from start until now.  detail
+// may be NULL.  Does nothing unless reporting spans.
+void lf_span_end(uint64_t start, const char *name, const char *detail);
+
+// Entry point of diamond-filter-host
+diamond_public void lf_host_main(void);
+
 #endif
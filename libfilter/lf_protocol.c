@@ -101,14 +101,35 @@ char **lf_get_strings(FILE *in) {
   return result;
 }
 
-void *lf_get_binary(FILE *in, int *len_OUT) {
+void *lf_alloc_aligned(size_t len) {
+  size_t padded = (len + LF_TENSOR_ALIGN - 1) & ~(size_t) (LF_TENSOR_ALIGN - 1);
+  void *buf;
+
+  if (padded == 0) {
+    padded = LF_TENSOR_ALIGN;
+  }
+  if (posix_memalign(&buf, LF_TENSOR_ALIGN, padded)) {
+    g_error("Can't allocate %zu bytes", padded);
+  }
+  memset((uint8_t *) buf + len, 0, padded - len);
+
+  return buf;
+}
+
+static void *get_binary(FILE *in, int *len_OUT, bool aligned) {
   int size = lf_get_size(in);
   *len_OUT = size;
 
   uint8_t *binary = NULL;
 
+  if (aligned && size >= 0) {
+    binary = lf_alloc_aligned(size);
+  }
+
   if (size > 0) {
-    binary = g_malloc(size);
+    if (!aligned) {
+      binary = g_malloc(size);
+    }
 
     if (fread(binary, size, 1, in) != 1) {
       error_stdio(in, "Can't read binary");
@@ -123,6 +144,14 @@ void *lf_get_binary(FILE *in, int *len_OUT) {
   return binary;
 }
 
+void *lf_get_binary(FILE *in, int *len_OUT) {
+  return get_binary(in, len_OUT, false);
+}
+
+void *lf_get_binary_aligned(FILE *in, int *len_OUT) {
+  return get_binary(in, len_OUT, true);
+}
+
 void lf_send_binary(FILE *out, int len, const void *data) {
   if (fprintf(out, "%d\n", len) == -1) {
     error_stdio(out, "Can't write binary length");
@@ -26,6 +26,13 @@ char **lf_get_strings(FILE *in);
 
 void *lf_get_binary(FILE *in, int *len_OUT);
 
+// Allocate a buffer aligned to LF_TENSOR_ALIGN and zero-padded to a
+// multiple of it.  Free with free().
+void *lf_alloc_aligned(size_t len);
+
+// Like lf_get_binary(), but the result comes from lf_alloc_aligned()
+void *lf_get_binary_aligned(FILE *in, int *len_OUT);
+
 bool lf_get_boolean(FILE *in);
 
 void lf_get_blank(FILE *in);
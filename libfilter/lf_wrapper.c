@@ -23,6 +23,11 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
 
 #include "lib_filter.h"
 #include "lf_protocol.h"
@@ -32,6 +37,14 @@ struct lf_state lf_state;
 
 static GStaticMutex out_mutex = G_STATIC_MUTEX_INIT;
 
+// Spans of the current evaluation, one per line
+static GStaticMutex span_mutex = G_STATIC_MUTEX_INIT;
+static GString *spans;
+
+// Per-evaluation CPU time budget from the server, or zero for none
+static struct itimerval deadline;
+static volatile sig_atomic_t deadline_expired;
+
 void lf_start_output(void) {
   g_static_mutex_lock(&out_mutex);
 }
@@ -107,11 +120,137 @@ static gpointer logger(gpointer data) {
   return NULL;
 }
 
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+// If the server placed us on a NUMA node, prefer memory from that node
+// for attribute buffers.  Must run before any threads are created, since
+// the policy is per-thread and inherited only by new threads.
+static void init_numa_policy(void) {
+#ifdef SYS_set_mempolicy
+  const char *env = getenv("DIAMOND_NUMA_NODE");
+  if (env == NULL || *env == 0) {
+    return;
+  }
+
+  char *end;
+  long node = strtol(env, &end, 10);
+  unsigned long mask[16] = {0};
+  const unsigned long bits = 8 * sizeof(mask[0]);
+  if (*end != 0 || node < 0 || (unsigned long) node >= 16 * bits) {
+    g_warning("Invalid NUMA node: %s", env);
+    return;
+  }
+  mask[node / bits] = 1UL << (node % bits);
+
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, 16 * bits)) {
+    g_warning("Couldn't set NUMA memory policy: %s", strerror(errno));
+  }
+#endif
+}
+
+static void deadline_handler(int sig) {
+  deadline_expired = 1;
+}
+
+// If the server gave us a time budget for each evaluation, arrange for
+// SIGVTALRM to mark it expired.  The budget is CPU time, since a
+// standalone filter begins evaluating the next object, and waits for the
+// server to answer its first request, as soon as it has returned a
+// result.
+static void init_deadline(void) {
+  const char *env = getenv("DIAMOND_DEADLINE_MS");
+  if (env == NULL || *env == 0) {
+    return;
+  }
+
+  char *end;
+  long ms = strtol(env, &end, 10);
+  if (*end != 0 || ms < 0) {
+    g_warning("Invalid deadline: %s", env);
+    return;
+  }
+  deadline.it_value.tv_sec = ms / 1000;
+  deadline.it_value.tv_usec = (ms % 1000) * 1000;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = deadline_handler;
+  // Don't disturb blocking calls in the filter
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  assert_result(sigaction(SIGVTALRM, &sa, NULL));
+}
+
+int lf_deadline_expired(void) {
+  return deadline_expired;
+}
+
+// If the server is tracing objects, report the time taken by evaluations
+// and attribute fetches of the objects it samples.  The server matches our
+// CLOCK_MONOTONIC times against its own.
+static void init_spans(void) {
+  const char *env = getenv("DIAMOND_SPANS");
+  lf_state.spans = env != NULL && *env != 0;
+  if (lf_state.spans) {
+    spans = g_string_new(NULL);
+  }
+}
+
+// Once we have announced that we report spans, the server starts each
+// evaluation by saying whether the object is sampled.  Since we block
+// until then, the evaluation's spans exclude the time spent waiting for
+// the server to get to the object.
+static void read_sampled(void) {
+  lf_state.sampled = lf_state.spans && lf_get_boolean(lf_state.in);
+}
+
+uint64_t lf_span_begin(void) {
+  if (!lf_state.sampled) {
+    return 0;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void lf_span_end(uint64_t start, const char *name, const char *detail) {
+  if (!lf_state.sampled) {
+    return;
+  }
+  uint64_t end = lf_span_begin();
+  g_static_mutex_lock(&span_mutex);
+  g_string_append_printf(spans, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+                         " %s%s%s\n", start, end, name, detail ? " " : "",
+                         detail ? detail : "");
+  g_static_mutex_unlock(&span_mutex);
+}
+
+// Send the spans of the evaluation ahead of its result.  Called with the
+// output lock held.
+static void send_spans(void) {
+  if (!lf_state.sampled) {
+    return;
+  }
+  g_static_mutex_lock(&span_mutex);
+  if (spans->len) {
+    lf_send_tag(lf_state.out, "spans");
+    lf_send_string(lf_state.out, spans->str);
+    g_string_truncate(spans, 0);
+  }
+  g_static_mutex_unlock(&span_mutex);
+}
+
 static void lf_init(void) {
   int stdin_orig;
   int stdout_orig;
   int stdout_log;
 
+  init_numa_policy();
+  init_deadline();
+  init_spans();
+
   if (!g_thread_supported ()) g_thread_init (NULL);
 
   init_file_descriptors(&stdin_orig, &stdout_orig,
@@ -140,13 +279,8 @@ static void lf_init(void) {
   }
 }
 
-static void lf_run_filter(char *filter_name, filter_init_proto init,
-                          filter_eval_proto eval_int,
-                          filter_eval_double_proto eval_double,
-                          char **args, void *blob, unsigned bloblen) {
-  // record the filter name
-  lf_state.filter_name = filter_name;
-
+static void *init_filter(const char *filter_name, filter_init_proto init,
+                         char **args, void *blob, unsigned bloblen) {
   // initialize the filter
   void *data;
   int result = init(g_strv_length(args), (const char * const *) args,
@@ -156,32 +290,113 @@ static void lf_run_filter(char *filter_name, filter_init_proto init,
     exit(EXIT_FAILURE);
   }
 
-  // report init success
+  // report init success, announcing that we expect the sampled flag
   lf_start_output();
+  if (lf_state.spans) {
+    lf_send_tag(lf_state.out, "report-spans");
+  }
   lf_send_tag(lf_state.out, "init-success");
   lf_end_output();
 
+  return data;
+}
+
+static void eval_filter(lf_obj_handle_t obj, filter_eval_proto eval_int,
+                        filter_eval_double_proto eval_double, void *data) {
+  // start the clock
+  static const struct itimerval disarm;
+  bool timed = deadline.it_value.tv_sec || deadline.it_value.tv_usec;
+  deadline_expired = 0;
+  if (timed) {
+    assert_result(setitimer(ITIMER_VIRTUAL, &deadline, NULL));
+  }
+
+  // eval and return result
+  uint64_t start = lf_span_begin();
+  double result;
+  if (eval_double) {
+    result = eval_double(obj, data);
+  } else {
+    result = eval_int(obj, data);
+  }
+  lf_span_end(start, "eval", NULL);
+
+  if (timed) {
+    assert_result(setitimer(ITIMER_VIRTUAL, &disarm, NULL));
+  }
+  lf_start_output();
+  send_spans();
+  if (deadline_expired) {
+    // the result may be from an abandoned evaluation
+    lf_send_tag(lf_state.out, "deadline-expired");
+  } else {
+    lf_send_tag(lf_state.out, "result");
+    lf_send_double(lf_state.out, result);
+  }
+  lf_end_output();
+}
+
+static void lf_run_filter(char *filter_name, filter_init_proto init,
+                          filter_eval_proto eval_int,
+                          filter_eval_double_proto eval_double,
+                          char **args, void *blob, unsigned bloblen) {
+  // record the filter name
+  lf_state.filter_name = filter_name;
+
+  void *data = init_filter(filter_name, init, args, blob, bloblen);
+
   // eval loop
   while (true) {
     // init ohandle
     lf_obj_handle_t obj = lf_obj_handle_new();
 
-    // eval and return result
-    double result;
-    if (eval_double) {
-      result = eval_double(obj, data);
-    } else {
-      result = eval_int(obj, data);
-    }
-    lf_start_output();
-    lf_send_tag(lf_state.out, "result");
-    lf_send_double(lf_state.out, result);
-    lf_end_output();
+    read_sampled();
+    eval_filter(obj, eval_int, eval_double, data);
 
     lf_obj_handle_free(obj);
   }
 }
 
+// Map the blob argument from the server's blob cache.  The mapping is
+// private, so a filter that modifies its blob only copies the pages it
+// writes; all other pages are shared through the page cache with every
+// filter process using the same blob.
+static void *map_blob(const char *path, int *bloblen) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    g_error("Couldn't open blob %s: %s", path, g_strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    g_error("Couldn't stat blob %s: %s", path, g_strerror(errno));
+  }
+  if (st.st_size > G_MAXINT) {
+    g_error("Blob %s is too large", path);
+  }
+  void *blob = NULL;
+  if (st.st_size > 0) {
+    blob = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (blob == MAP_FAILED) {
+      g_error("Couldn't map blob %s: %s", path, g_strerror(errno));
+    }
+  }
+  close(fd);
+  *bloblen = st.st_size;
+  return blob;
+}
+
+// Read the blob argument: its contents in protocol versions 1 and 2, or
+// the path to a file containing it in versions 3 and 4.
+static void *get_blob(int version, int *bloblen) {
+  if (version >= 3) {
+    char *path = lf_get_string(lf_state.in);
+    void *blob = map_blob(path, bloblen);
+    g_free(path);
+    return blob;
+  }
+  return lf_get_binary(lf_state.in, bloblen);
+}
+
 static void _lf_main(filter_init_proto init, filter_eval_proto eval,
                      filter_eval_double_proto eval_double) {
   // set up file descriptors
@@ -189,7 +404,7 @@ static void _lf_main(filter_init_proto init, filter_eval_proto eval,
 
   // read protocol version
   double version = lf_get_double(lf_state.in);
-  if (version != 1) {
+  if (version != 1 && version != 3) {
     g_error("Unknown protocol version %d", (int) version);
     exit(EXIT_FAILURE);
   }
@@ -202,7 +417,7 @@ static void _lf_main(filter_init_proto init, filter_eval_proto eval,
 
   // read blob
   int bloblen;
-  void *blob = lf_get_binary(lf_state.in, &bloblen);
+  void *blob = get_blob(version, &bloblen);
 
   // run the filter loop
   lf_run_filter(filter_name, init, eval, eval_double, args, blob, bloblen);
@@ -215,3 +430,94 @@ void lf_main(filter_init_proto init, filter_eval_proto eval) {
 void lf_main_double(filter_init_proto init, filter_eval_double_proto eval) {
   _lf_main(init, NULL, eval);
 }
+
+
+struct hosted_filter {
+  char *name;
+  char **args;
+  void *blob;
+  int bloblen;
+  const struct lf_shared_filter *entry;
+  bool initialized;
+  void *data;
+};
+
+static void load_hosted_filter(struct hosted_filter *filter, int version) {
+  filter->name = lf_get_string(lf_state.in);
+  filter->args = lf_get_strings(lf_state.in);
+  filter->blob = get_blob(version, &filter->bloblen);
+  char *path = lf_get_string(lf_state.in);
+
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    g_error("Couldn't load filter %s: %s", filter->name, dlerror());
+  }
+  filter->entry = dlsym(handle, LF_SHARED_SYMBOL);
+  if (filter->entry == NULL) {
+    g_error("Filter %s has no %s symbol", filter->name, LF_SHARED_SYMBOL);
+  }
+  if (filter->entry->version != LF_SHARED_VERSION) {
+    g_error("Filter %s has unknown entry point version %u", filter->name,
+            filter->entry->version);
+  }
+  g_free(path);
+}
+
+// Run several shared-object filters in one process.  The server names
+// the filter and object for each evaluation; consecutive evaluations of
+// the same object share its object handle, so attributes fetched or
+// written by one filter are available to the next without a round trip.
+// Each filter is initialized on its first evaluation, so that its
+// init-success is read by the server runner for that filter.
+void lf_host_main(void) {
+  // set up file descriptors
+  lf_init();
+  lf_state.host_mode = true;
+
+  // read protocol version
+  double version = lf_get_double(lf_state.in);
+  if (version != 2 && version != 4) {
+    g_error("Unknown protocol version %d", (int) version);
+    exit(EXIT_FAILURE);
+  }
+
+  // read filters
+  int count = lf_get_double(lf_state.in);
+  struct hosted_filter *filters = g_new0(struct hosted_filter, count);
+  for (int i = 0; i < count; i++) {
+    load_hosted_filter(&filters[i], version);
+  }
+
+  // eval loop
+  lf_obj_handle_t obj = NULL;
+  double current = 0;
+  while (true) {
+    int index = lf_get_double(lf_state.in);
+    double sequence = lf_get_double(lf_state.in);
+    if (index < 0 || index >= count) {
+      g_error("Invalid filter index %d", index);
+    }
+
+    // new object?
+    if (obj == NULL || sequence != current) {
+      if (obj != NULL) {
+        lf_obj_handle_free(obj);
+      }
+      obj = lf_obj_handle_new();
+      current = sequence;
+    }
+
+    struct hosted_filter *filter = &filters[index];
+    lf_state.filter_name = filter->name;
+    if (!filter->initialized) {
+      filter->data = init_filter(filter->name, filter->entry->init,
+                                 filter->args, filter->blob, filter->bloblen);
+      filter->initialized = true;
+    }
+
+    lf_state.eval_generation++;
+    read_sampled();
+    eval_filter(obj, filter->entry->eval, filter->entry->eval_double,
+                filter->data);
+  }
+}
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "lib_filter.h"
 #include "lf_protocol.h"
@@ -28,17 +29,21 @@
 
 struct ohandle {
   GHashTable *attributes;
+  GPtrArray *by_id;	// borrowed from attributes, indexed by interned id
 };
 
 struct attribute {
   size_t len;
   void *data;
+  // host mode: eval generation in which the server last saw this
+  // filter access the attribute
+  unsigned reported;
 };
 
 static void attribute_destroy(gpointer user_data) {
   struct attribute *attr = user_data;
 
-  g_free(attr->data);
+  free(attr->data);
   g_slice_free(struct attribute, attr);
 }
 
@@ -47,6 +52,7 @@ lf_obj_handle_t lf_obj_handle_new(void) {
 
   ret->attributes = g_hash_table_new_full(g_str_hash, g_str_equal,
                                           g_free, attribute_destroy);
+  ret->by_id = g_ptr_array_new();
 
   return ret;
 }
@@ -54,36 +60,147 @@ lf_obj_handle_t lf_obj_handle_new(void) {
 void lf_obj_handle_free(lf_obj_handle_t obj) {
   struct ohandle *ohandle = obj;
 
+  g_ptr_array_free(ohandle->by_id, TRUE);
   g_hash_table_unref(ohandle->attributes);
   g_slice_free(struct ohandle, ohandle);
 }
 
+// interned attribute names, indexed by id
+static GPtrArray *interned_names;
+// name -> id + 1
+static GHashTable *interned_ids;
+
+static bool valid_attr_id(lf_attr_id_t id) {
+  return interned_names != NULL && id >= 0 &&
+    (guint) id < interned_names->len;
+}
+
+static struct attribute *receive_attribute(struct ohandle *ohandle,
+                                           const char *name) {
+  int len;
+  void *data = lf_get_binary_aligned(lf_state.in, &len);
+
+  if (len == -1) {
+    // no attribute
+    return NULL;
+  }
+
+  struct attribute *attr = g_slice_new(struct attribute);
+  attr->data = data;
+  attr->len = len;
+  attr->reported = lf_state.eval_generation;
+
+  g_hash_table_insert(ohandle->attributes, g_strdup(name), attr);
+
+  return attr;
+}
+
+// In host mode, the attribute may have been fetched or written by another
+// filter.  Tell the server that this filter read it, so that the filter's
+// cached results record the dependency.  No reply.
+static void report_read(struct attribute *attr, const char *tag,
+                        const char *name, lf_attr_id_t id) {
+  if (!lf_state.host_mode || attr->reported == lf_state.eval_generation) {
+    return;
+  }
+  attr->reported = lf_state.eval_generation;
+
+  lf_start_output();
+  lf_send_tag(lf_state.out, tag);
+  if (name != NULL) {
+    lf_send_string(lf_state.out, name);
+  } else {
+    lf_send_int(lf_state.out, id);
+  }
+  lf_end_output();
+}
+
+// In host mode, keep a copy of written attributes for the filters that
+// run after this one.  The attribute is updated in place so that by_id
+// references to it remain valid.
+static void store_attribute(struct ohandle *ohandle, const char *name,
+                            size_t len, const void *data) {
+  if (!lf_state.host_mode) {
+    return;
+  }
+
+  // copy before freeing the old value, which the filter may be writing
+  // back from a pointer returned by lf_ref_attr()
+  void *copy = lf_alloc_aligned(len);
+  memcpy(copy, data, len);
+
+  struct attribute *attr = g_hash_table_lookup(ohandle->attributes, name);
+  if (attr == NULL) {
+    attr = g_slice_new(struct attribute);
+    g_hash_table_insert(ohandle->attributes, g_strdup(name), attr);
+  } else {
+    free(attr->data);
+  }
+  attr->data = copy;
+  attr->len = len;
+  // the server learned nothing about reads from this write
+  attr->reported = 0;
+}
+
 static struct attribute *get_attribute(struct ohandle *ohandle,
                                        const char *name) {
   // look up in hash table
   struct attribute *attr = g_hash_table_lookup(ohandle->attributes,
 					       name);
 
-  // retrieve?
-  if (attr == NULL) {
+  if (attr != NULL) {
+    report_read(attr, "read-attribute", name, 0);
+  } else {
+    // retrieve
+    uint64_t start = lf_span_begin();
     lf_start_output();
     lf_send_tag(lf_state.out, "get-attribute");
     lf_send_string(lf_state.out, name);
     lf_end_output();
 
-    int len;
-    void *data = lf_get_binary(lf_state.in, &len);
+    attr = receive_attribute(ohandle, name);
+    lf_span_end(start, "get-attribute", name);
+  }
 
-    if (len == -1) {
-      // no attribute
-      return NULL;
-    }
+  return attr;
+}
 
-    attr = g_slice_new(struct attribute);
-    attr->data = data;
-    attr->len = len;
+static struct attribute *get_attribute_by_id(struct ohandle *ohandle,
+                                             lf_attr_id_t id) {
+  struct attribute *attr = NULL;
 
-    g_hash_table_insert(ohandle->attributes, g_strdup(name), attr);
+  // look up in id table
+  if ((guint) id < ohandle->by_id->len) {
+    attr = g_ptr_array_index(ohandle->by_id, id);
+  }
+  if (attr != NULL) {
+    report_read(attr, "read-attribute-id", NULL, id);
+    return attr;
+  }
+
+  // the attribute may have been fetched by name
+  const char *name = g_ptr_array_index(interned_names, id);
+  attr = g_hash_table_lookup(ohandle->attributes, name);
+
+  if (attr != NULL) {
+    report_read(attr, "read-attribute-id", NULL, id);
+  } else {
+    // retrieve
+    uint64_t start = lf_span_begin();
+    lf_start_output();
+    lf_send_tag(lf_state.out, "get-attribute-id");
+    lf_send_int(lf_state.out, id);
+    lf_end_output();
+
+    attr = receive_attribute(ohandle, name);
+    lf_span_end(start, "get-attribute", name);
+  }
+
+  if (attr != NULL) {
+    if ((guint) id >= ohandle->by_id->len) {
+      g_ptr_array_set_size(ohandle->by_id, id + 1);
+    }
+    g_ptr_array_index(ohandle->by_id, id) = attr;
   }
 
   return attr;
@@ -112,14 +229,38 @@ void lf_log(int level, const char *fmt, ...) {
 }
 
 
-int lf_read_attr(lf_obj_handle_t obj, const char *name, size_t *len,
-		 void *data) {
+lf_attr_id_t lf_attr_intern(const char *name) {
   if (strlen(name) + 1 > MAX_ATTR_NAME) {
-    return EINVAL;
+    return -1;
   }
 
-  struct attribute *attr = get_attribute(obj, name);
+  if (interned_names == NULL) {
+    interned_names = g_ptr_array_new();
+    interned_ids = g_hash_table_new(g_str_hash, g_str_equal);
+  }
+
+  gpointer value = g_hash_table_lookup(interned_ids, name);
+  if (value != NULL) {
+    return GPOINTER_TO_INT(value) - 1;
+  }
+
+  char *copy = g_strdup(name);
+  lf_attr_id_t id = interned_names->len;
+  g_ptr_array_add(interned_names, copy);
+  g_hash_table_insert(interned_ids, copy, GINT_TO_POINTER(id + 1));
+
+  // tell the server; no reply
+  lf_start_output();
+  lf_send_tag(lf_state.out, "intern-attribute");
+  lf_send_int(lf_state.out, id);
+  lf_send_string(lf_state.out, copy);
+  lf_end_output();
+
+  return id;
+}
+
 
+static int copy_attribute(struct attribute *attr, size_t *len, void *data) {
   // found?
   if (attr == NULL) {
     return ENOENT;
@@ -139,21 +280,102 @@ int lf_read_attr(lf_obj_handle_t obj, const char *name, size_t *len,
 }
 
 
+static int ref_attribute(struct attribute *attr, size_t *len,
+			 const void **data) {
+  // found?
+  if (attr == NULL) {
+    return ENOENT;
+  }
+
+  *len = attr->len;
+  *data = attr->data;
+
+  return 0;
+}
+
+
+int lf_read_attr(lf_obj_handle_t obj, const char *name, size_t *len,
+		 void *data) {
+  if (strlen(name) + 1 > MAX_ATTR_NAME) {
+    return EINVAL;
+  }
+
+  return copy_attribute(get_attribute(obj, name), len, data);
+}
+
+
+int lf_read_attr_by_id(lf_obj_handle_t obj, lf_attr_id_t id, size_t *len,
+		       void *data) {
+  if (!valid_attr_id(id)) {
+    return EINVAL;
+  }
+
+  return copy_attribute(get_attribute_by_id(obj, id), len, data);
+}
+
+
 int lf_ref_attr(lf_obj_handle_t obj, const char *name, size_t *len,
 		const void **data) {
   if (strlen(name) + 1 > MAX_ATTR_NAME) {
     return EINVAL;
   }
 
-  struct attribute *attr = get_attribute(obj, name);
+  return ref_attribute(get_attribute(obj, name), len, data);
+}
 
-  // found?
-  if (attr == NULL) {
-    return ENOENT;
+
+int lf_ref_attr_by_id(lf_obj_handle_t obj, lf_attr_id_t id, size_t *len,
+		      const void **data) {
+  if (!valid_attr_id(id)) {
+    return EINVAL;
   }
 
-  *len = attr->len;
-  *data = attr->data;
+  return ref_attribute(get_attribute_by_id(obj, id), len, data);
+}
+
+int lf_read_attr_range(lf_obj_handle_t obj, const char *name, size_t offset,
+		       size_t *len, void *data) {
+  struct ohandle *ohandle = obj;
+
+  if (strlen(name) + 1 > MAX_ATTR_NAME) {
+    return EINVAL;
+  }
+  if (offset > (size_t) G_MAXINT || *len > (size_t) G_MAXINT) {
+    // too large for the protocol
+    return EINVAL;
+  }
+
+  // use our copy if we have one
+  struct attribute *attr = g_hash_table_lookup(ohandle->attributes, name);
+  if (attr != NULL) {
+    report_read(attr, "read-attribute", name, 0);
+    if (offset >= attr->len) {
+      *len = 0;
+    } else {
+      *len = MIN(*len, attr->len - offset);
+      memcpy(data, (uint8_t *) attr->data + offset, *len);
+    }
+    return 0;
+  }
+
+  // otherwise retrieve only the range, and don't keep it
+  uint64_t start = lf_span_begin();
+  lf_start_output();
+  lf_send_tag(lf_state.out, "get-attribute-range");
+  lf_send_string(lf_state.out, name);
+  lf_send_int(lf_state.out, offset);
+  lf_send_int(lf_state.out, *len);
+  lf_end_output();
+
+  int size;
+  void *buf = lf_get_binary(lf_state.in, &size);
+  lf_span_end(start, "get-attribute-range", name);
+  if (size == -1) {
+    return ENOENT;
+  }
+  *len = MIN(*len, (size_t) size);
+  memcpy(data, buf, *len);
+  g_free(buf);
 
   return 0;
 }
@@ -170,6 +392,25 @@ int lf_write_attr(lf_obj_handle_t ohandle, const char *name, size_t len,
   lf_send_binary(lf_state.out, len, data);
   lf_end_output();
 
+  store_attribute(ohandle, name, len, data);
+
+  return 0;
+}
+
+int lf_write_attr_by_id(lf_obj_handle_t ohandle, lf_attr_id_t id, size_t len,
+			const void *data) {
+  if (!valid_attr_id(id)) {
+    return EINVAL;
+  }
+
+  lf_start_output();
+  lf_send_tag(lf_state.out, "set-attribute-id");
+  lf_send_int(lf_state.out, id);
+  lf_send_binary(lf_state.out, len, data);
+  lf_end_output();
+
+  store_attribute(ohandle, g_ptr_array_index(interned_names, id), len, data);
+
   return 0;
 }
 
@@ -187,6 +428,169 @@ int lf_omit_attr(lf_obj_handle_t ohandle, const char *name) {
   return lf_get_boolean(lf_state.in) ? 0 : ENOENT;
 }
 
+int lf_omit_attr_by_id(lf_obj_handle_t ohandle, lf_attr_id_t id) {
+  if (!valid_attr_id(id)) {
+    return EINVAL;
+  }
+
+  lf_start_output();
+  lf_send_tag(lf_state.out, "omit-attribute-id");
+  lf_send_int(lf_state.out, id);
+  lf_end_output();
+
+  // server sends false if non-existent
+  return lf_get_boolean(lf_state.in) ? 0 : ENOENT;
+}
+
+
+// Encoded tensor header, followed by shape and strides as uint64_t[ndim]
+// each, then padding up to the payload offset
+struct tensor_header {
+  uint32_t magic;
+  uint32_t dtype;
+  uint32_t ndim;
+  uint32_t offset;	// of the payload, a multiple of LF_TENSOR_ALIGN
+};
+
+#define TENSOR_MAGIC 0x3154464c	// "LFT1" in little-endian order
+
+static size_t tensor_header_size(unsigned ndim) {
+  size_t len = sizeof(struct tensor_header) + 2 * ndim * sizeof(uint64_t);
+  return (len + LF_TENSOR_ALIGN - 1) & ~(size_t) (LF_TENSOR_ALIGN - 1);
+}
+
+// Number of payload bytes spanned by the tensor elements, 0 if empty, or
+// SIZE_MAX on overflow
+static size_t tensor_extent(const lf_tensor_t *tensor) {
+  size_t extent = lf_dtype_size(tensor->dtype);
+  for (unsigned i = 0; i < tensor->ndim; i++) {
+    if (tensor->shape[i] == 0) {
+      return 0;
+    }
+  }
+  for (unsigned i = 0; i < tensor->ndim; i++) {
+    size_t count = tensor->shape[i] - 1;
+    if (tensor->strides[i] != 0 &&
+        count > (SIZE_MAX - extent) / tensor->strides[i]) {
+      return SIZE_MAX;
+    }
+    extent += count * tensor->strides[i];
+  }
+  return extent;
+}
+
+size_t lf_dtype_size(lf_dtype_t dtype) {
+  switch (dtype) {
+  case LF_DTYPE_UINT8:
+  case LF_DTYPE_INT8:
+    return 1;
+  case LF_DTYPE_UINT16:
+  case LF_DTYPE_INT16:
+    return 2;
+  case LF_DTYPE_UINT32:
+  case LF_DTYPE_INT32:
+  case LF_DTYPE_FLOAT32:
+    return 4;
+  case LF_DTYPE_UINT64:
+  case LF_DTYPE_INT64:
+  case LF_DTYPE_FLOAT64:
+    return 8;
+  }
+  return 0;
+}
+
+int lf_tensor_init(lf_tensor_t *tensor, lf_dtype_t dtype, unsigned ndim,
+		   const size_t *shape, const void *data) {
+  size_t stride = lf_dtype_size(dtype);
+  if (stride == 0 || ndim > LF_TENSOR_MAX_DIMS) {
+    return EINVAL;
+  }
+
+  memset(tensor, 0, sizeof(*tensor));
+  tensor->dtype = dtype;
+  tensor->ndim = ndim;
+  tensor->data = data;
+  for (unsigned i = ndim; i > 0; i--) {
+    tensor->shape[i - 1] = shape[i - 1];
+    tensor->strides[i - 1] = stride;
+    stride *= shape[i - 1];
+  }
+
+  return 0;
+}
+
+int lf_ref_tensor(lf_obj_handle_t obj, const char *name,
+		  lf_tensor_t *tensor) {
+  if (strlen(name) + 1 > MAX_ATTR_NAME) {
+    return EINVAL;
+  }
+
+  struct attribute *attr = get_attribute(obj, name);
+  if (attr == NULL) {
+    return ENOENT;
+  }
+
+  // validate header
+  const struct tensor_header *hdr = attr->data;
+  if (attr->len < sizeof(*hdr) || hdr->magic != TENSOR_MAGIC ||
+      lf_dtype_size(hdr->dtype) == 0 || hdr->ndim > LF_TENSOR_MAX_DIMS ||
+      hdr->offset != tensor_header_size(hdr->ndim) ||
+      hdr->offset > attr->len) {
+    return EINVAL;
+  }
+
+  const uint64_t *dims = (const uint64_t *) (hdr + 1);
+  tensor->dtype = hdr->dtype;
+  tensor->ndim = hdr->ndim;
+  for (unsigned i = 0; i < hdr->ndim; i++) {
+    tensor->shape[i] = dims[i];
+    tensor->strides[i] = dims[hdr->ndim + i];
+  }
+  tensor->data = (const uint8_t *) attr->data + hdr->offset;
+
+  // the payload must cover every element
+  if (tensor_extent(tensor) > attr->len - hdr->offset) {
+    return EINVAL;
+  }
+
+  return 0;
+}
+
+int lf_write_tensor(lf_obj_handle_t obj, const char *name,
+		    const lf_tensor_t *tensor) {
+  if (lf_dtype_size(tensor->dtype) == 0 ||
+      tensor->ndim > LF_TENSOR_MAX_DIMS) {
+    return EINVAL;
+  }
+
+  size_t offset = tensor_header_size(tensor->ndim);
+  size_t extent = tensor_extent(tensor);
+  if (extent > (size_t) G_MAXINT - offset) {
+    // too large for the protocol
+    return EINVAL;
+  }
+  uint8_t *buf = g_malloc0(offset + extent);
+
+  struct tensor_header *hdr = (struct tensor_header *) buf;
+  hdr->magic = TENSOR_MAGIC;
+  hdr->dtype = tensor->dtype;
+  hdr->ndim = tensor->ndim;
+  hdr->offset = offset;
+  uint64_t *dims = (uint64_t *) (hdr + 1);
+  for (unsigned i = 0; i < tensor->ndim; i++) {
+    dims[i] = tensor->shape[i];
+    dims[tensor->ndim + i] = tensor->strides[i];
+  }
+  if (extent > 0) {
+    memcpy(buf + offset, tensor->data, extent);
+  }
+
+  int result = lf_write_attr(obj, name, offset + extent, buf);
+  g_free(buf);
+
+  return result;
+}
+
 int lf_get_session_variables(lf_obj_handle_t ohandle,
 			     lf_session_variable_t **list) {
   lf_start_output();
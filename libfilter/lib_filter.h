@@ -41,6 +41,7 @@
 
 
 #include <sys/types.h>		/* for size_t */
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -210,6 +211,59 @@ void lf_main_double(filter_init_proto init, filter_eval_double_proto eval);
     }
 
 
+/*!
+ * Version of struct lf_shared_filter.
+ */
+#define LF_SHARED_VERSION 1
+
+/*!
+ * Name of the symbol exported by filters built as shared objects.
+ */
+#define LF_SHARED_SYMBOL "lf_shared_filter_entry"
+
+/*!
+ * Entry points of a filter built as a shared object.  Shared-object
+ * filters are loaded by diamond-filter-host, which can run several
+ * filters of a search in one process and pass attributes between them
+ * in memory.  Exactly one of eval and eval_double is non-NULL.  Define
+ * this with LF_SHARED().
+ */
+struct lf_shared_filter {
+  unsigned version;
+  filter_init_proto init;
+  filter_eval_proto eval;
+  filter_eval_double_proto eval_double;
+};
+
+
+/*!
+ * A utility macro to export a Diamond filter from a shared object.  Use
+ * this instead of LF_MAIN() and link the filter with -shared.
+ *
+ * \param init
+ * 		The filter init function.
+ *
+ * \param eval
+ *		The filter evaluation function.  Can be either a
+ *		filter_eval_proto or a filter_eval_double_proto.
+ */
+#define LF_SHARED(init, eval)						\
+    /* Compile error if eval is not one of the two valid types. */	\
+    typedef char lf_shared_incorrect_eval_function_type[-1 +		\
+        __builtin_types_compatible_p(typeof(&eval),			\
+            filter_eval_proto) +					\
+        __builtin_types_compatible_p(typeof(&eval),			\
+            filter_eval_double_proto)];					\
+    diamond_public const struct lf_shared_filter lf_shared_filter_entry = { \
+        LF_SHARED_VERSION,						\
+        init,								\
+        __builtin_choose_expr(__builtin_types_compatible_p(		\
+            typeof(&eval), filter_eval_proto), eval, 0),		\
+        __builtin_choose_expr(__builtin_types_compatible_p(		\
+            typeof(&eval), filter_eval_double_proto), eval, 0),	\
+    }
+
+
 /*!
  * Read an attribute from the object into the buffer space provided
  * by the caller.  This does invoke a copy and for large structures
@@ -249,7 +303,8 @@ int lf_read_attr(lf_obj_handle_t ohandle, const char *name, size_t *len,
 /*!
  * Get pointer to attribute data in an object.  The returned pointer should
  * be treated read-only, and is only valid in the current instance of the
- * filter.  
+ * filter.  In diamond-filter-host, writing the attribute with
+ * lf_write_attr() invalidates pointers previously returned for it.
  * \param ohandle
  * 		the object handle.
  *
@@ -277,9 +332,53 @@ diamond_public
 int lf_ref_attr(lf_obj_handle_t ohandle, const char *name,
 		size_t *len, const void **data);
 
+/*!
+ * Read part of an attribute.  Unless this filter has already read or
+ * written the attribute, only the requested bytes are transferred from
+ * the server, so this is cheaper than lf_read_attr() for reading e.g.
+ * the header of a large object.  The object data is the attribute
+ * named "" (the empty string); if the server loads object data lazily
+ * and no other filter has read it, only the requested bytes are fetched
+ * from the dataretriever.
+ *
+ * \param ohandle
+ * 		the object handle.
+ *
+ * \param name
+ *		The name of the attribute to read.
+ *
+ * \param offset
+ *		The offset of the first byte to read.
+ *
+ * \param len
+ *		The caller sets this to the number of bytes to read.
+ *		Upon return this is set to the number of bytes actually
+ *		read, which is smaller if the range extends past the end
+ *		of the attribute.
+ *
+ * \param data
+ *		The location where the results should be stored.
+ *
+ * \return 0
+ *		The range was read successfully.
+ *
+ * \return ENOENT
+ *		The attribute was not found.
+ *
+ * \return EINVAL
+ *		One or more of the arguments was invalid, or offset or
+ *		len exceeds G_MAXINT.
+ */
+
+diamond_public
+int lf_read_attr_range(lf_obj_handle_t ohandle, const char *name,
+		       size_t offset, size_t *len, void *data);
+
 
 /*!
- * This function sets the some of the object's attributes.
+ * This function sets the some of the object's attributes.  data may
+ * point to a value returned by lf_ref_attr(); in diamond-filter-host,
+ * such pointers to the attribute are invalid once this returns.
  *
  * \param ohandle
  *		the object handle.
@@ -329,6 +428,319 @@ diamond_public
 int lf_omit_attr(lf_obj_handle_t ohandle, const char *name);
 
 
+/*!
+ * Handle for an interned attribute name.
+ */
+typedef int lf_attr_id_t;
+
+/*!
+ * This function interns an attribute name, returning a handle which
+ * can be passed to the _by_id variants of the attribute functions.
+ * These avoid the cost of validating, hashing and transmitting the
+ * name on each call.  Interning the same name again returns the
+ * same handle.  Handles are only valid within the current filter
+ * process.
+ *
+ * \param name
+ *		The attribute name.
+ *
+ * \return
+ *		A non-negative handle, or -1 if the name is invalid.
+ */
+
+diamond_public
+lf_attr_id_t lf_attr_intern(const char *name);
+
+/*!
+ * Equivalent to lf_read_attr(), but takes an interned attribute handle.
+ * Returns EINVAL if the handle is invalid.
+ */
+
+diamond_public
+int lf_read_attr_by_id(lf_obj_handle_t ohandle, lf_attr_id_t id,
+		       size_t *len, void *data);
+
+/*!
+ * Equivalent to lf_ref_attr(), but takes an interned attribute handle.
+ * Returns EINVAL if the handle is invalid.
+ */
+
+diamond_public
+int lf_ref_attr_by_id(lf_obj_handle_t ohandle, lf_attr_id_t id,
+		      size_t *len, const void **data);
+
+/*!
+ * Equivalent to lf_write_attr(), but takes an interned attribute handle.
+ * Returns EINVAL if the handle is invalid.
+ */
+
+diamond_public
+int lf_write_attr_by_id(lf_obj_handle_t ohandle, lf_attr_id_t id,
+			size_t len, const void *data);
+
+/*!
+ * Equivalent to lf_omit_attr(), but takes an interned attribute handle.
+ * Returns EINVAL if the handle is invalid.
+ */
+
+diamond_public
+int lf_omit_attr_by_id(lf_obj_handle_t ohandle, lf_attr_id_t id);
+
+
+/*!
+ * Element types of tensor attributes.
+ */
+typedef enum {
+  LF_DTYPE_UINT8 = 1,
+  LF_DTYPE_INT8,
+  LF_DTYPE_UINT16,
+  LF_DTYPE_INT16,
+  LF_DTYPE_UINT32,
+  LF_DTYPE_INT32,
+  LF_DTYPE_UINT64,
+  LF_DTYPE_INT64,
+  LF_DTYPE_FLOAT32,
+  LF_DTYPE_FLOAT64,
+} lf_dtype_t;
+
+/*!
+ * Maximum number of dimensions of a tensor attribute.
+ */
+#define LF_TENSOR_MAX_DIMS 8
+
+/*!
+ * Alignment, in bytes, of tensor payloads and attribute buffers.
+ */
+#define LF_TENSOR_ALIGN 64
+
+/*!
+ * A typed, strided array stored in an attribute.  The attribute value is
+ * a small header giving the dtype, shape and strides, followed by the
+ * payload at an offset that is a multiple of LF_TENSOR_ALIGN.  Attribute
+ * buffers in libdiamondfilter are LF_TENSOR_ALIGN-aligned and padded with
+ * zeroes to a multiple of LF_TENSOR_ALIGN bytes, so the data returned by
+ * lf_ref_tensor() can be read in whole vectors without copying.  The
+ * encoding uses host byte order.
+ */
+typedef struct {
+  lf_dtype_t dtype;
+  unsigned ndim;
+  size_t shape[LF_TENSOR_MAX_DIMS];
+  size_t strides[LF_TENSOR_MAX_DIMS];	/* in bytes */
+  const void *data;
+} lf_tensor_t;
+
+/*!
+ * Return the size in bytes of one element of the given type, or 0 if
+ * the type is invalid.
+ */
+
+diamond_public
+size_t lf_dtype_size(lf_dtype_t dtype);
+
+/*!
+ * Describe a C-contiguous array: fill in the tensor with the given type,
+ * shape and data, and with row-major strides.
+ *
+ * \return 0
+ *		Success.
+ *
+ * \return EINVAL
+ *		The type or number of dimensions is invalid.
+ */
+
+diamond_public
+int lf_tensor_init(lf_tensor_t *tensor, lf_dtype_t dtype, unsigned ndim,
+		   const size_t *shape, const void *data);
+
+/*!
+ * Obtain a reference to a tensor attribute.  tensor->data points into
+ * libdiamondfilter's copy of the attribute and is valid for the same
+ * period as a pointer returned by lf_ref_attr().  It is aligned to
+ * LF_TENSOR_ALIGN bytes.
+ *
+ * \param ohandle
+ * 		the object handle.
+ *
+ * \param name
+ *		The name of the attribute.
+ *
+ * \param tensor
+ *		The tensor description to fill in.
+ *
+ * \return 0
+ *		The tensor was found.
+ *
+ * \return ENOENT
+ *		The attribute was not found.
+ *
+ * \return EINVAL
+ *		The attribute is not a valid tensor, or the name is invalid.
+ */
+
+diamond_public
+int lf_ref_tensor(lf_obj_handle_t ohandle, const char *name,
+		  lf_tensor_t *tensor);
+
+/*!
+ * Write a tensor attribute.  The elements described by the shape and
+ * strides are copied, keeping the strides, so that readers see the
+ * same layout.
+ *
+ * \param ohandle
+ * 		the object handle.
+ *
+ * \param name
+ *		The name of the attribute.
+ *
+ * \param tensor
+ *		The tensor to write.
+ *
+ * \return 0
+ *		The attribute was written.
+ *
+ * \return EINVAL
+ *		The tensor description or the name is invalid.
+ */
+
+diamond_public
+int lf_write_tensor(lf_obj_handle_t ohandle, const char *name,
+		    const lf_tensor_t *tensor);
+
+
+/*!
+ * \defgroup kernels  Image and vector kernels
+ * Inner loops that filters commonly need, vectorized for the CPU the
+ * filter runs on.  On x86, SSE4.2 and AVX2 implementations are selected
+ * at first use according to the CPU's capabilities, with a portable
+ * scalar fallback; the DIAMOND_KERNEL_ISA environment variable or
+ * lf_kernel_select() may be used to override the choice.  Floating-point
+ * results may differ in the last bits between implementations because
+ * the order of summation differs.
+ *
+ * Image kernels operate on packed RGBX pixels, four bytes per pixel in
+ * the order red, green, blue, unused, as found after the header of an
+ * RGBImage attribute.
+ */
+
+/*!
+ * Return the name of the instruction set used by the kernels: "scalar",
+ * "sse4.2" or "avx2".
+ */
+
+diamond_public
+const char *lf_kernel_isa(void);
+
+/*!
+ * Select the implementation used by the kernels.
+ *
+ * \param isa
+ *		"scalar", "sse4.2" or "avx2", or NULL to restore the
+ *		automatic choice.
+ *
+ * \return 0
+ *		The implementation was selected.
+ *
+ * \return ENOTSUP
+ *		The implementation is unknown or not supported by this CPU.
+ */
+
+diamond_public
+int lf_kernel_select(const char *isa);
+
+/*!
+ * Add a joint color histogram of RGBX pixels to hist.  Each channel is
+ * quantized to bins levels, and the pixel is counted in bin
+ * (r * bins + g) * bins + b.  hist must have bins^3 entries; it is not
+ * cleared first, so a histogram can be accumulated over several calls.
+ *
+ * \param bins
+ *		Levels per channel; a power of two between 1 and 256.
+ *
+ * \return 0
+ *		Success.
+ *
+ * \return EINVAL
+ *		bins is invalid.
+ */
+
+diamond_public
+int lf_rgb_histogram(const void *pixels, size_t count, unsigned bins,
+		     uint32_t *hist);
+
+/*!
+ * Count the RGBX pixels whose red, green and blue values all lie within
+ * the corresponding inclusive ranges [lo, hi].
+ */
+
+diamond_public
+size_t lf_count_in_range(const void *pixels, size_t count,
+			 const uint8_t lo[3], const uint8_t hi[3]);
+
+/*!
+ * Compute the sums of one channel of an RGBX image over every
+ * win_width x win_height window.  out receives
+ * (width - win_width + 1) x (height - win_height + 1) sums in row-major
+ * order, the sum for the window whose top left pixel is (x, y) at index
+ * y * (width - win_width + 1) + x.
+ *
+ * \param stride
+ *		Distance in bytes between the starts of two image rows.
+ *
+ * \param channel
+ *		0 for red, 1 for green, 2 for blue.
+ *
+ * \return 0
+ *		Success.
+ *
+ * \return EINVAL
+ *		The channel is invalid, or the window is empty or larger
+ *		than the image.
+ */
+
+diamond_public
+int lf_window_sums(const void *pixels, size_t width, size_t height,
+		   size_t stride, unsigned channel, size_t win_width,
+		   size_t win_height, uint32_t *out);
+
+/*!
+ * Compute the squared Euclidean distance between query and each of count
+ * vectors of dim elements, stored consecutively, writing it to out.
+ */
+
+diamond_public
+void lf_l2_distances(const float *query, const float *vectors,
+		     size_t count, size_t dim, float *out);
+
+/*!
+ * Compute the cosine similarity between query and each of count vectors
+ * of dim elements, stored consecutively, writing it to out.  The
+ * similarity with a zero vector is 0.
+ */
+
+diamond_public
+void lf_cosine_similarities(const float *query, const float *vectors,
+			    size_t count, size_t dim, float *out);
+
+
+/*!
+ * Return nonzero if the evaluation of the current object has used up the
+ * CPU time budget set by the server.  Filters that can spend a long time on
+ * some objects should call this periodically and, once it returns
+ * nonzero, return from their eval function promptly.  The object is then
+ * reported as timed out, and the value returned by eval is ignored.  The
+ * server kills a filter whose evaluation runs for twice the budget in
+ * wall clock time.
+ *
+ * This function is async-signal-safe.  The budget is implemented with
+ * ITIMER_VIRTUAL, so filters must not use SIGVTALRM or ITIMER_VIRTUAL
+ * themselves when the server sets one.
+ */
+
+diamond_public
+int lf_deadline_expired(void);
+
+
 /*!
  * This function allows the programmer to log some data that
  * can be retrieved from the host system.
@@ -0,0 +1,95 @@
+/*
+ *  The OpenDiamond Platform for Interactive Search
+ *
+ *  Copyright (c) 2012 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  This software is distributed under the terms of the Eclipse Public
+ *  License, Version 1.0 which can be found in the file named LICENSE.
+ *  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+ *  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+ */
+
+#ifndef _LIB_FILTER_HPP_
+#define	_LIB_FILTER_HPP_
+
+/*!
+ * \file lib_filter.hpp
+ * \ingroup filter
+ * Header-only C++11 helpers for interned attribute handles.  An
+ * attribute name written as LF_ATTR("name") is hashed at compile time
+ * and interned on first use, so that later accesses through the
+ * diamond::attr functions cost only a load of a static variable:
+ *
+ *   size_t len;
+ *   const void *data;
+ *   diamond::ref_attr(ohandle, LF_ATTR("rgbimage"), &len, &data);
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lib_filter.h"
+
+namespace diamond {
+
+/*!
+ * 64-bit FNV-1a hash, usable in constant expressions.
+ */
+constexpr uint64_t attr_hash(const char *name,
+			     uint64_t hash = 14695981039346656037ULL) {
+  return *name ? attr_hash(name + 1,
+			   (hash ^ (unsigned char) *name) * 1099511628211ULL)
+    : hash;
+}
+
+constexpr size_t attr_length(const char *name) {
+  return *name ? 1 + attr_length(name + 1) : 0;
+}
+
+/*!
+ * Per-name storage for an interned handle.  The template arguments
+ * identify the name; the name itself is supplied on first use.
+ */
+template <uint64_t Hash, size_t Length>
+struct static_attr {
+  static lf_attr_id_t id(const char *name) {
+    static const lf_attr_id_t handle = lf_attr_intern(name);
+    static const char *const first = name;
+    // Catch (astronomically unlikely) hash collisions in debug builds
+    assert(first == name || strcmp(first, name) == 0);
+    (void) first;
+    return handle;
+  }
+};
+
+inline int read_attr(lf_obj_handle_t ohandle, lf_attr_id_t id,
+		     size_t *len, void *data) {
+  return lf_read_attr_by_id(ohandle, id, len, data);
+}
+
+inline int ref_attr(lf_obj_handle_t ohandle, lf_attr_id_t id,
+		    size_t *len, const void **data) {
+  return lf_ref_attr_by_id(ohandle, id, len, data);
+}
+
+inline int write_attr(lf_obj_handle_t ohandle, lf_attr_id_t id,
+		      size_t len, const void *data) {
+  return lf_write_attr_by_id(ohandle, id, len, data);
+}
+
+inline int omit_attr(lf_obj_handle_t ohandle, lf_attr_id_t id) {
+  return lf_omit_attr_by_id(ohandle, id);
+}
+
+}  // namespace diamond
+
+/*!
+ * Evaluates to the interned handle for the string literal name.
+ */
+#define LF_ATTR(name)							\
+  (::diamond::static_attr< ::diamond::attr_hash(name),			\
+   ::diamond::attr_length(name)>::id(name))
+
+#endif /* _LIB_FILTER_HPP_  */
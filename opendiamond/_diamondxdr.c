@@ -0,0 +1,334 @@
+/*
+ *  The OpenDiamond Platform for Interactive Search
+ *
+ *  Copyright (c) 2012 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  This software is distributed under the terms of the Eclipse Public
+ *  License, Version 1.0 which can be found in the file named LICENSE.
+ *  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+ *  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+ */
+
+/*
+ * Native helpers for opendiamond.xdr.  Encodes arrays of attributes as
+ * a list of strings which reference the attribute values rather than
+ * copying them, and transmits such a list with writev().
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define XDR_UNIT 4
+
+static const char zeroes[XDR_UNIT];
+
+static Py_ssize_t xdr_pad(Py_ssize_t len) {
+  return (XDR_UNIT - len % XDR_UNIT) % XDR_UNIT;
+}
+
+static char *put_uint(char *p, uint32_t val) {
+  p[0] = (char) (val >> 24);
+  p[1] = (char) (val >> 16);
+  p[2] = (char) (val >> 8);
+  p[3] = (char) val;
+  return p + XDR_UNIT;
+}
+
+static int check_length(Py_ssize_t len) {
+  if ((uint64_t) len > UINT32_MAX) {
+    PyErr_SetString(PyExc_ValueError, "Value too long for XDR");
+    return -1;
+  }
+  return 0;
+}
+
+static int append_steal(PyObject *list, PyObject *item) {
+  int ret;
+
+  if (item == NULL) {
+    return -1;
+  }
+  ret = PyList_Append(list, item);
+  Py_DECREF(item);
+  return ret;
+}
+
+/*
+ * Build the framing between the previous value and the next one: the
+ * padding of the previous value, the XDR string holding the attribute
+ * name, and the length word of the next value.
+ */
+static PyObject *make_separator(Py_ssize_t prev_pad, PyObject *name,
+				Py_ssize_t value_len) {
+  Py_ssize_t name_len = PyString_GET_SIZE(name);
+  Py_ssize_t len = prev_pad + XDR_UNIT + name_len + xdr_pad(name_len) +
+    XDR_UNIT;
+  PyObject *sep;
+  char *p;
+
+  sep = PyString_FromStringAndSize(NULL, len);
+  if (sep == NULL) {
+    return NULL;
+  }
+  p = PyString_AS_STRING(sep);
+  memset(p, 0, prev_pad);
+  p += prev_pad;
+  p = put_uint(p, (uint32_t) name_len);
+  memcpy(p, PyString_AS_STRING(name), name_len);
+  p += name_len;
+  memset(p, 0, xdr_pad(name_len));
+  p += xdr_pad(name_len);
+  put_uint(p, (uint32_t) value_len);
+  return sep;
+}
+
+static PyObject *encode_attributes(PyObject *self, PyObject *args) {
+  const char *head;
+  Py_ssize_t head_len;
+  PyObject *attrs;
+  Py_ssize_t max_name = -1;
+  PyObject *seq = NULL;
+  PyObject *result = NULL;
+  PyObject *name = NULL;
+  PyObject *value = NULL;
+  PyObject *piece;
+  Py_ssize_t count;
+  Py_ssize_t prev_pad = 0;
+  Py_ssize_t i;
+  char *p;
+
+  if (!PyArg_ParseTuple(args, "s#O|n:encode_attributes", &head, &head_len,
+			&attrs, &max_name)) {
+    return NULL;
+  }
+  seq = PySequence_Fast(attrs, "attributes must be a sequence");
+  if (seq == NULL) {
+    return NULL;
+  }
+  count = PySequence_Fast_GET_SIZE(seq);
+  if (check_length(count)) {
+    goto out;
+  }
+  result = PyList_New(0);
+  if (result == NULL) {
+    goto out;
+  }
+
+  // Head and array length
+  piece = PyString_FromStringAndSize(NULL, head_len + XDR_UNIT);
+  if (piece != NULL) {
+    p = PyString_AS_STRING(piece);
+    memcpy(p, head, head_len);
+    put_uint(p + head_len, (uint32_t) count);
+  }
+  if (append_steal(result, piece)) {
+    goto fail;
+  }
+
+  for (i = 0; i < count; i++) {
+    PyObject *attr = PySequence_Fast_GET_ITEM(seq, i);
+
+    name = PyObject_GetAttrString(attr, "name");
+    if (name == NULL) {
+      goto fail;
+    }
+    value = PyObject_GetAttrString(attr, "value");
+    if (value == NULL) {
+      goto fail;
+    }
+    if (!PyString_Check(name) || !PyString_Check(value)) {
+      PyErr_SetString(PyExc_ValueError, "Attribute name and value must "
+		      "be strings");
+      goto fail;
+    }
+    if (max_name >= 0 && PyString_GET_SIZE(name) > max_name) {
+      PyErr_SetString(PyExc_ValueError, "Attribute name too long");
+      goto fail;
+    }
+    if (check_length(PyString_GET_SIZE(name)) ||
+	check_length(PyString_GET_SIZE(value))) {
+      goto fail;
+    }
+
+    if (append_steal(result, make_separator(prev_pad, name,
+					    PyString_GET_SIZE(value)))) {
+      goto fail;
+    }
+    // Reference the value itself; no copy
+    if (PyString_GET_SIZE(value) > 0 && PyList_Append(result, value)) {
+      goto fail;
+    }
+    prev_pad = xdr_pad(PyString_GET_SIZE(value));
+    Py_CLEAR(name);
+    Py_CLEAR(value);
+  }
+
+  if (prev_pad > 0 &&
+      append_steal(result, PyString_FromStringAndSize(zeroes, prev_pad))) {
+    goto fail;
+  }
+  goto out;
+
+fail:
+  Py_CLEAR(result);
+out:
+  Py_XDECREF(name);
+  Py_XDECREF(value);
+  Py_DECREF(seq);
+  return result;
+}
+
+// Wait up to timeout_ms, or forever if negative, for fd to become
+// writable.  Returns -1 with errno set to ETIMEDOUT if it does not.
+static int wait_writable(int fd, int timeout_ms) {
+  struct pollfd pfd = {
+    .fd = fd,
+    .events = POLLOUT,
+  };
+  int ret;
+
+  do {
+    ret = poll(&pfd, 1, timeout_ms);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == 0) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return ret == -1 ? -1 : 0;
+}
+
+static PyObject *sendv(PyObject *self, PyObject *args) {
+  int fd;
+  PyObject *pieces;
+  PyObject *seq;
+  struct iovec *iov = NULL;
+  struct iovec *cur;
+  Py_ssize_t count;
+  Py_ssize_t remaining;
+  Py_ssize_t total = 0;
+  Py_ssize_t i;
+  ssize_t ret;
+  int saved_errno = 0;
+  double timeout = -1;
+  int timeout_ms;
+
+  if (!PyArg_ParseTuple(args, "iO|d:sendv", &fd, &pieces, &timeout)) {
+    return NULL;
+  }
+  // Like a Python socket timeout, this limits each wait for the socket
+  // to accept more data
+  if (timeout < 0) {
+    timeout_ms = -1;
+  } else if (timeout * 1000 >= INT_MAX) {
+    timeout_ms = INT_MAX;
+  } else {
+    // Round up, so that short timeouts still wait
+    timeout_ms = (int) (timeout * 1000);
+    if (timeout_ms < timeout * 1000) {
+      timeout_ms++;
+    }
+  }
+  seq = PySequence_Fast(pieces, "pieces must be a sequence");
+  if (seq == NULL) {
+    return NULL;
+  }
+  count = PySequence_Fast_GET_SIZE(seq);
+  iov = PyMem_New(struct iovec, count > 0 ? count : 1);
+  if (iov == NULL) {
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+  for (i = 0; i < count; i++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+    if (!PyString_Check(item)) {
+      PyErr_SetString(PyExc_TypeError, "pieces must be strings");
+      goto fail;
+    }
+    iov[i].iov_base = PyString_AS_STRING(item);
+    iov[i].iov_len = PyString_GET_SIZE(item);
+    total += iov[i].iov_len;
+  }
+
+  // seq keeps the strings alive while the GIL is released
+  cur = iov;
+  remaining = count;
+  Py_BEGIN_ALLOW_THREADS
+  while (remaining > 0) {
+    if (cur->iov_len == 0) {
+      cur++;
+      remaining--;
+      continue;
+    }
+    ret = writev(fd, cur, remaining < IOV_MAX ? remaining : IOV_MAX);
+    if (ret == -1) {
+      if (errno == EINTR) {
+	continue;
+      } else if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+		 timeout_ms != 0 && wait_writable(fd, timeout_ms) == 0) {
+	continue;
+      }
+      saved_errno = errno;
+      break;
+    }
+    // Skip completed buffers, then advance into a partial one
+    while (remaining > 0 && (size_t) ret >= cur->iov_len) {
+      ret -= cur->iov_len;
+      cur++;
+      remaining--;
+    }
+    if (remaining > 0) {
+      cur->iov_base = (char *) cur->iov_base + ret;
+      cur->iov_len -= ret;
+    }
+  }
+  Py_END_ALLOW_THREADS
+
+  if (saved_errno) {
+    errno = saved_errno;
+    PyErr_SetFromErrno(PyExc_OSError);
+    goto fail;
+  }
+  PyMem_Del(iov);
+  Py_DECREF(seq);
+  return PyInt_FromSsize_t(total);
+
+fail:
+  PyMem_Del(iov);
+  Py_DECREF(seq);
+  return NULL;
+}
+
+static PyMethodDef methods[] = {
+  {"encode_attributes", encode_attributes, METH_VARARGS,
+   "encode_attributes(head, attrs[, max_name_length]) -> list of strings\n\n"
+   "Encode head followed by an XDR array of (string name, opaque value)\n"
+   "structs from the name and value attributes of attrs.  Values are\n"
+   "included in the result by reference."},
+  {"sendv", sendv, METH_VARARGS,
+   "sendv(fd, pieces[, timeout]) -> int\n\n"
+   "Write the concatenation of the strings in pieces to fd with writev()\n"
+   "and return the number of bytes written.  If fd is non-blocking, wait\n"
+   "up to timeout seconds, or forever if negative, each time it is not\n"
+   "writable, and fail with ETIMEDOUT after that."},
+  {NULL, NULL, 0, NULL}
+};
+
+/* AM_CFLAGS hides symbols by default */
+PyMODINIT_FUNC init_diamondxdr(void) __attribute__((visibility("default")));
+
+PyMODINIT_FUNC init_diamondxdr(void) {
+  Py_InitModule3("_diamondxdr", methods,
+		 "Native XDR encoding helpers for OpenDiamond.");
+}
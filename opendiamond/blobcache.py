@@ -54,9 +54,12 @@ class BlobCache(object):
     def __init__(self, basedir, digest='md5'):
         self.basedir = basedir
         self.digest = digest
-        # Ensure _executable_dir is inside the search-specific tempdir
+        # Ensure _executable_dir and _data_dir are inside the
+        # search-specific tempdir
         self._executable_dir = mkdtemp(dir=os.environ.get('TMPDIR'),
                                         prefix='executable-')
+        self._data_dir = mkdtemp(dir=os.environ.get('TMPDIR'),
+                                        prefix='data-')
 
     def _path(self, sig):
         return os.path.join(self.basedir, sig.lower())
@@ -129,8 +132,23 @@ class BlobCache(object):
         bit is set in the filesystem.  The path is guaranteed to be valid
         for the lifetime of the search, even in the presence of
         garbage-collection.'''
+        return self._link(sig, self._executable_dir, 0500)
+
+    def data_path(self, sig):
+        '''Return a path to a read-only file containing the specified data,
+        e.g. so that filter processes can map it.  When possible, the file
+        is a hard link to the cache entry, so processes mapping it share
+        its pages.  The path is guaranteed to be valid for the lifetime of
+        the search, even in the presence of garbage-collection.'''
+        return self._link(sig, self._data_dir)
+
+    def _link(self, sig, dir, mode=None):
+        '''Return the path to a file in dir containing the specified data,
+        creating it if necessary.  If mode is specified, the file is given
+        that mode; otherwise it keeps the read-only mode of the cache
+        entry.'''
         src = self._path(sig)
-        dest = os.path.join(self._executable_dir, sig)
+        dest = os.path.join(dir, sig)
         def make_dest():
             # Link the blob into a temporary directory.  This directory will
             # normally (but need not always) be deleted by the supervisor when
@@ -140,15 +158,18 @@ class BlobCache(object):
                 # destination not to exist.  If someone else wins the race
                 # to create the same file we'll simply fall back to
                 # copying it.
-                dest_tmp = mktemp(dir=self._executable_dir)
+                dest_tmp = mktemp(dir=dir)
                 os.link(src, dest_tmp)
             except OSError:
-                # self._executable_dir may be on a different filesystem
-                # than self.basedir.  Try copying the file instead.
-                fd, dest_tmp = mkstemp(dir=self._executable_dir)
+                # dir may be on a different filesystem than self.basedir.
+                # Try copying the file instead.
+                fd, dest_tmp = mkstemp(dir=dir)
                 os.close(fd)
                 shutil.copyfile(src, dest_tmp)
-            os.chmod(dest_tmp, 0500)
+                if mode is None:
+                    os.chmod(dest_tmp, 0400)
+            if mode is not None:
+                os.chmod(dest_tmp, mode)
             os.rename(dest_tmp, dest)
         self._access(sig)
         if not os.path.exists(dest):
@@ -100,8 +100,15 @@ class DiamondConfig(object):
             ## diamondd
             # Cache directory expiration
             _Param('blob_cache_days', 'BLOBDAYS', 30),
+            # Key filter results by object data rather than object ID
+            _Param('cache_content_addressed', 'CACHECONTENT', False),
             # Redis database
             _Param('cache_database', 'CACHEDB', 0),
+            # Expected number of keys in the Redis database.  If nonzero,
+            # searches keep a Bloom filter of the keys, saved in CACHEDIR
+            # between searches, so that they can skip lookups that would
+            # miss.  Unused while the database holds more keys.
+            _Param('cache_key_filter', 'CACHEKEYS', 0),
             # Redis password
             _Param('cache_password', 'CACHEPASSWD', None),
             # Redis host and port
@@ -121,18 +128,96 @@ class DiamondConfig(object):
             _Param('debug_command', None, 'valgrind'),
             # Names or signatures of filters to run under a debugger
             _Param('debug_filters', None, []),
+            # Per-object filter time budget (ms), or 0 for none.  Objects
+            # exceeding it are dropped; filters still running after twice
+            # the budget are killed.
+            _Param('filter_deadline_ms', 'DEADLINE', 0),
+            # Program that runs filters built as shared objects
+            _Param('filter_host', 'FILTERHOST', 'diamond-filter-host'),
+            # Keep the idle filter processes of finished searches for reuse
+            # by later searches with the same filter code, arguments, and
+            # blob argument
+            _Param('filter_pool', 'FILTERPOOL', False),
+            # Where pooled filter processes run
+            _Param('filter_pool_dir', 'POOLDIR',
+                                os.path.join(confdir, 'pool')),
+            # Seconds an unused pooled process is kept
+            _Param('filter_pool_idle', 'POOLIDLE', 300),
+            # Resident memory of pooled processes (MB), beyond which the
+            # least recently used are killed
+            _Param('filter_pool_mb', 'POOLMB', 1024),
+            # Names or signatures of shared-object filters to run in their
+            # own host process
+            _Param('isolated_filters', 'ISOLATEFILTER', []),
+            # Fetch only the attributes of objects up front, and their data
+            # when a filter or the client first needs it.  Costs an extra
+            # request per object whose data is needed.
+            _Param('lazy_data', 'LAZYDATA', False),
             # Number of days of logfiles to keep
             _Param('logdays', 'LOGDAYS', 14),
+            # Maximum worker threads per child process.  If greater than
+            # THREADS, searches start THREADS active workers and adjust the
+            # number to throughput between MINTHREADS and MAXTHREADS.
+            _Param('max_threads', 'MAXTHREADS', 0),
+            # Attribute memory of in-flight objects per search (MB), beyond
+            # which workers stop starting new objects; 0 for no limit
+            _Param('memory_budget_mb', 'MEMBUDGET', 0),
             # Directory for logfiles
             _Param('logdir', 'LOGDIR', os.path.join(confdir, 'log')),
+            # Minimum active worker threads when adjusting to throughput
+            _Param('min_threads', 'MINTHREADS', 1),
+            # Objects fetched per request from dataretrievers that support
+            # batching; 1 to disable
+            _Param('object_batch', 'OBJECTBATCH', 32),
+            # Record the progress of one object in N through the search
+            # pipeline to a Chrome trace file in TRACEDIR; 0 to disable
+            _Param('object_trace', 'OBJECTTRACE', 0),
             # Don't fork when a connection arrives
             _Param('oneshot', None, False),
             # HTTP proxy
             _Param('http_proxy', 'HTTP_PROXY', None),
+            # Listen port; clients expect the default
+            _Param('port', 'PORT', 5872),
+            # Pin worker threads and their filters: none, core, or node
+            _Param('placement', 'PLACEMENT', 'none'),
+            # CPU sets for placement, e.g. 0-5,12-17; one per occurrence
+            _Param('placement_cpus', 'PLACEMENTCPUS', []),
+            # Start the reexecution filters with the search rather than on
+            # the first reexecution request.  Makes the first request
+            # faster, but starts every filter twice for each search.
+            _Param('reexecute_prestart', 'REEXECPRESTART', False),
+            # Reexecution latency target (ms); slower requests are logged
+            _Param('reexecute_target_ms', 'REEXECTARGET', 250),
+            # Scope lists fetched and parsed concurrently per search
+            _Param('scope_fetchers', 'SCOPEFETCHERS', 4),
+            # Parsed objects buffered ahead of the worker threads
+            _Param('scope_queue', 'SCOPEQUEUE', 1024),
+            # Append JSON search statistics to this file when a search ends
+            _Param('stats_file', 'STATSFILE', None),
+            # Share the scope with the other servers of a search: fetch
+            # scope indexes in parts, and let idle servers steal the parts
+            # that busy ones have not reached
+            _Param('steal', 'STEAL', False),
+            # Where searches register to receive steal requests
+            _Param('steal_dir', 'STEALDIR', os.path.join(confdir, 'steal')),
+            # Parts per scope index
+            _Param('steal_parts', 'STEALPARTS', 16),
+            # Peers as host[:port]; by default, the other servers named in
+            # the scope cookies
+            _Param('steal_peers', 'STEALPEER', []),
+            # Supervisor port for steal lookups
+            _Param('steal_port', 'STEALPORT', 5874),
+            # Base URL at which peers reach our dataretriever; by default,
+            # port 5873 of our canonical server ID
+            _Param('steal_retriever', 'STEALRETRIEVER', None),
             # Canonical server names
             _Param('serverids', 'SERVERID', []),
             # Worker threads per child process
             _Param('threads', 'THREADS', default_threads),
+            # Where to write filter session traces
+            _Param('trace_dir', 'TRACEDIR', os.path.join(confdir, 'trace')),
+            # Names or signatures of filters whose sessions are traced
+            _Param('trace_filters', 'TRACEFILTER', []),
             # HTTP user agent
             _Param('user_agent', None, 'OpenDiamond/%s'
                                         % opendiamond.__version__),
@@ -239,6 +324,8 @@ class DiamondConfig(object):
         # Canonicalize debug options
         self.debug_filters = set(self.debug_filters)
         self.debug_command = self.debug_command.split(None)
+        self.isolated_filters = set(self.isolated_filters)
+        self.trace_filters = set(self.trace_filters)
 
         # Set default dataretriever stores
         if not self.retriever_stores:
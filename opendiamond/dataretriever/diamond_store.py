@@ -21,15 +21,19 @@ OBJECT_URI = 'obj'
 STYLE = False
 
 from datetime import datetime, timedelta
-from opendiamond.dataretriever.util import guess_mime_type
+from opendiamond.dataretriever.util import guess_mime_type, parse_range
 from opendiamond.config import DiamondConfig
+from opendiamond.helpers import md5
+from opendiamond import objectbatch, scopeindex
 from wsgiref.util import shift_path_info
-from urllib import quote
+from urllib import quote, unquote
+from cgi import parse_qs
+from tempfile import gettempdir, mkstemp
 import rfc822
 import os
 import re
 
-__all__ = ['scope_app', 'object_app']
+__all__ = ['scope_app', 'object_app', 'batch_app']
 baseurl = 'collection'
 
 
@@ -47,34 +51,95 @@ def diamond_textattr(path):
     except IOError:
 	pass
 
-def GIDIDXParser(index):
+def GIDIDXObjects(index):
     f = open(index, 'r')
-    nentries = 0
-    for line in f:
-	nentries = nentries + 1
-    f.close();
+    for path in f:
+	yield '%s/%s' % (OBJECT_URI, quote(path.strip()))
+    f.close()
+
+# Binary scope indexes are built once per GIDIDX file and kept next to it,
+# or in the temporary directory if INDEXDIR is not writable.  A stale index
+# is rebuilt when the GIDIDX file is newer.
+def GIDIDXScopeIndex(index):
+    mtime = os.stat(index).st_mtime
+    candidates = [index + '.dsci', os.path.join(gettempdir(),
+		'diamond-%s.dsci' % md5(os.path.abspath(index)).hexdigest())]
+    for path in candidates:
+	try:
+	    if os.stat(path).st_mtime >= mtime:
+		return path
+	except OSError:
+	    pass
+    for path in candidates:
+	try:
+	    fd, tmp = mkstemp(dir=os.path.dirname(path), prefix='.dsci-')
+	except OSError:
+	    continue
+	try:
+	    f = os.fdopen(fd, 'wb')
+	    scopeindex.write_index(f, GIDIDXObjects(index))
+	    f.close()
+	    os.rename(tmp, path)
+	except:
+	    os.unlink(tmp)
+	    raise
+	return path
+    raise IOError('Cannot create scope index for ' + index)
+
+def GIDIDXParser(index):
+    # The binary index header saves us a pass over the GIDIDX file to
+    # count its entries.
+    f = open(GIDIDXScopeIndex(index), 'rb')
+    nentries = scopeindex.ScopeIndexHeader.read(f).total
+    f.close()
 
-    f = open(index, 'r')
     yield '<?xml version="1.0" encoding="UTF-8" ?>\n'
     if STYLE:
 	yield '<?xml-stylesheet type="text/xsl" href="/scopelist.xsl" ?>\n'
     yield '<objectlist count="%d">\n' % nentries
-    for path in f:
-	yield '<object src="%s/%s" />\n' % (OBJECT_URI, quote(path.strip()))
+    for url in GIDIDXObjects(index):
+	yield '<object src="%s" />\n' % url
     yield '</objectlist>'
-    f.close()
+
+def GIDIDXPart(index, part, parts):
+    f = open(GIDIDXScopeIndex(index), 'rb')
+    try:
+	for buf in scopeindex.iter_part(f, part, parts):
+	    yield buf
+    finally:
+	f.close()
 
 
+# The binary format is returned when the client asks for it with an Accept
+# header or with ?format=binary.  ?part=N&parts=M selects one of M
+# roughly equal slices of the index.
 def scope_app(environ, start_response):
     root = shift_path_info(environ)
     if root == 'obj':
 	return object_app(environ, start_response)
+    if root == 'batch':
+	return batch_app(environ, start_response)
 
     index = 'GIDIDX' + root.upper()
     index = os.path.join(INDEXDIR, index)
 
-    start_response("200 OK", [('Content-Type', "text/xml")])
-    return GIDIDXParser(index)
+    query = parse_qs(environ.get('QUERY_STRING', ''))
+    binary = (scopeindex.MIME_TYPE in environ.get('HTTP_ACCEPT', '') or
+	      query.get('format') == ['binary'])
+    if not binary:
+	start_response("200 OK", [('Content-Type', "text/xml")])
+	return GIDIDXParser(index)
+
+    try:
+	part = int(query.get('part', ['0'])[0])
+	parts = int(query.get('parts', ['1'])[0])
+	if parts < 1 or part < 0 or part >= parts:
+	    raise ValueError()
+    except ValueError:
+	start_response("400 Bad Request", [('Content-Type', "text/plain")])
+	return ['Invalid part specification']
+    start_response("200 OK", [('Content-Type', scopeindex.MIME_TYPE)])
+    return GIDIDXPart(index, part, parts)
 
 
 # Get file handle and attributes for a Diamond object
@@ -90,7 +155,9 @@ def object_app(environ, start_response):
 	       ('Content-Length', str(stat.st_size)),
 	       ('Last-Modified', rfc822.formatdate(stat.st_mtime)),
 	       ('Expires', expirestr),
-	       ('ETag', etag)]
+	       ('ETag', etag),
+	       ('Accept-Ranges', 'bytes'),
+	       (objectbatch.BATCH_HEADER, '/%s/batch' % baseurl)]
 
     for key, value in diamond_textattr(path):
 	# we probably should filter out invalid characters for HTTP headers
@@ -104,8 +171,79 @@ def object_app(environ, start_response):
 	start_response("304 Not Modified", headers)
 	return [""]
 
-    start_response("200 OK", headers)
-    # wrap the file object in an iterator that reads the file in 64KB blocks
-    # instead of line-by-line.
-    return environ['wsgi.file_wrapper'](f, 65536)
+    # headers and attributes only; the client fetches the data if it
+    # turns out to need it
+    if environ.get('REQUEST_METHOD') == 'HEAD':
+	f.close()
+	start_response("200 OK", headers)
+	return [""]
 
+    # serve a single byte range if asked, unless If-Range says that the
+    # client's copy is stale
+    status = "200 OK"
+    start, length = 0, stat.st_size
+    byte_range = environ.get('HTTP_RANGE')
+    if_range = environ.get('HTTP_IF_RANGE')
+    if byte_range and (not if_range or if_range == etag):
+	try:
+	    byte_range = parse_range(byte_range, stat.st_size)
+	except ValueError:
+	    f.close()
+	    start_response("416 Requested Range Not Satisfiable",
+			   [('Content-Range', 'bytes */%d' % stat.st_size)])
+	    return [""]
+	if byte_range is not None:
+	    start, length = byte_range
+	    status = "206 Partial Content"
+	    headers = [h for h in headers if h[0] != 'Content-Length']
+	    headers.extend([('Content-Length', str(length)),
+			    ('Content-Range', 'bytes %d-%d/%d' %
+			     (start, start + length - 1, stat.st_size))])
+	    f.seek(start)
+
+    start_response(status, headers)
+    # wrap the file object in an iterator that sends the requested part of
+    # the file, in 64KB blocks or directly from the kernel.
+    return environ['wsgi.file_wrapper'](f, 65536, length)
+
+
+
+def BatchObjects(paths):
+    yield objectbatch.encode_header()
+    for path in paths:
+	try:
+	    f = open(path, 'rb')
+	    try:
+		data = f.read()
+	    finally:
+		f.close()
+	except IOError:
+	    yield objectbatch.encode_missing()
+	    continue
+	yield objectbatch.encode_record(list(diamond_textattr(path)),
+		len(data))
+	yield data
+
+# Return many objects and their attributes in one response.  The request
+# body lists object URLs relative to the batch URL, one per line.
+def batch_app(environ, start_response):
+    if environ['REQUEST_METHOD'] != 'POST':
+	start_response("405 Method Not Allowed", [('Content-Type', "text/plain"),
+						  ('Allow', 'POST')])
+	return ['Batch requests must use POST']
+
+    try:
+	length = int(environ.get('CONTENT_LENGTH') or 0)
+    except ValueError:
+	length = 0
+    paths = []
+    for url in environ['wsgi.input'].read(length).splitlines():
+	comp = [p for p in unquote(url.strip()).split('/')
+		if p not in ('', '.', '..')]
+	if not comp or comp[0] != OBJECT_URI:
+	    start_response("400 Bad Request", [('Content-Type', "text/plain")])
+	    return ['Invalid object URL: ' + url]
+	paths.append(os.path.join(DATAROOT, *comp[1:]))
+
+    start_response("200 OK", [('Content-Type', objectbatch.MIME_TYPE)])
+    return BatchObjects(paths)
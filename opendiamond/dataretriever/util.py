@@ -13,14 +13,34 @@
 # Helper functions for an OpenDiamond DataRetriever WSGI application
 #
 
-__all__ = ["guess_mime_type", "DataRetriever"]
+__all__ = ["guess_mime_type", "parse_range", "FileRange", "DataRetriever",
+	   "SENDFILE_HANDLER"]
 
+from ctypes import CDLL, POINTER, byref, c_int, c_int64, c_size_t, \
+	c_ssize_t, get_errno
+import errno
+from functools import partial
+import os
 import posixpath
 import mimetypes
-from wsgiref.util import FileWrapper, shift_path_info
+import re
+import select
+import socket
+from wsgiref.util import shift_path_info
 
 from opendiamond.helpers import connection_ok
 
+# environ key for the server's request handler, if the server allows
+# FileRange to write to its connection
+SENDFILE_HANDLER = 'opendiamond.sendfile_handler'
+
+try:
+    _sendfile = CDLL('libc.so.6', use_errno=True).sendfile64
+    _sendfile.argtypes = [c_int, c_int, POINTER(c_int64), c_size_t]
+    _sendfile.restype = c_ssize_t
+except (OSError, AttributeError):
+    _sendfile = None
+
 # the following mime type guessing is from SimpleHTTPServer.py
 if not mimetypes.inited:
     mimetypes.init()
@@ -37,6 +57,95 @@ def guess_mime_type(path):
     else:
 	return extensions['']
 
+# Parse an HTTP Range header for a resource of the given size.  Returns
+# (start, length) for a single byte range, or None if the header should be
+# ignored.  Raises ValueError if the range is unsatisfiable.
+def parse_range(header, size):
+    m = re.match(r'^bytes=(\d*)-(\d*)$', header.strip())
+    if not m or m.groups() == ('', ''):
+	# Malformed, or a multiple-range request; serve the whole thing
+	return None
+    first, last = m.groups()
+    if first == '':
+	# The last N bytes
+	length = min(int(last), size)
+	if length == 0:
+	    raise ValueError('Empty suffix range')
+	return size - length, length
+    first = int(first)
+    if last != '' and int(last) < first:
+	return None
+    if first >= size:
+	raise ValueError('Range starts past end of file')
+    if last == '':
+	last = size - 1
+    return first, min(int(last), size - 1) - first + 1
+
+# WSGI file wrapper returning length bytes of a file, or the rest of it,
+# from the current position.  Given the request handler of a Paste HTTP
+# server, it writes the response headers itself and then has the kernel
+# copy the data from the file to the socket with sendfile(), instead of
+# passing it through Python in blocks.
+class FileRange:
+    def __init__(self, filelike, blksize=65536, length=None, handler=None):
+	self.filelike = filelike
+	self.blksize = blksize
+	self.length = length
+	self.handler = handler
+	if hasattr(filelike, 'close'):
+	    self.close = filelike.close
+
+    def __iter__(self):
+	remaining = self.length
+	if remaining is None and hasattr(self.filelike, 'fileno'):
+	    remaining = (os.fstat(self.filelike.fileno()).st_size -
+			 self.filelike.tell())
+	if (self.handler is not None and _sendfile is not None and
+		remaining is not None and hasattr(self.filelike, 'fileno') and
+		isinstance(self.handler.connection, socket.socket)):
+	    remaining = self._sendfile(remaining)
+	while remaining is None or remaining > 0:
+	    count = self.blksize
+	    if remaining is not None:
+		count = min(count, remaining)
+		remaining -= count
+	    data = self.filelike.read(count)
+	    if not data:
+		break
+	    yield data
+
+    # Returns the number of bytes left to send by other means
+    def _sendfile(self, remaining):
+	handler = self.handler
+	# Send the status line and headers and flush them past the buffer
+	handler.wsgi_write_chunk('')
+	handler.wfile.flush()
+	sock = handler.connection
+	offset = c_int64(self.filelike.tell())
+	while remaining > 0:
+	    count = _sendfile(sock.fileno(), self.filelike.fileno(),
+			      byref(offset), min(remaining, 1 << 30))
+	    if count > 0:
+		remaining -= count
+	    elif count == 0:
+		# The file was truncated
+		break
+	    else:
+		err = get_errno()
+		if err == errno.EINTR:
+		    continue
+		elif err == errno.EAGAIN:
+		    # The socket has a timeout, and so is non-blocking
+		    if not select.select([], [sock], [], sock.gettimeout())[1]:
+			raise socket.timeout('timed out')
+		elif err in (errno.EINVAL, errno.ENOSYS):
+		    # Not supported for this file; copy it instead
+		    break
+		else:
+		    raise IOError(err, os.strerror(err))
+	self.filelike.seek(offset.value)
+	return remaining
+
 # return xslt stylesheet which makes browsers show the scope list as thumbnails.
 # guaranteed to bring chaos with any decent data set.
 def scopelist_xsl(environ, start_response):
@@ -79,7 +188,9 @@ class DataRetriever:
 	    start_response("403 Forbidden", headers)
 	    return "Client not authorized"
 
-	environ.setdefault('wsgi.file_wrapper', FileWrapper)
+	# Stores may ask for part of a file
+	environ['wsgi.file_wrapper'] = partial(FileRange,
+				handler=environ.get(SENDFILE_HANDLER))
 
 	root = shift_path_info(environ)
 
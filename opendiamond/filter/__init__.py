@@ -162,11 +162,15 @@ class Filter(object):
 
             # Read arguments and initialize filter
             ver = int(conn.get_item())
-            if ver != 1:
+            if ver not in (1, 3):
                 raise ValueError('Unknown protocol version %d' % ver)
             name = conn.get_item()
             args = conn.get_array()
             blob = conn.get_item()
+            if ver == 3:
+                # We were given the path to the blob in the blob cache
+                with open(blob, 'rb') as fh:
+                    blob = fh.read()
             session = Session(name, conn)
             if classes is not None:
                 # Use the class named by the first filter argument
@@ -233,6 +237,21 @@ class Object(object):
             raise KeyError()
         return self._attrs[key]
 
+    def get_binary_range(self, key, offset, length):
+        '''Get length bytes of the specified object attribute, starting at
+        offset.  Unless the attribute has already been read, only the
+        requested bytes are transferred.'''
+        self.check_valid()
+        if key in self._attrs:
+            value = self._attrs[key]
+            if value is None:
+                raise KeyError()
+            return value[offset:offset + length]
+        value = self._get_attribute_range(key, offset, length)
+        if value is None:
+            raise KeyError()
+        return value
+
     def set_binary(self, key, value):
         '''Set the specified object attribute as raw binary data.'''
         self.check_valid()
@@ -364,6 +383,9 @@ class Object(object):
     def _get_attribute(self, _key):
         return None
 
+    def _get_attribute_range(self, _key, _offset, _length):
+        return None
+
     def _set_attribute(self, _key, _value):
         pass
 
@@ -383,6 +405,10 @@ class _DiamondObject(Object):
         self._conn.send_message('get-attribute', key)
         return self._conn.get_item()
 
+    def _get_attribute_range(self, key, offset, length):
+        self._conn.send_message('get-attribute-range', key, offset, length)
+        return self._conn.get_item()
+
     def _set_attribute(self, key, value):
         self._conn.send_message('set-attribute', key, value)
 
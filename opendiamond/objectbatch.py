@@ -0,0 +1,109 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2012 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''Batched object transfer format.
+
+A dataretriever that supports batching names its batch URL in the
+BATCH_HEADER header of its object responses.  A client POSTs a list of
+object URLs, one per line and relative to the batch URL, and receives the
+objects and their initial attributes in a single response.  The response
+contains one record per requested URL, in request order.  All integers are
+big-endian.
+
+    magic       4 bytes         'DOBB'
+    version     uint32          1
+    records
+
+Each record is:
+
+    status      uint32          STATUS_OK or STATUS_MISSING
+    nattrs      uint32          number of attributes
+    attrs       nattrs*(uint32 length, name, uint32 length, value)
+    length      uint64          length of the object data
+    data        length bytes
+
+A missing object has no attributes and no data.
+'''
+
+import struct
+
+MIME_TYPE = 'application/x-diamond-object-batch'
+BATCH_HEADER = 'x-diamond-batch'
+MAGIC = 'DOBB'
+VERSION = 1
+STATUS_OK = 0
+STATUS_MISSING = 1
+
+_HEADER = struct.Struct('>4sI')
+_RECORD = struct.Struct('>II')
+_LENGTH = struct.Struct('>I')
+_DATA_LENGTH = struct.Struct('>Q')
+
+class ObjectBatchError(Exception):
+    '''Malformed object batch.'''
+
+
+def encode_header():
+    '''Return the header of a batch response.'''
+    return _HEADER.pack(MAGIC, VERSION)
+
+
+def encode_record(attrs, length):
+    '''Return the part of a record that precedes length bytes of object
+    data.  attrs is a list of (name, value) pairs.'''
+    parts = [_RECORD.pack(STATUS_OK, len(attrs))]
+    for name, value in attrs:
+        parts.extend([_LENGTH.pack(len(name)), name,
+                _LENGTH.pack(len(value)), value])
+    parts.append(_DATA_LENGTH.pack(length))
+    return ''.join(parts)
+
+
+def encode_missing():
+    '''Return the record for an object that could not be read.'''
+    return _RECORD.pack(STATUS_MISSING, 0) + _DATA_LENGTH.pack(0)
+
+
+def decode(data):
+    '''Decode a complete batch response and return a list with an entry
+    for each record: None for a missing object, otherwise a tuple of
+    (attrs, data) where attrs is a list of (name, value) pairs.'''
+    try:
+        magic, version = _HEADER.unpack_from(data)
+        if magic != MAGIC or version != VERSION:
+            raise ObjectBatchError('Bad batch header')
+        pos = _HEADER.size
+        records = []
+        while pos < len(data):
+            status, nattrs = _RECORD.unpack_from(data, pos)
+            pos += _RECORD.size
+            attrs = []
+            for _i in xrange(2 * nattrs):
+                length = _LENGTH.unpack_from(data, pos)[0]
+                pos += _LENGTH.size
+                attrs.append(data[pos:pos + length])
+                pos += length
+            length = _DATA_LENGTH.unpack_from(data, pos)[0]
+            pos += _DATA_LENGTH.size
+            if pos + length > len(data):
+                raise ObjectBatchError('Truncated object batch')
+            if status == STATUS_OK:
+                records.append((zip(attrs[::2], attrs[1::2]),
+                        data[pos:pos + length]))
+            elif status == STATUS_MISSING:
+                records.append(None)
+            else:
+                raise ObjectBatchError('Bad record status %d' % status)
+            pos += length
+        return records
+    except struct.error:
+        raise ObjectBatchError('Truncated object batch')
@@ -16,7 +16,8 @@
 # pylint: disable=C0103
 
 from opendiamond.rpc import RPCError
-from opendiamond.xdr import XDR, XDRStruct
+from opendiamond.xdr import (XDR, XDRStruct, XDREncodingError,
+        encode_attribute_vector)
 
 # Default port
 PORT = 5872
@@ -60,6 +61,14 @@ class XDR_object(XDRStruct):
         'attrs', XDR.array(XDR.struct(XDR_attribute)),
     )
 
+    def encode_vector(self):
+        # Avoid copying attribute values, which can be large
+        for attr in self.attrs:
+            if type(attr) is not XDR_attribute:
+                raise XDREncodingError()
+        head = XDR_object(self.search_id, []).encode()[:-4]
+        return encode_attribute_vector(head, self.attrs, MAX_ATTRIBUTE_NAME)
+
 
 class XDR_blob_list(XDRStruct):
     '''A list of blob URIs'''
@@ -104,6 +113,14 @@ class XDR_start(XDRStruct):
     )
 
 
+class XDR_ranking(XDRStruct):
+    '''Top-K result parameters'''
+    members = (
+        'filter', XDR.string(MAX_FILTER_NAME),
+        'count', XDR.uint(),		# 0 to return all results
+    )
+
+
 class _XDRStats(XDRStruct):
     '''Base class for XDR_filter_stats and XDR_search_stats'''
 
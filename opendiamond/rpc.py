@@ -17,7 +17,7 @@ import logging
 import socket
 import threading
 
-from opendiamond.xdr import XDR, XDRStruct, XDREncodingError
+from opendiamond.xdr import XDR, XDRStruct, XDREncodingError, send_vector
 
 _log = logging.getLogger(__name__)
 
@@ -55,10 +55,10 @@ class _RPCRequest(object):
         self.hdr = hdr
         self.data = data
 
-    def make_reply_header(self, status, data):
+    def make_reply_header(self, status, datalen):
         '''Return the header for an RPC reply.'''
         return RPCHeader(sequence=self.hdr.sequence, status=status,
-                            cmd=self.hdr.cmd, datalen=len(data))
+                            cmd=self.hdr.cmd, datalen=datalen)
 
 
 class RPCConnection(object):
@@ -93,12 +93,14 @@ class RPCConnection(object):
             if hdr.status == RPC_PENDING:
                 return _RPCRequest(hdr, data)
 
-    def _reply(self, request, status=0, body=''):
-        assert status == 0 or len(body) == 0
-        hdr = request.make_reply_header(status, body).encode()
+    def _reply(self, request, status=0, body=()):
+        '''body is a sequence of strings which are sent consecutively.'''
+        datalen = sum([len(piece) for piece in body])
+        assert status == 0 or datalen == 0
+        hdr = request.make_reply_header(status, datalen).encode()
         with self._lock:
             try:
-                self._sock.sendall(hdr + body)
+                send_vector(self._sock, [hdr] + list(body))
             except socket.error, e:
                 self._sock.close()
                 raise ConnectionFailure(str(e))
@@ -130,10 +132,10 @@ class RPCConnection(object):
             # Encode reply
             if ret_obj is None:
                 assert handler.rpc_reply_class is None
-                ret = ''
+                ret = []
             else:
                 assert isinstance(ret_obj, handler.rpc_reply_class)
-                ret = ret_obj.encode()
+                ret = ret_obj.encode_vector()
 
             # Send reply
             self._reply(req, body=ret)
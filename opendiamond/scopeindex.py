@@ -0,0 +1,218 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2011 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''Binary scope list index format.
+
+A scope index is a compact alternative to the XML scope list.  Its header
+gives the object count up front and contains an offset table, so an index
+can be split into byte ranges which are enumerated independently.  All
+integers are big-endian.
+
+    magic       4 bytes         'DSCI'
+    version     uint32          1
+    count       uint64          number of objects in this index
+    total       uint64          number of objects in the complete index
+    first       uint64          ordinal of the first object in this index
+    nchunks     uint32          number of chunks
+    offsets     nchunks*uint64  offset of each chunk, relative to the end
+                                of the header
+    entries     count*(uint32 length, length bytes of object URL)
+
+Chunk k begins with object number first + k * CHUNK_OBJECTS.  Object URLs
+are relative to the URL of the scope list, as in the XML format.  A part of
+an index, produced by iter_part(), is itself a valid index whose count
+covers only the objects in that part.
+'''
+
+import shutil
+import struct
+from tempfile import TemporaryFile
+
+MIME_TYPE = 'application/x-diamond-scope-index'
+MAGIC = 'DSCI'
+VERSION = 1
+CHUNK_OBJECTS = 1024
+
+_HEADER = struct.Struct('>4sIQQQI')
+_OFFSET = struct.Struct('>Q')
+_LENGTH = struct.Struct('>I')
+
+class ScopeIndexError(Exception):
+    '''Malformed scope index.'''
+
+
+class ScopeIndexHeader(object):
+    '''The fixed portion and offset table of a scope index.'''
+
+    def __init__(self, count, total, first, offsets):
+        self.count = count
+        self.total = total
+        self.first = first
+        self.offsets = offsets
+
+    def __len__(self):
+        '''Return the encoded length of the header.'''
+        return _HEADER.size + _OFFSET.size * len(self.offsets)
+
+    def encode(self):
+        return (_HEADER.pack(MAGIC, VERSION, self.count, self.total,
+                self.first, len(self.offsets)) +
+                ''.join([_OFFSET.pack(o) for o in self.offsets]))
+
+    @classmethod
+    def fixed_length(cls):
+        '''Return the length of the header, excluding the offset table.'''
+        return _HEADER.size
+
+    @classmethod
+    def decode_fixed(cls, data):
+        '''Decode the fixed part of the header and return (count, total,
+        first, nchunks).'''
+        magic, version, count, total, first, nchunks = _HEADER.unpack(data)
+        if magic != MAGIC:
+            raise ScopeIndexError('Bad magic number')
+        if version != VERSION:
+            raise ScopeIndexError('Unknown version %d' % version)
+        return count, total, first, nchunks
+
+    @classmethod
+    def read(cls, fh):
+        '''Read a header from the file-like object.'''
+        data = fh.read(_HEADER.size)
+        if len(data) != _HEADER.size:
+            raise ScopeIndexError('Short read in header')
+        count, total, first, nchunks = cls.decode_fixed(data)
+        data = fh.read(_OFFSET.size * nchunks)
+        if len(data) != _OFFSET.size * nchunks:
+            raise ScopeIndexError('Short read in offset table')
+        offsets = list(struct.unpack('>%dQ' % nchunks, data))
+        return cls(count, total, first, offsets)
+
+    def chunk_range(self, part, parts):
+        '''Return (first_chunk, end_chunk) for the specified part when the
+        index is divided into parts parts.'''
+        if parts < 1 or part < 0 or part >= parts:
+            raise ValueError('Invalid part %d of %d' % (part, parts))
+        nchunks = len(self.offsets)
+        return (part * nchunks // parts, (part + 1) * nchunks // parts)
+
+
+def write_index(fh, urls):
+    '''Write a complete scope index containing the specified object URLs
+    to the file-like object.  Returns the number of objects written.'''
+    offsets = []
+    count = 0
+    pos = 0
+    entries = TemporaryFile()
+    try:
+        for url in urls:
+            if count % CHUNK_OBJECTS == 0:
+                offsets.append(pos)
+            entries.write(_LENGTH.pack(len(url)))
+            entries.write(url)
+            pos += _LENGTH.size + len(url)
+            count += 1
+        fh.write(ScopeIndexHeader(count, count, 0, offsets).encode())
+        entries.seek(0)
+        shutil.copyfileobj(entries, fh)
+    finally:
+        entries.close()
+    return count
+
+
+def iter_part(fh, part=0, parts=1, blocksize=65536):
+    '''Generator yielding the encoded bytes of the specified part of the
+    seekable scope index fh.  The result is itself a scope index.'''
+    fh.seek(0)
+    hdr = ScopeIndexHeader.read(fh)
+    base = len(hdr)
+    start, end = hdr.chunk_range(part, parts)
+    offsets = hdr.offsets[start:end]
+    first = min(start * CHUNK_OBJECTS, hdr.count)
+    if offsets:
+        byte_start = offsets[0]
+        if end < len(hdr.offsets):
+            byte_end = hdr.offsets[end]
+        else:
+            fh.seek(0, 2)
+            byte_end = fh.tell() - base
+        count = min(hdr.count - first, (end - start) * CHUNK_OBJECTS)
+    else:
+        byte_start = byte_end = 0
+        count = 0
+    yield ScopeIndexHeader(count, hdr.total, hdr.first + first,
+                [o - byte_start for o in offsets]).encode()
+    fh.seek(base + byte_start)
+    remaining = byte_end - byte_start
+    while remaining > 0:
+        buf = fh.read(min(blocksize, remaining))
+        if len(buf) == 0:
+            raise ScopeIndexError('Short read in entries')
+        remaining -= len(buf)
+        yield buf
+
+
+class ScopeIndexParser(object):
+    '''Incremental parser for a scope index arriving in arbitrary pieces,
+    e.g. from a network connection.'''
+
+    def __init__(self):
+        self.header = None
+        self._buf = ''
+        self._fixed = None
+        self._parsed = 0
+
+    def feed(self, data):
+        '''Add data to the parser and return a list of the object URLs
+        that it completes.'''
+        self._buf += data
+        urls = []
+        if self.header is None and not self._parse_header():
+            return urls
+        buf = self._buf
+        pos = 0
+        while len(buf) - pos >= _LENGTH.size:
+            length = _LENGTH.unpack_from(buf, pos)[0]
+            end = pos + _LENGTH.size + length
+            if end > len(buf):
+                break
+            urls.append(buf[pos + _LENGTH.size:end])
+            pos = end
+        self._buf = buf[pos:]
+        self._parsed += len(urls)
+        if self._parsed > self.header.count:
+            raise ScopeIndexError('Too many entries')
+        return urls
+
+    def _parse_header(self):
+        '''Try to parse the header from the buffer.  Return True on
+        success.'''
+        fixed = ScopeIndexHeader.fixed_length()
+        if self._fixed is None:
+            if len(self._buf) < fixed:
+                return False
+            self._fixed = ScopeIndexHeader.decode_fixed(self._buf[:fixed])
+        count, total, first, nchunks = self._fixed
+        length = fixed + _OFFSET.size * nchunks
+        if len(self._buf) < length:
+            return False
+        offsets = list(struct.unpack('>%dQ' % nchunks,
+                self._buf[fixed:length]))
+        self.header = ScopeIndexHeader(count, total, first, offsets)
+        self._buf = self._buf[length:]
+        return True
+
+    def close(self):
+        '''Verify that the complete index has been parsed.'''
+        if (self.header is None or self._buf or
+                self._parsed != self.header.count):
+            raise ScopeIndexError('Incomplete scope index')
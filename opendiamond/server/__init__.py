@@ -29,6 +29,13 @@ connection pair.
 temporary directories and killing all of their children (filters and helper
 processes).
 
+4.  If work stealing is enabled, telling peer servers which port a search
+accepts steal requests on (see opendiamond.server.steal).
+
+5.  If filter pooling is enabled, holding the idle filter processes of
+finished searches for adoption by later ones (see
+opendiamond.server.pool).
+
 The child is responsible for handling the search.  Initially it has only one
 thread, which is responsible for handling the control connection back to the
 client.  All client RPCs, including search reexecution, are handled in this
@@ -39,6 +46,10 @@ machine) to process objects for the search.
 Several pieces of mutable state are shared between threads.  The control
 thread configures a ScopeListLoader which iterates over the in-scope Diamond
 objects, returning a new object to each worker thread that asks for one.
+The ScopeListLoader starts its own threads to fetch and parse scope lists
+concurrently; they queue objects for the worker threads.  With work
+stealing, they also take parts of the scope from peer servers that have
+not reached them.
 The blast channel is also shared.  There are also shared objects for logging
 and for tracking of statistics and session variables.  All of these objects
 have locking to ensure consistency.
@@ -90,6 +101,7 @@ from opendiamond.helpers import daemonize, signalname
 from opendiamond.rpc import RPCConnection, ConnectionFailure
 from opendiamond.server.child import ChildManager
 from opendiamond.server.listen import ConnListener
+from opendiamond.server.pool import FilterPool
 from opendiamond.server.search import Search
 
 SEARCH_LOG_DATE_FORMAT = '%Y-%m-%d-%H:%M:%S'
@@ -133,7 +145,18 @@ class DiamondServer(object):
 
         self.config = config
         self._children = ChildManager(config.cgroupdir, not config.oneshot)
-        self._listener = ConnListener()
+        self._pool = None
+        if config.filter_pool:
+            self._pool = FilterPool(config.filter_pool_dir,
+                                config.filter_pool_idle,
+                                config.filter_pool_mb << 20, config.cgroupdir)
+        if config.steal:
+            if not os.path.isdir(config.steal_dir):
+                os.mkdir(config.steal_dir, 0700)
+            self._listener = ConnListener(config.port, config.steal_port,
+                                config.steal_dir, pool=self._pool)
+        else:
+            self._listener = ConnListener(config.port, pool=self._pool)
         self._last_log_prune = datetime.fromtimestamp(0)
         self._last_cache_prune = datetime.fromtimestamp(0)
         self._ignore_signals = False
@@ -183,6 +206,8 @@ class DiamondServer(object):
             self._listener.shutdown()
             # Kill our children and clean up after them
             self._children.kill_all()
+            if self._pool is not None:
+                self._pool.close()
             # Shut down logging
             logging.shutdown()
             # Ensure our exit status reflects that we died on the signal
@@ -213,6 +238,8 @@ class DiamondServer(object):
             try:
                 # Close listening socket and half-open connections
                 self._listener.shutdown()
+                if self._pool is not None:
+                    self._pool.forget()
                 # Log startup of child
                 _log.info('Starting search %s, pid %d',
                                         opendiamond.__version__,
@@ -0,0 +1,203 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2012 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''Local knowledge of which keys exist in the Redis cache.
+
+When the cache is cold, almost every result cache lookup misses, and
+each one costs a round trip to Redis.  A search can instead keep a Bloom
+filter of the keys in the cache and skip lookups of keys that it knows to
+be absent.  The filter is updated with the keys the search itself stores,
+and saved in the cache directory when the search ends, so that the next
+search can start with it.  A search whose saved filter is missing or was
+last refreshed from Redis more than RESCAN seconds ago scans the cache in
+the background instead; until the scan finishes, every key is looked up.
+If the database holds more keys than the filter was sized for, the filter
+would mostly give false positives, so it is not used.
+
+A Bloom filter has no false negatives, but the filter can still miss keys
+stored by other servers, or by concurrent searches, since it was last
+refreshed.  Skipping their lookups only costs a cache hit; filter results
+are never wrong.
+'''
+
+from __future__ import with_statement
+import logging
+import math
+import os
+from redis import Redis
+import simplejson as json
+import struct
+import tempfile
+import threading
+import time
+
+from opendiamond.helpers import md5
+
+# Keys fetched per SCAN request while loading the filter
+SCAN_COUNT = 1000
+# Seconds after which a saved filter is refreshed by scanning the cache
+RESCAN = 3600
+
+_log = logging.getLogger(__name__)
+
+class BloomFilter(object):
+    '''A Bloom filter sized for capacity keys at the specified false
+    positive rate.  Adding is serialized; membership tests are not.'''
+
+    def __init__(self, capacity, error_rate=0.01):
+        capacity = max(capacity, 1)
+        bits = -capacity * math.log(error_rate) / (math.log(2) ** 2)
+        self._bits = max(int(math.ceil(bits)), 8)
+        self._hashes = max(int(round(self._bits * math.log(2) /
+                                capacity)), 1)
+        self._array = bytearray((self._bits + 7) // 8)
+        self._lock = threading.Lock()
+
+    def _positions(self, key):
+        # Derive the bit positions from two independent hashes
+        a, b = struct.unpack('<QQ', md5(key).digest())
+        return [(a + i * b) % self._bits for i in xrange(self._hashes)]
+
+    def add(self, key):
+        '''Add the key to the filter.'''
+        positions = self._positions(key)
+        with self._lock:
+            for pos in positions:
+                self._array[pos >> 3] |= 1 << (pos & 7)
+
+    def __contains__(self, key):
+        '''Return False if the key has certainly not been added.'''
+        for pos in self._positions(key):
+            if not self._array[pos >> 3] & (1 << (pos & 7)):
+                return False
+        return True
+
+    def tostring(self):
+        '''Return the contents of the filter.'''
+        with self._lock:
+            return str(self._array)
+
+    def fromstring(self, data):
+        '''Replace the contents of the filter with data from tostring() on
+        a filter of the same size.'''
+        if len(data) != len(self._array):
+            raise ValueError('Filter size mismatch')
+        with self._lock:
+            self._array = bytearray(data)
+
+
+class CacheKeyFilter(object):
+    '''The keys known to exist in the configured Redis cache database.
+    Until load() has finished, every key may exist.'''
+
+    def __init__(self, config):
+        self._config = config
+        self._bloom = BloomFilter(config.cache_key_filter)
+        host, port = config.cache_server
+        # Identifies the filter's database and size in the saved filter
+        self._header = {
+            'server': '%s:%d' % (host, port),
+            'database': config.cache_database,
+            'capacity': config.cache_key_filter,
+        }
+        self._path = os.path.join(config.cachedir, 'cache-keys')
+        self._scanned = None	# When the filter was last refreshed
+        self.ready = False
+
+    def load(self):
+        '''Start loading the filter from a background thread.'''
+        thread = threading.Thread(target=self._load, name='cache-keys')
+        thread.setDaemon(True)
+        thread.start()
+
+    def _load(self):
+        config = self._config
+        host, port = config.cache_server
+        try:
+            redis = Redis(host=host, port=port, db=config.cache_database,
+                                password=config.cache_password)
+            size = redis.dbsize()
+            if size > config.cache_key_filter:
+                _log.warning('Not filtering cache keys: the cache has %d '
+                                'keys, more than CACHEKEYS (%d)', size,
+                                config.cache_key_filter)
+                return
+            if self._restore():
+                self.ready = True
+                _log.info('Loaded saved cache key filter')
+                return
+            scanned = time.time()
+            count = 0
+            for key in redis.scan_iter(count=SCAN_COUNT):
+                self._bloom.add(key)
+                count += 1
+        except Exception, e:
+            # Keep looking up every key
+            _log.warning("Couldn't load cache keys: %s", e)
+            return
+        self._scanned = scanned
+        self.ready = True
+        _log.info('Loaded %d cache keys', count)
+
+    def _restore(self):
+        '''Load the saved filter if it matches our configuration and is
+        recent enough.  Return True on success.'''
+        try:
+            fh = open(self._path, 'rb')
+        except IOError:
+            return False
+        try:
+            try:
+                header = json.loads(fh.readline())
+                scanned = header.pop('scanned')
+                if header != self._header or time.time() - scanned > RESCAN:
+                    return False
+                self._bloom.fromstring(fh.read())
+            except (IOError, ValueError, KeyError, AttributeError):
+                return False
+        finally:
+            fh.close()
+        self._scanned = scanned
+        return True
+
+    def save(self):
+        '''Save the filter, including the keys we have stored, for later
+        searches.  Concurrent searches overwrite each other's saved keys,
+        which only costs cache hits.'''
+        if not self.ready:
+            return
+        header = dict(self._header, scanned=self._scanned)
+        try:
+            fd, tmp = tempfile.mkstemp(dir=self._config.cachedir,
+                                prefix='cache-keys.')
+            try:
+                fh = os.fdopen(fd, 'wb')
+                try:
+                    fh.write(json.dumps(header) + '\n')
+                    fh.write(self._bloom.tostring())
+                finally:
+                    fh.close()
+                os.rename(tmp, self._path)
+            except:
+                os.unlink(tmp)
+                raise
+        except (IOError, OSError), e:
+            _log.warning("Couldn't save cache keys: %s", e)
+
+    def add(self, keys):
+        '''Record that the keys have been stored in the cache.'''
+        for key in keys:
+            self._bloom.add(key)
+
+    def __contains__(self, key):
+        '''Return False if the key is known not to be in the cache.'''
+        return not self.ready or key in self._bloom
@@ -32,6 +32,15 @@ Result cache:
 Attribute cache:
     'attribute:' + MD5(attribute value) => attribute value
 
+If content-addressed caching is enabled, the object ID in the result cache
+key of each filter (but not of the dataretriever fetch) is replaced by
+'data ' + MD5(object data), so that identical data reached through different
+URLs shares cached results.  A side index allows the data signature to be
+found before the object is fetched:
+
+Data signature index:
+    'datasig:' + MD5(object ID) => MD5(object data)
+
 The purpose of the result cache is to reuse drop decisions without needing
 to rerun any filters.  A result cache lookup on an object returns an array
 of FilterResult entries, one for each filter in the filter stack, where one
@@ -54,27 +63,54 @@ and skip execution of the filter.  Otherwise, we execute the filter.  To
 avoid storing cheaply recomputable values in the attribute cache, we only
 cache values resulting from filter executions that produce attribute data at
 less than 2 MB/s.
+
+Filters built as shared objects (with LF_SHARED() rather than LF_MAIN())
+are run by diamond-filter-host.  All such filters of a filter stack share a
+host process, except those listed in ISOLATEFILTER, which get a process of
+their own.  The host passes attributes between consecutive filters run on
+the same object without sending them back through the server; it reports
+those reads so that result cache entries still record their inputs.
 '''
 
+from __future__ import with_statement
+from collections import deque
+from functools import partial
+import heapq
+import itertools
 import logging
 import os
+import re
 from redis import Redis
 from redis.exceptions import ResponseError
+import shutil
 import signal
 import simplejson as json
+import struct
 import subprocess
+import tempfile
 import threading
 
 from opendiamond.helpers import md5, signalname, split_scheme
 from opendiamond.rpc import ConnectionFailure
-from opendiamond.server.object_ import ObjectLoader, ObjectLoadError
-from opendiamond.server.statistics import FilterStatistics, Timer
+from opendiamond.server.filtertrace import FilterTraceWriter
+from opendiamond.server.object_ import ATTR_DATA, ObjectLoader, ObjectLoadError
+from opendiamond.server.placement import (Placement, PlacementError,
+        NUMA_NODE_ENV, current_node)
+from opendiamond.server.pool import process_key
+from opendiamond.server.statistics import (FilterStatistics, Timer,
+        monotonic_time)
+from opendiamond.server.workers import WorkerController
 
 ATTR_FILTER_SCORE = '_filter.%s_score'	# arg: filter name
 # If a filter produces attribute values at less than this rate
 # (total attribute value size / execution time), we will cache the attribute
 # values as well as the filter results.
 ATTRIBUTE_CACHE_THRESHOLD = 2 << 20	# bytes/sec
+# Environment variable passing the evaluation deadline to libfilter
+DEADLINE_ENV = 'DIAMOND_DEADLINE_MS'
+# Tells libfilter that each evaluation starts with whether to report its
+# spans
+SPANS_ENV = 'DIAMOND_SPANS'
 DEBUG = False
 
 _log = logging.getLogger(__name__)
@@ -94,27 +130,207 @@ class _DropObject(Exception):
     without caching the drop result.'''
 
 
+# ELF header fields following e_ident, through e_phnum, by ELF class
+_ELF_HEADER_FORMATS = {'\x01': 'HHIIIIIHHH', '\x02': 'HHIQQQIHHH'}
+_ET_DYN = 3
+_PT_INTERP = 3
+
+def _is_shared_object(path):
+    '''Return True if the file at path is an ELF shared object rather than
+    an executable.  Position-independent executables are also ET_DYN, but
+    request a program interpreter.'''
+    try:
+        with open(path, 'rb') as fh:
+            ident = fh.read(16)
+            if ident[:4] != '\x7fELF' or ident[4:5] not in _ELF_HEADER_FORMATS:
+                return False
+            order = ident[5:6] == '\x02' and '>' or '<'
+            fmt = order + _ELF_HEADER_FORMATS[ident[4]]
+            fields = struct.unpack(fmt, fh.read(struct.calcsize(fmt)))
+            e_type, e_phoff, e_phentsize, e_phnum = (fields[0], fields[4],
+                                    fields[8], fields[9])
+            if e_type != _ET_DYN:
+                return False
+            for i in xrange(e_phnum):
+                fh.seek(e_phoff + i * e_phentsize)
+                p_type = struct.unpack(order + 'I', fh.read(4))[0]
+                if p_type == _PT_INTERP:
+                    return False
+            return True
+    except (IOError, struct.error):
+        return False
+
+
+# Distinguishes the traces written by a diamondd process
+_trace_sequence = itertools.count()
+
+def _get_trace_path(config, name, filters):
+    '''Return a path for a trace of a new process running the specified
+    filters, or None if none of them are being traced.'''
+    for f in filters:
+        if f.name in config.trace_filters or \
+                f.signature in config.trace_filters:
+            break
+    else:
+        return None
+    if not os.path.isdir(config.trace_dir):
+        try:
+            os.makedirs(config.trace_dir)
+        except OSError:
+            pass
+    name = re.sub('[^A-Za-z0-9_.-]', '_', name)
+    return os.path.join(config.trace_dir, '%s-%d-%d.trace' % (name,
+                                os.getpid(), _trace_sequence.next()))
+
+
+class _NullTrace(object):
+    '''Stands in for a FilterTraceWriter when the process is not being
+    traced.'''
+
+    def send(self, *pieces):
+        pass
+
+    def blob(self, path):
+        pass
+
+    def begin(self, filter, obj):
+        pass
+
+    def request(self, *args):
+        pass
+
+    def result(self, score):
+        pass
+
+    def close(self):
+        pass
+
+
+class _AdoptedProcess(object):
+    '''A filter process adopted from the supervisor's pool.  It is not our
+    child, so it presents the subset of the subprocess.Popen interface
+    that _FilterProcess uses without waiting for it.'''
+
+    def __init__(self, pid, stdin_fd, stdout_fd):
+        self.pid = pid
+        # Unbuffered, like the pipes of subprocess.Popen, so that reads
+        # never take data that belongs to the next owner
+        self.stdin = os.fdopen(stdin_fd, 'wb', 0)
+        self.stdout = os.fdopen(stdout_fd, 'rb', 0)
+
+    def poll(self):
+        try:
+            os.kill(self.pid, 0)
+        except OSError:
+            return 0
+        return None
+
+    def wait(self):
+        pass
+
+
 class _FilterProcess(object):
-    '''A connection to a running filter process.'''
-    def __init__(self, code_argv, name, args, blob):
+    '''A connection to a running filter process.  If trace_path is
+    specified, the session is recorded there for diamond-filter-replay,
+    together with the contents of the files in blob_paths.  If deadline_ms
+    is nonzero, libfilter reports evaluations that take longer than that
+    as timed out.  If spans is True, libfilter announces that it reports
+    spans before its init-success; each evaluation in such a process then
+    starts by telling libfilter whether the object is traced, and
+    libfilter reports spans of the evaluations of traced objects.  Other
+    filters never see the flag.  Sessions recorded for replay don't
+    report spans.  If pool is specified, a process with
+    the same identity (see process_key()) is adopted from the supervisor's
+    pool if possible, and the process is parked there when the search
+    exits.  Traced processes are never pooled.'''
+    def __init__(self, code_argv, name, handshake, trace_path=None,
+                blob_paths=(), deadline_ms=0, pool=None, spans=False,
+                identity=None):
+        self.trace = _NullTrace()
+        # Set when the watchdog kills the process
+        self.timed_out = False
+        # Held while evaluating an object
+        self.lock = threading.Lock()
+        # False while the process owes us a reply
+        self.clean = True
+        # Names of the filters whose init-success we have received
+        self.initialized = set()
+        # Object sequence number of a diamond-filter-host process
+        self.sequence = 0
+        self.pool_key = None
+        self.tempdir = None
+        self.spans = spans and trace_path is None
+        # Set when the filter announces that it reports spans
+        self.reports_spans = False
+        self._parked = False
         try:
             self._name = name
+            # The child inherits the CPU affinity of the calling thread
+            extra_env = dict()
+            node = current_node()
+            if node is not None:
+                extra_env[NUMA_NODE_ENV] = str(node)
+            if deadline_ms:
+                extra_env[DEADLINE_ENV] = str(deadline_ms)
+            if self.spans:
+                extra_env[SPANS_ENV] = '1'
+            # Interned attribute handle -> attribute name
+            self.attribute_names = dict()
+            if (pool is not None and identity is not None and
+                        trace_path is None):
+                self.pool_key = process_key(identity, extra_env)
+                adopted = pool.adopt(self.pool_key)
+                if adopted is not None:
+                    pid, stdin_fd, stdout_fd, self.tempdir, state = adopted
+                    self._proc = _AdoptedProcess(pid, stdin_fd, stdout_fd)
+                    self._fin = self._proc.stdout
+                    self._fout = self._proc.stdin
+                    state = json.loads(state)
+                    self.attribute_names = dict([(k.encode('latin-1'),
+                                v.encode('latin-1')) for k, v in
+                                state['attribute_names'].iteritems()])
+                    self.initialized = set([n.encode('latin-1')
+                                for n in state['initialized']])
+                    self.sequence = state['sequence']
+                    self.reports_spans = state['reports_spans']
+                    pool.register(self)
+                    _log.info('Adopted pooled filter %s', self)
+                    return
+                # Give the process a working directory that outlives the
+                # search
+                self.tempdir = tempfile.mkdtemp(prefix='filter-',
+                                dir=pool.directory)
+                extra_env['TMPDIR'] = self.tempdir
+            env = dict(os.environ)
+            env.update(extra_env)
             self._proc = subprocess.Popen(code_argv + ['--filter'],
                                 stdin=subprocess.PIPE, stdout=subprocess.PIPE,
-                                close_fds=True, cwd=os.getenv('TMPDIR'))
+                                close_fds=True,
+                                cwd=self.tempdir or os.getenv('TMPDIR'),
+                                env=env)
             self._fin = self._proc.stdout
             self._fout = self._proc.stdin
 
-            # Send:
-            # - Protocol version (1)
-            # - Filter name
-            # - Array of filter arguments
-            # - Blob argument
-            self.send(1, name, args, blob)
+            if trace_path is not None:
+                try:
+                    trace = FilterTraceWriter(trace_path, code_argv)
+                    for path in blob_paths:
+                        trace.blob(path)
+                    self.trace = trace
+                    _log.info('Tracing filter %s to %s', self, trace_path)
+                except IOError, e:
+                    _log.warning("Couldn't trace filter %s: %s", self, e)
+
+            self.send(*handshake)
+            if self.pool_key is not None:
+                pool.register(self)
         except (OSError, IOError):
             raise FilterExecutionError('Unable to launch filter %s' % self)
 
     def __del__(self):
+        if self._parked:
+            return
+        self.trace.close()
         ret = self._proc.poll()
         if ret is None:
             os.kill(self._proc.pid, signal.SIGKILL)
@@ -123,10 +339,52 @@ class _FilterProcess(object):
             _log.info('Filter %s exited on %s', self, signalname(-ret))
         elif ret > 0:
             _log.info('Filter %s exited with status %d', self, ret)
+        if self.tempdir is not None:
+            shutil.rmtree(self.tempdir, True)
+
+    @property
+    def pid(self):
+        return self._proc.pid
+
+    def park_state(self):
+        '''If the process is idle and initialized, keep it idle and return
+        a JSON description of its protocol state for its next owner.
+        Otherwise return None.'''
+        if not self.lock.acquire(False):
+            return None
+        # The lock stays held, since the process is leaving the search
+        if not self.clean or not self.initialized or self.timed_out:
+            return None
+        # Attribute names are arbitrary bytes
+        return json.dumps({
+            'attribute_names': self.attribute_names,
+            'initialized': sorted(self.initialized),
+            'sequence': self.sequence,
+            'reports_spans': self.reports_spans,
+        }, encoding='latin-1')
+
+    def filenos(self):
+        '''Return the descriptors of the process' stdin and stdout.'''
+        return [self._fout.fileno(), self._fin.fileno()]
+
+    def detach(self):
+        '''Give up the process after it has been parked.'''
+        self._parked = True
+        self._fout.close()
+        self._fin.close()
 
     def __str__(self):
         return self._name
 
+    def kill(self):
+        '''Kill the process for overrunning its deadline.  The caller will
+        see end-of-file.'''
+        self.timed_out = True
+        try:
+            os.kill(self._proc.pid, signal.SIGKILL)
+        except OSError:
+            pass
+
     def get_tag(self):
         '''Read and return a tag.'''
         return self._fin.readline().strip()
@@ -164,25 +422,108 @@ class _FilterProcess(object):
            scalar => serialized as str(value)
            tuple or list => serialized as an array terminated by a blank line
         '''
+        buf = []
         def send_value(value):
             value = str(value)
-            self._fout.write('%d\n%s\n' % (len(value), value))
+            buf.extend(['%d\n' % len(value), value, '\n'])
         for value in values:
             if isinstance(value, list) or isinstance(value, tuple):
                 for element in value:
                     send_value(element)
-                self._fout.write('\n')
+                buf.append('\n')
             elif value is True:
                 send_value('true')
             elif value is False:
                 send_value('false')
             elif value is None:
-                self._fout.write('\n')
+                buf.append('\n')
             else:
                 send_value(value)
+        self.write(*buf)
+
+    def write(self, *pieces):
+        '''Send data that has already been serialized.'''
+        self.trace.send(*pieces)
+        for piece in pieces:
+            self._fout.write(piece)
         self._fout.flush()
 
 
+class _FilterHost(object):
+    '''A diamond-filter-host process running one or more shared-object
+    filters.  The process is started by the first filter to need it and
+    shared by the _FilterRunners of its filters.'''
+
+    def __init__(self, state, filters):
+        self._state = state
+        self._filters = list(filters)
+        self._proc = None
+        # The object whose attributes the host has, while it is being
+        # processed, and its version when the host last evaluated it
+        self._obj = None
+        self._version = None
+
+    def __str__(self):
+        return 'host(%s)' % ', '.join([f.name for f in self._filters])
+
+    def get_proc(self):
+        '''Return the host process, starting it if necessary.'''
+        if self._proc is None:
+            config = self._state.config
+            argv = [config.filter_host]
+            for f in self._filters:
+                if f.name in config.debug_filters or \
+                        f.signature in config.debug_filters:
+                    argv = config.debug_command + argv
+                    break
+            # Send:
+            # - Protocol version (4)
+            # - Number of filters
+            # - For each filter: name, array of arguments, path to blob
+            #   argument, path to shared object
+            handshake = [4, len(self._filters)]
+            for f in self._filters:
+                handshake.extend([f.name, f.arguments, f.blob_path,
+                                f.code_path])
+            identity = [4, argv] + [f.pool_identity() for f in self._filters]
+            self._proc = _FilterProcess(argv, str(self), handshake,
+                                _get_trace_path(config, str(self),
+                                self._filters),
+                                [f.blob_path for f in self._filters],
+                                config.filter_deadline_ms, self._state.pool,
+                                self._state.tracer is not None, identity)
+            self._obj = None
+        return self._proc
+
+    def begin(self, filter, obj):
+        '''Ask the host to run filter on obj.  Consecutive requests for the
+        same obj share an object handle in the host, unless something
+        outside the host has set attributes of obj in between.'''
+        if obj is not self._obj or obj.version != self._version:
+            self._obj = obj
+            # Kept with the process, which may be reused by later searches
+            self._proc.sequence += 1
+        self._proc.send(self._filters.index(filter), self._proc.sequence)
+
+    def end(self, obj):
+        '''Note that the host has finished evaluating obj.  Its attributes
+        now include the ones the host set.'''
+        if obj is self._obj:
+            self._version = obj.version
+
+    def done(self, obj):
+        '''Forget obj once it has been processed.'''
+        if obj is self._obj:
+            self._obj = None
+            self._version = None
+
+    def reset(self):
+        '''Discard the host process after it has died.'''
+        self._proc = None
+        self._obj = None
+        self._version = None
+
+
 class _FilterResult(object):
     '''A summary of the result of running a filter on an object: the score
     and hashes of the output attributes, together with hashes of the input
@@ -219,16 +560,23 @@ class _ObjectProcessor(object):
     # Whether to report the filter score back to the client (True for
     # filters requested by the client, False for other filters)
     send_score = False
+    # Whether the result cache key may be derived from the object data
+    # rather than the object ID
+    content_keyed = False
 
     def __str__(self):
         '''Return a human-readable name for the underlying filter.'''
         raise NotImplementedError()
 
-    def get_cache_key(self, obj):
+    def get_cache_key(self, obj, data_sig=None):
         '''Return the result cache lookup key for previous filter executions
-        on this object.'''
+        on this object.  If data_sig is specified, the key is derived from
+        that signature of the object data rather than from the object ID.'''
         digest = self._get_cache_digest()
-        digest.update(str(obj))
+        if data_sig is not None:
+            digest.update('data ' + data_sig)
+        else:
+            digest.update(str(obj))
         return 'result:' + digest.hexdigest()
 
     def _get_cache_digest(self):
@@ -241,6 +589,24 @@ class _ObjectProcessor(object):
         producing the given result.'''
         pass
 
+    def done(self, obj):
+        '''Notification that processing of the object is complete.'''
+        pass
+
+    def prestart(self):
+        '''Prepare to evaluate objects, e.g. by starting a filter process,
+        so that the first evaluation does not pay the startup cost.'''
+        pass
+
+    def expect(self, objs):
+        '''Note the objects that will be evaluated next.'''
+        pass
+
+    def release(self):
+        '''Kill any filter process, to free its memory while idle.  It is
+        restarted when next needed.'''
+        pass
+
     def evaluate(self, obj):
         '''Execute the filter on this object, returning a _FilterResult.'''
         raise NotImplementedError()
@@ -252,12 +618,18 @@ class _ObjectProcessor(object):
 
 
 class _ObjectFetcher(_ObjectProcessor):
-    '''A context for loading object data from the dataretriever.'''
+    '''A context for loading object data from the dataretriever.  If lazy
+    is True, only the initial attributes are fetched up front, and the
+    object data is fetched when something first reads it.  If the
+    dataretriever gives the data a strong entity tag, filters that read
+    only part of the data fetch only that part.'''
 
-    def __init__(self, state):
+    def __init__(self, state, lazy=False):
         _ObjectProcessor.__init__(self)
         self._state = state
-        self._loader = ObjectLoader(state.config, state.blob_cache)
+        self._lazy = lazy
+        self._loader = ObjectLoader(state.config, state.blob_cache,
+                                state.memory)
         self._digest_prefix = md5('dataretriever ')
 
     def __str__(self):
@@ -266,18 +638,74 @@ class _ObjectFetcher(_ObjectProcessor):
     def _get_cache_digest(self):
         return self._digest_prefix.copy()
 
+    def expect(self, objs):
+        self._loader.expect(objs)
+
     def evaluate(self, obj):
+        timer = Timer()
+        span_start = obj.trace is not None and obj.trace.begin()
+        headers = None
         try:
-            self._loader.load(obj)
+            if self._lazy:
+                headers = self._loader.load_attributes(obj)
+            else:
+                self._loader.load(obj)
         except ObjectLoadError, e:
             _log.warning('Failed to load %s: %s', obj, e)
             self._state.stats.update('objs_unloadable')
             raise _DropObject()
+        finally:
+            self._state.stats.update(fetch_ns=timer.elapsed)
+            if obj.trace is not None:
+                obj.trace.end(self._lazy and 'fetch-attributes' or 'fetch',
+                                span_start)
         result = _FilterResult()
         for key in obj:
             result.output_attrs[key] = obj.get_signature(key)
+        if headers is not None:
+            signature = self._loader.data_signature(obj, headers)
+            if signature is not None:
+                result.output_attrs[ATTR_DATA] = signature
+                load_range = partial(self._load_range, headers)
+            else:
+                load_range = None
+            obj.defer(ATTR_DATA, partial(self._load_data, result, headers),
+                                signature, load_range)
         return result
 
+    def _load_data(self, result, headers, obj):
+        '''Fetch deferred object data and add its signature to our result,
+        which may not have been written to the result cache yet.'''
+        timer = Timer()
+        span_start = obj.trace is not None and obj.trace.begin()
+        try:
+            self._loader.load_data(obj, headers)
+        except ObjectLoadError, e:
+            _log.warning('Failed to load data of %s: %s', obj, e)
+            self._state.stats.update('objs_unloadable')
+            raise
+        finally:
+            self._state.stats.update(fetch_ns=timer.elapsed)
+            if obj.trace is not None:
+                obj.trace.end('fetch-data', span_start)
+        if ATTR_DATA not in result.output_attrs:
+            result.output_attrs[ATTR_DATA] = obj.get_signature(ATTR_DATA)
+
+    def _load_range(self, headers, obj, offset, length):
+        '''Fetch part of the deferred object data.'''
+        timer = Timer()
+        span_start = obj.trace is not None and obj.trace.begin()
+        try:
+            return self._loader.load_range(obj, headers, offset, length)
+        except ObjectLoadError, e:
+            _log.warning('Failed to load data range of %s: %s', obj, e)
+            self._state.stats.update('objs_unloadable')
+            raise
+        finally:
+            self._state.stats.update(fetch_ns=timer.elapsed)
+            if obj.trace is not None:
+                obj.trace.end('fetch-range', span_start)
+
     def threshold(self, result):
         return True
 
@@ -286,13 +714,16 @@ class _FilterRunner(_ObjectProcessor):
     '''A context for processing objects with a Filter.'''
 
     send_score = True
+    content_keyed = True
 
-    def __init__(self, state, filter):
+    def __init__(self, state, filter, host=None):
         _ObjectProcessor.__init__(self)
         self._filter = filter
         self._state = state
+        self._host = host
         self._proc = None
         self._proc_initialized = False
+        self._load_failed = False
 
     def __str__(self):
         return self._filter.name
@@ -307,42 +738,188 @@ class _FilterRunner(_ObjectProcessor):
                                 objs_cache_dropped=int(not accept),
                                 objs_cache_passed=int(accept))
 
-    def evaluate(self, obj):
-        if self._proc is None:
+    def _get_attribute_name(self, proc, cmd):
+        '''Read an attribute name from the filter, or an interned attribute
+        handle if the command is one of the -id variants.'''
+        item = proc.get_item()
+        if cmd.endswith('-id'):
+            try:
+                return proc.attribute_names[item]
+            except KeyError:
+                raise FilterExecutionError('%s: unknown attribute handle'
+                                % self)
+        return item
+
+    def _read_attribute(self, obj, key):
+        '''Return the value of the attribute, or None if it is absent or
+        its deferred value could not be loaded.'''
+        try:
+            return obj[key]
+        except KeyError:
+            return None
+        except ObjectLoadError:
+            # Reply anyway to keep the filter in sync; the object is
+            # dropped once the filter finishes with it
+            self._load_failed = True
+            return None
+
+    def _read_attribute_range(self, obj, key, offset, length):
+        '''Return part of the value of the attribute, fetching only that
+        part of deferred object data if possible, or None as for
+        _read_attribute().'''
+        if key not in obj:
+            return None
+        try:
+            return obj.get_range(key, offset, length)
+        except KeyError:
+            return None
+        except ObjectLoadError:
+            self._load_failed = True
+            return None
+
+    def prestart(self):
+        # The filter initializes while we wait for the first object; its
+        # init-success message is consumed by the first evaluate().
+        if self._host is not None:
+            # A new host process initializes its filters on first use
+            proc = self._host.get_proc()
+            if proc is not self._proc:
+                self._proc = proc
+                # An adopted host may have initialized us already
+                self._proc_initialized = self._filter.name in proc.initialized
+        elif self._proc is None:
             debug = self._state.config.debug_filters
             if self._filter.name in debug or self._filter.signature in debug:
                 argv = (self._state.config.debug_command +
                             [self._filter.code_path])
             else:
                 argv = [self._filter.code_path]
+            # Send:
+            # - Protocol version (3)
+            # - Filter name
+            # - Array of filter arguments
+            # - Path to blob argument, which the filter maps
             self._proc = _FilterProcess(argv, self._filter.name,
-                                    self._filter.arguments, self._filter.blob)
-            self._proc_initialized = False
+                                    [3, self._filter.name,
+                                    self._filter.arguments,
+                                    self._filter.blob_path],
+                                    _get_trace_path(self._state.config,
+                                    self._filter.name, [self._filter]),
+                                    [self._filter.blob_path],
+                                    self._state.config.filter_deadline_ms,
+                                    self._state.pool,
+                                    self._state.tracer is not None,
+                                    [3, argv[:-1],
+                                    self._filter.pool_identity()])
+            self._proc_initialized = bool(self._proc.initialized)
+
+    def release(self):
+        if self._host is not None:
+            self._host.reset()
+        self._proc = None
+
+    def done(self, obj):
+        if self._host is not None:
+            self._host.done(obj)
+
+    def _disarm(self, proc, armed):
+        '''Stop timing the evaluation as soon as the process has replied.
+        If the watchdog killed the process anyway, the reply stands, but
+        the process must be restarted.'''
+        if not self._state.watchdog.disarm(proc, armed):
+            _log.info('Filter %s was killed after finishing in time', self)
+            self.release()
+
+    def _add_spans(self, obj, spans):
+        '''Record the spans reported by libfilter, one per line as start
+        and end in ns and a name, optionally followed by a detail.'''
+        if obj.trace is None:
+            return
+        for line in spans.splitlines():
+            try:
+                start, end, name = line.split(' ', 2)
+                start, end = int(start) * 1e-9, int(end) * 1e-9
+            except ValueError:
+                raise FilterExecutionError('%s: bad span' % self)
+            name, _sep, detail = name.partition(' ')
+            args = detail and {'detail': detail} or None
+            obj.trace.add(name, start, end, 'libfilter', args)
+
+    def evaluate(self, obj):
+        self.prestart()
         timer = Timer()
+        span_start = obj.trace is not None and obj.trace.begin()
         result = _FilterResult()
         proc = self._proc
+        trace = proc.trace
+        self._load_failed = False
+        watchdog = self._state.watchdog
+        armed = None		# Watchdog token while timing the evaluation
+        proc.lock.acquire()
+        proc.clean = False
         try:
+            if self._proc_initialized:
+                armed = watchdog.arm(proc)
+            trace.begin(self._filter.name, obj)
+            if self._host is not None:
+                self._host.begin(self._filter, obj)
+            # Whether libfilter has been told if the object is sampled
+            sampled_sent = proc.reports_spans
+            if sampled_sent:
+                # Start libfilter's clock for the evaluation, and say
+                # whether to report its spans
+                proc.send(obj.trace is not None)
             while True:
                 cmd = proc.get_tag()
-                if cmd == 'init-success':
+                if cmd == 'report-spans':
+                    # libfilter will read the flag after its init-success
+                    proc.reports_spans = True
+                    if not sampled_sent:
+                        proc.send(obj.trace is not None)
+                        sampled_sent = True
+                elif cmd == 'init-success':
                     # The filter initialized successfully.  This may not
                     # be the first command produced by the filter, since
                     # its init function may e.g. produce log messages.
                     self._proc_initialized = True
-                elif cmd == 'get-attribute':
+                    proc.initialized.add(self._filter.name)
+                    armed = watchdog.arm(proc)
+                elif cmd == 'intern-attribute':
+                    handle = proc.get_item()
+                    proc.attribute_names[handle] = proc.get_item()
+                elif cmd in ('get-attribute', 'get-attribute-id'):
+                    key = self._get_attribute_name(proc, cmd)
+                    trace.request('get-attribute', key)
+                    value = self._read_attribute(obj, key)
+                    proc.send(value)
+                    if value is not None:
+                        result.input_attrs[key] = obj.get_signature(key)
+                elif cmd == 'get-attribute-range':
                     key = proc.get_item()
-                    if key in obj:
-                        proc.send(obj[key])
+                    offset = int(proc.get_item())
+                    length = int(proc.get_item())
+                    trace.request(cmd, key, offset, length)
+                    value = self._read_attribute_range(obj, key, offset,
+                                length)
+                    if value is not None:
+                        proc.send(value)
                         result.input_attrs[key] = obj.get_signature(key)
                     else:
                         proc.send(None)
-                elif cmd == 'set-attribute':
-                    key = proc.get_item()
+                elif cmd in ('read-attribute', 'read-attribute-id'):
+                    # The filter host satisfied a read from attributes it
+                    # already had; record the dependency.  No reply.
+                    key = self._get_attribute_name(proc, cmd)
+                    if key in obj:
+                        result.input_attrs[key] = obj.get_signature(key)
+                elif cmd in ('set-attribute', 'set-attribute-id'):
+                    key = self._get_attribute_name(proc, cmd)
                     value = proc.get_item()
                     obj[key] = value
                     result.output_attrs[key] = obj.get_signature(key)
-                elif cmd == 'omit-attribute':
-                    key = proc.get_item()
+                elif cmd in ('omit-attribute', 'omit-attribute-id'):
+                    key = self._get_attribute_name(proc, cmd)
+                    trace.request('omit-attribute', key)
                     try:
                         obj.omit(key)
                         proc.send(True)
@@ -350,6 +927,7 @@ class _FilterRunner(_ObjectProcessor):
                         proc.send(False)
                 elif cmd == 'get-session-variables':
                     keys = proc.get_array()
+                    trace.request(cmd, *keys)
                     valuemap = self._state.session_vars.filter_get(keys)
                     values = [valuemap[key] for key in keys]
                     proc.send(values)
@@ -389,16 +967,42 @@ class _FilterRunner(_ObjectProcessor):
                     _log.log(level, message)
                 elif cmd == 'stdout':
                     print proc.get_item(),
+                elif cmd == 'spans':
+                    self._add_spans(obj, proc.get_item())
                 elif cmd == 'result':
                     result.score = float(proc.get_item())
+                    self._disarm(proc, armed)
+                    armed = None
+                    trace.result(result.score)
+                    proc.clean = True
+                    if self._load_failed:
+                        raise _DropObject()
                     break
+                elif cmd == 'deadline-expired':
+                    # The filter gave up on the object.  Drop it without
+                    # caching, since the result depends on timing.
+                    self._disarm(proc, armed)
+                    armed = None
+                    trace.result(None)
+                    proc.clean = True
+                    self._filter.stats.update('objs_timeout')
+                    raise _DropObject()
                 elif cmd == '':
                     # Encountered EOF on pipe
                     raise IOError()
                 else:
                     raise FilterExecutionError('%s: unknown command' % self)
         except IOError:
-            if self._proc_initialized:
+            if self._host is not None:
+                self._host.reset()
+            if proc.timed_out:
+                _log.warning('Killed filter %s (signature %s) after it '
+                                'overran its deadline on object %s',
+                                self, self._filter.signature, obj)
+                self._filter.stats.update('objs_timeout')
+                self._proc = None
+                raise _DropObject()
+            elif self._proc_initialized:
                 # Filter died on an object.  Drop the object without caching
                 # the result.
                 _log.error('Filter %s (signature %s) died on object %s',
@@ -411,14 +1015,23 @@ class _FilterRunner(_ObjectProcessor):
                 raise FilterExecutionError("Filter %s failed to initialize"
                                 % self)
         finally:
+            if self._host is not None:
+                self._host.end(obj)
+            if armed is not None:
+                watchdog.disarm(proc, armed)
+            proc.lock.release()
             accept = self.threshold(result)
             self._filter.stats.update('objs_processed', 'objs_compute',
                                     objs_dropped=int(not accept),
                                     execution_ns=timer.elapsed)
+            self._state.stats.update(filter_ns=timer.elapsed)
             lengths = [len(obj[k]) for k in result.output_attrs]
             throughput = int(sum(lengths) / timer.elapsed_seconds)
             if throughput < ATTRIBUTE_CACHE_THRESHOLD:
                 result.cache_output = True
+            if obj.trace is not None:
+                obj.trace.end(self._filter.name, span_start, 'filter',
+                                score=result.score)
         return result
 
     def threshold(self, result):
@@ -443,7 +1056,9 @@ class Filter(object):
         # Will be initialized during resolve()
         self.code_path = None
         self.signature = None
-        self.blob = None
+        self.blob_path = None
+        self.blob_signature = None
+        self.shared = False
         self._digest_prefix = None
 
     def get_cache_digest(self):
@@ -451,22 +1066,33 @@ class Filter(object):
         its arguments) already hashed into it.'''
         return self._digest_prefix.copy()
 
+    def pool_identity(self):
+        '''Return a description of the filter that is the same in every
+        search running it, for pooling its processes.  resolve() must be
+        called first.'''
+        return [self.name, self.signature, self.arguments,
+                                self.blob_signature]
+
     def resolve(self, state):
         '''Ensure filter code and blob argument are available in the blob
-        cache, load the blob argument, and initialize the cache digest.'''
+        cache, find the blob argument, and initialize the cache digest.'''
         if self.code_path is not None:
             return
         # Get path to filter code
         code_path, signature = self._resolve_code(state)
-        # Get contents of blob argument
-        blob = self._resolve_blob(state)
-        # Initialize digest
-        summary = [signature] + self.arguments + [blob]
+        # Get path to blob argument.  The filter maps the file, so the
+        # blob is never read into the server.
+        blob_path, blob_signature = self._resolve_blob(state)
+        # Initialize digest.  The blob cache is content-addressed, so the
+        # blob signature stands in for its contents.
+        summary = [signature] + self.arguments + [blob_signature]
         digest_prefix = md5(' '.join(summary))
         # Commit
         self.code_path = code_path
         self.signature = signature
-        self.blob = blob
+        self.blob_path = blob_path
+        self.blob_signature = blob_signature
+        self.shared = _is_shared_object(code_path)
         self._digest_prefix = digest_prefix
 
     def _resolve_code(self, state):
@@ -483,11 +1109,12 @@ class Filter(object):
             raise FilterUnsupportedSource()
 
     def _resolve_blob(self, state):
-        '''Returns blob data.'''
+        '''Returns (blob_path, signature).'''
         scheme, path = split_scheme(self.blob_source)
         if scheme == state.blob_cache.digest:
+            sig = path
             try:
-                return state.blob_cache[path]
+                return (state.blob_cache.data_path(sig), sig)
             except KeyError:
                 raise FilterDependencyError('Missing blob for filter ' +
                                         self.name)
@@ -506,30 +1133,150 @@ class Filter(object):
         else:
             raise FilterUnsupportedSource()
 
-    def bind(self, state):
-        '''Return a _FilterRunner for this filter.'''
+    def bind(self, state, host=None):
+        '''Return a _FilterRunner for this filter.  host is the _FilterHost
+        to run a shared-object filter in.'''
         # resolve() must be called first
         assert self.code_path is not None
-        return _FilterRunner(state, self)
+        assert self.shared == (host is not None)
+        return _FilterRunner(state, self, host)
 
 
 class FilterStackRunner(threading.Thread):
     '''A context for processing objects with a FilterStack.  Handles querying
     and updating the result and attribute caches.'''
 
-    def __init__(self, state, filter_runners, name, cleanup):
+    def __init__(self, state, filter_runners, name, cleanup, place=None,
+                last_readers=None, keep_attrs=None, ranking=None,
+                memory=None, worker=None):
         threading.Thread.__init__(self, name=name)
         self.setDaemon(True)
         self._state = state
         self._runners = filter_runners
+        self._place = place	# Called at thread startup to set affinity
+        # If last_readers is specified, it gives the position of the last
+        # runner that may read the output attributes of each runner, or
+        # None if they must be kept.  Other output attributes, except
+        # those in keep_attrs, are released as soon as they are dead.
+        self._last_reader = dict()
+        if last_readers is not None:
+            self._last_reader = dict(zip(filter_runners, last_readers))
+        self._keep_attrs = keep_attrs or set()
+        # If specified, only objects that rank among the top K are accepted
+        self._ranking = ranking
+        # If specified, the MemoryBudget that in-flight objects are
+        # charged to
+        self._memory = memory
+        # Our number for state.workers, if it adjusts the active workers
+        self._worker = worker
+        self._charged = 0	# Bytes charged to the memory budget
         self._redis = None	# May be None if caching is not enabled
         self._cleanup = cleanup	# cleanup.__del__ fires when all workers exit
         self._warned_cache_update = False
+        self._content_keyed = state.config.cache_content_addressed
+        self._trace = None	# ObjectTrace of the current object, if any
+        self._cached = dict()	# obj -> _cache_lookup() result of its group
 
     def _get_attribute_key(self, value_sig):
         '''Return an attribute cache lookup key for the specified signature.'''
         return 'attribute:' + value_sig
 
+    def _get_data_signature_key(self, obj):
+        '''Return a data signature index key for the object.'''
+        return 'datasig:' + md5(str(obj)).hexdigest()
+
+    def _get_cache_keys(self, obj, runners, data_sig):
+        '''Return a runner -> result cache key mapping.  If content-addressed
+        caching is enabled, data_sig is the signature of the object data;
+        runners that can be keyed by it but for which it is not yet known
+        are omitted.'''
+        keys = dict()
+        for runner in runners:
+            if self._content_keyed and runner.content_keyed:
+                if data_sig is not None:
+                    keys[runner] = runner.get_cache_key(obj, data_sig)
+            else:
+                keys[runner] = runner.get_cache_key(obj)
+        return keys
+
+    def _cache_get(self, keys):
+        '''Return the cached values of the keys, with None for keys that
+        are not cached.  Keys known to be absent are not looked up.'''
+        trace = self._trace
+        span_start = trace is not None and trace.begin()
+        known = self._state.cache_keys
+        if known is None or not known.ready:
+            values = self._redis.mget(keys)
+            if trace is not None:
+                trace.end('cache-lookup', span_start, keys=len(keys))
+            return values
+        probe = [k for k in keys if k in known]
+        found = dict()
+        if probe:
+            found = dict(zip(probe, self._redis.mget(probe)))
+        if trace is not None:
+            trace.end('cache-lookup', span_start, keys=len(probe),
+                                skipped=len(keys) - len(probe))
+        hits = len([v for v in found.itervalues() if v is not None])
+        self._state.stats.update(cache_filter_misses=len(keys) - len(probe),
+                                cache_filter_hits=hits,
+                                cache_filter_false_positives=len(probe) - hits)
+        return [found.get(k) for k in keys]
+
+    def _result_cache_lookup(self, cache_keys):
+        '''Look up the specified runner -> key mapping in the result cache
+        and return a runner -> _FilterResult mapping for results that
+        exist.'''
+        return self._result_cache_lookup_all([cache_keys])[0]
+
+    def _result_cache_lookup_all(self, cache_key_maps):
+        '''Look up a list of runner -> key mappings in the result cache in
+        one request, and return the corresponding list of
+        runner -> _FilterResult mappings.'''
+        if self._redis is None:
+            return [dict() for m in cache_key_maps]
+        lookups = [(i, runner, keys[runner])
+                        for i, keys in enumerate(cache_key_maps)
+                        for runner in keys]
+        if not lookups:
+            return [dict() for m in cache_key_maps]
+        timer = Timer()
+        values = self._cache_get([key for i, runner, key in lookups])
+        self._state.stats.update(cache_ns=timer.elapsed)
+        results = [dict() for m in cache_key_maps]
+        for (i, runner, key), data in zip(lookups, values):
+            result = _FilterResult.decode(data)
+            if result is not None:
+                results[i][runner] = result
+        return results
+
+    def _cache_lookup(self, objs):
+        '''Look up the cached results of a group of objects, in as few
+        cache requests as possible.  Return an obj -> (data signature,
+        runner -> result cache key, runner -> cached _FilterResult,
+        whether the object can be dropped) mapping.'''
+        # If result cache keys are derived from the object data, try to
+        # find the signatures without fetching the objects.
+        data_sigs = [None] * len(objs)
+        if self._content_keyed and self._redis is not None and objs:
+            timer = Timer()
+            data_sigs = self._cache_get([self._get_data_signature_key(obj)
+                                for obj in objs])
+            self._state.stats.update(cache_ns=timer.elapsed)
+
+        # Calculate runner -> result cache key mappings, and look up all
+        # filter results in the cache.
+        cache_keys = [self._get_cache_keys(obj, self._runners, sig)
+                                for obj, sig in zip(objs, data_sigs)]
+        cache_results = self._result_cache_lookup_all(cache_keys)
+
+        ret = dict()
+        for obj, sig, keys, results in zip(objs, data_sigs, cache_keys,
+                                cache_results):
+            ret[obj] = (sig, keys, results,
+                                self._result_cache_can_drop(obj, results))
+        return ret
+
     def _result_cache_can_drop(self, obj, cache_results):
         '''Return True if the object can be dropped.  cache_results is a
         runner -> _FilterResult map retrieved from the result cache.'''
@@ -634,7 +1381,9 @@ class FilterStackRunner(threading.Thread):
         cache_keys = [self._get_attribute_key(result.output_attrs[k])
                         for k in keys]
         if self._redis is not None and len(cache_keys) > 0:
-            values = self._redis.mget(cache_keys)
+            timer = Timer()
+            values = self._cache_get(cache_keys)
+            self._state.stats.update(cache_ns=timer.elapsed)
         else:
             values = [None for k in cache_keys]
         if None in values:
@@ -654,29 +1403,40 @@ class FilterStackRunner(threading.Thread):
     def _evaluate(self, obj):
         _debug('Evaluating %s', obj)
 
-        # Calculate runner -> result cache key mapping.
-        cache_keys = dict([(r, r.get_cache_key(obj)) for r in self._runners])
-
-        # Look up all filter results in the cache and build runner -> result
-        # mapping for results that exist.
-        if self._redis is not None:
-            keys = [cache_keys[r] for r in self._runners]
-            results = [(runner, _FilterResult.decode(data))
-                                for runner, data in
-                                zip(self._runners, self._redis.mget(keys))]
-            # runner -> _FilterResult
-            cache_results = dict([(k, v) for k, v in results if v is not None])
-        else:
-            cache_results = dict()
-
-        # Evaluate the object in the result cache.
-        if self._result_cache_can_drop(obj, cache_results):
+        # Evaluate the object in the result cache, which was normally
+        # searched when the object's group was taken from the scope.
+        try:
+            cached = self._cached.pop(obj)
+        except KeyError:
+            cached = self._cache_lookup([obj])[obj]
+        data_sig, cache_keys, cache_results, drop = cached
+        if drop:
             return False
 
         new_results = dict()		# runner -> result
+        results = dict()		# runner -> result, new or cached
+        resultmap = dict()		# extra cache updates
+        rank_score = None
         try:
             # Run each filter or load its prior result into the object.
             for runner in self._runners:
+                if runner not in cache_keys:
+                    # The object data has now been fetched, so we can
+                    # look up the results that are keyed by it.
+                    sig = obj.get_signature(ATTR_DATA)
+                    if sig != data_sig:
+                        resultmap[self._get_data_signature_key(obj)] = sig
+                    pending = [r for r in self._runners
+                                if r not in cache_keys]
+                    keys = self._get_cache_keys(obj, pending, sig)
+                    cache_keys.update(keys)
+                    cache_results.update(self._result_cache_lookup(keys))
+                    # Our own fresh results can complete the dependency
+                    # chain of a cached drop decision.
+                    known = dict(cache_results)
+                    known.update(new_results)
+                    if self._result_cache_can_drop(obj, known):
+                        return False
                 if (runner in cache_results and
                             self._attribute_cache_try_load(runner, obj,
                             cache_results[runner])):
@@ -684,6 +1444,14 @@ class FilterStackRunner(threading.Thread):
                 else:
                     result = runner.evaluate(obj)
                     new_results[runner] = result
+                    # Attribute cache entries, if the filter was expensive
+                    # enough.  Copy the values now, since they may be
+                    # released before the cache is updated.
+                    if result.cache_output:
+                        resultmap.update([(self._get_attribute_key(valsig),
+                                        obj[key]) for key, valsig in
+                                        result.output_attrs.iteritems()])
+                results[runner] = result
                 if not runner.threshold(result):
                     # Drop decision.
                     return False
@@ -694,47 +1462,124 @@ class FilterStackRunner(threading.Thread):
                     # searches.
                     attrname = ATTR_FILTER_SCORE % runner
                     obj[attrname] = str(result.score) + '\0'
-            # Object passes all filters, accept
+                    if (self._ranking is not None and
+                                attrname == self._ranking.attr):
+                        # Don't run later filters on an object that can
+                        # no longer make the cut
+                        rank_score = result.score
+                        if not self._ranking.may_place(rank_score):
+                            self._state.stats.update('objs_outranked')
+                            return False
+                self._release_dead(obj, runner, results)
+                self._charge(obj)
+            # Object passes all filters.  Accept it unless it is ranked
+            # out by the objects already returned.  Check before fetching
+            # object data that no filter read, but only record the score
+            # once the object can be sent.
+            if (self._ranking is not None and
+                        not self._ranking.may_place(rank_score)):
+                self._state.stats.update('objs_outranked')
+                return False
+            # The client may want object data that no filter read
+            push_attrs = self._state.blast.push_attrs
+            if (obj.is_deferred(ATTR_DATA) and
+                        (push_attrs is None or ATTR_DATA in push_attrs)):
+                obj.load_deferred(ATTR_DATA)
+            if (self._ranking is not None and
+                        not self._ranking.place(rank_score)):
+                self._state.stats.update('objs_outranked')
+                return False
             return True
-        except _DropObject:
+        except (_DropObject, ObjectLoadError):
+            # Deferred data that could not be loaded has been logged
             return False
         finally:
             # Update the cache with new values
-            resultmap = dict()
             for runner, result in new_results.iteritems():
                 # Result cache entry
                 resultmap[cache_keys[runner]] = result.encode()
-                # Attribute cache entries, if the filter was expensive enough
-                if result.cache_output:
-                    resultmap.update([(self._get_attribute_key(valsig),
-                                            obj[key]) for key, valsig in
-                                            result.output_attrs.iteritems()])
             # Do it
             if self._redis is not None and resultmap:
+                timer = Timer()
+                span_start = obj.trace is not None and obj.trace.begin()
                 try:
                     self._redis.mset(resultmap)
+                    if self._state.cache_keys is not None:
+                        self._state.cache_keys.add(resultmap)
                 except ResponseError, e:
                     # mset failed, possibly due to maxmemory quota
                     if not self._warned_cache_update:
                         self._warned_cache_update = True
                         _log.warning('Failed to update cache: %s', e)
+                self._state.stats.update(cache_ns=timer.elapsed)
+                if obj.trace is not None:
+                    obj.trace.end('cache-update', span_start,
+                                keys=len(resultmap))
+
+    def _release_dead(self, obj, runner, results):
+        '''Release the output attributes that no runner after this one
+        will read.  results maps the runners executed so far on this
+        object to their results.'''
+        if not self._last_reader:
+            return
+        position = self._runners.index(runner)
+        live = set()
+        dead = set()
+        for producer, result in results.iteritems():
+            last = self._last_reader[producer]
+            if last is None or last > position:
+                live.update(result.output_attrs)
+            elif last == position:
+                dead.update(result.output_attrs)
+        for key in dead - live - self._keep_attrs:
+            if key in obj:
+                obj.release(key)
+
+    def _charge(self, obj):
+        '''Update the memory budget with the current size of the object.'''
+        if self._memory is not None and self._memory.limited:
+            size = obj.data_size()
+            self._memory.charge(size - self._charged)
+            self._charged = size
+
+    def _discharge(self):
+        '''Return the memory of the finished object to the budget.'''
+        if self._memory is not None:
+            self._memory.charge(-self._charged)
+        self._charged = 0
+
+    def prestart(self):
+        '''Start the filter processes ahead of the first object.'''
+        for runner in self._runners:
+            runner.prestart()
 
     def evaluate(self, obj):
         '''Evaluate the object and return True to accept or False to drop.'''
         timer = Timer()
         accept = False
+        self._trace = obj.trace
         try:
             accept = self._evaluate(obj)
         finally:
+            self._trace = None
+            for runner in self._runners:
+                runner.done(obj)
             self._state.stats.update('objs_processed',
                                     execution_ns=timer.elapsed,
                                     objs_passed=int(accept),
                                     objs_dropped=int(not accept))
         return accept
 
+    def release(self):
+        '''Kill our filter processes while this worker is inactive.'''
+        for runner in self._runners:
+            runner.release()
+
     def run(self):
         '''Thread function.'''
         try:
+            if self._place is not None:
+                self._place()
             config = self._state.config
             if config.cache_server is not None:
                 host, port = config.cache_server
@@ -744,11 +1589,61 @@ class FilterStackRunner(threading.Thread):
                 # Ensure the Redis server is available
                 self._redis.ping()
 
-            # ScopeListLoader properly handles interleaved access by
-            # multiple threads
-            for obj in self._state.scope:
-                if self.evaluate(obj):
-                    self._state.blast.send(obj)
+            # ScopeListLoader hands out objects parsed by its own threads
+            # and handles access by multiple workers
+            scope = self._state.scope
+            batch = max(config.object_batch, 1)
+            workers = self._worker is not None and self._state.workers
+            pending = deque()
+            while True:
+                if not pending:
+                    # Only park between groups, so that an inactive worker
+                    # doesn't hold objects other workers could process
+                    if workers:
+                        workers.admit(self._worker, self.release)
+                    # Don't take on another group while in-flight objects
+                    # exhaust the memory budget.  Prefetched data is
+                    # charged to the budget, so first discard whatever the
+                    # last group didn't use.
+                    for runner in self._runners:
+                        runner.expect([])
+                    self._state.memory.admit()
+                    timer = Timer()
+                    try:
+                        pending.extend(scope.take(batch))
+                    except StopIteration:
+                        if workers:
+                            # Let inactive workers see the end of the scope
+                            workers.finish()
+                        break
+                    finally:
+                        self._state.stats.update(scope_ns=timer.elapsed)
+                    # Allow the group to be fetched in one request, but
+                    # don't prefetch objects the result cache can drop
+                    self._cached = self._cache_lookup(list(pending))
+                    needed = [o for o in pending if not self._cached[o][3]]
+                    for runner in self._runners:
+                        runner.expect(needed)
+                obj = pending.popleft()
+                trace = obj.trace
+                if trace is not None:
+                    trace.start()
+                # Yield to interactive requests such as reexecution
+                self._state.priority.wait()
+                accept = False
+                try:
+                    accept = self.evaluate(obj)
+                    if accept:
+                        timer = Timer()
+                        span_start = trace is not None and trace.begin()
+                        self._state.blast.send(obj)
+                        self._state.stats.update(blast_ns=timer.elapsed)
+                        if trace is not None:
+                            trace.end('send', span_start)
+                finally:
+                    self._discharge()
+                    if trace is not None:
+                        trace.finish(accept)
         except ConnectionFailure:
             # Client closed blast connection.  Rather than just calling
             # sys.exit(), signal the main thread to shut us down.
@@ -758,6 +1653,166 @@ class FilterStackRunner(threading.Thread):
             os.kill(os.getpid(), signal.SIGUSR1)
 
 
+class PriorityGate(object):
+    '''Lets interactive work take priority over background scanning.  Used
+    as a context manager around priority work; scan workers call wait()
+    between objects and block while any priority work is in progress.'''
+
+    def __init__(self):
+        self._cond = threading.Condition()
+        self._active = 0
+
+    def __enter__(self):
+        with self._cond:
+            self._active += 1
+        return self
+
+    def __exit__(self, _type, _value, _traceback):
+        with self._cond:
+            self._active -= 1
+            if self._active == 0:
+                self._cond.notifyAll()
+
+    def wait(self):
+        '''Block until no priority work is in progress.'''
+        # Unlocked fast path, since this is called for every object
+        if self._active:
+            with self._cond:
+                while self._active:
+                    self._cond.wait()
+
+
+class MemoryBudget(object):
+    '''Limits the attribute memory of objects being scanned.  Workers call
+    admit() before taking on a group of objects, blocking while the budget
+    is exhausted, and charge() as the objects' attributes grow and shrink
+    and as their data is prefetched.  An admitted group is never blocked,
+    so no worker waits on another that is itself waiting; in-flight
+    objects may therefore overrun the budget until they finish.  A limit
+    of 0 disables the budget.'''
+
+    def __init__(self, limit):
+        self._cond = threading.Condition()
+        self._limit = limit
+        self._used = 0
+
+    @property
+    def limited(self):
+        return bool(self._limit)
+
+    def admit(self):
+        '''Wait until the budget has room for another object.'''
+        if not self._limit:
+            return
+        with self._cond:
+            while self._used >= self._limit:
+                self._cond.wait()
+
+    def charge(self, delta):
+        '''Add delta bytes to the memory in use.'''
+        if not self._limit or not delta:
+            return
+        with self._cond:
+            self._used += delta
+            if delta < 0:
+                self._cond.notify_all()
+
+
+class Watchdog(object):
+    '''Kills filter processes that are still evaluating an object twice
+    the deadline after they started.  Filters built with libfilter give up
+    on their own once the deadline passes; this catches those that do not
+    check for it or are stuck.  A deadline of 0 disables the watchdog.'''
+
+    def __init__(self, deadline_ms):
+        self._cond = threading.Condition()
+        self._timeout = 2 * deadline_ms / 1000.0
+        self._armed = {}		# proc -> (expiry time, token)
+        self._tokens = itertools.count(1)
+        self._thread = None
+
+    def arm(self, proc):
+        '''Start timing an evaluation by proc, and return a token for
+        disarming it.'''
+        if not self._timeout:
+            return None
+        with self._cond:
+            token = self._tokens.next()
+            self._armed[proc] = (monotonic_time() + self._timeout, token)
+            if self._thread is None:
+                self._thread = threading.Thread(name='watchdog',
+                                target=self._run)
+                self._thread.setDaemon(True)
+                self._thread.start()
+            self._cond.notify()
+            return token
+
+    def disarm(self, proc, token):
+        '''Stop timing the evaluation by proc for which arm() returned
+        token.  Return False if the watchdog has killed proc.'''
+        if token is None:
+            return True
+        with self._cond:
+            entry = self._armed.get(proc)
+            if entry is not None and entry[1] == token:
+                del self._armed[proc]
+            return not proc.timed_out
+
+    def _run(self):
+        with self._cond:
+            while True:
+                now = monotonic_time()
+                for proc, (expiry, _token) in self._armed.items():
+                    # Kill with the lock held, so that the evaluation
+                    # cannot be disarmed and another armed in between
+                    if expiry <= now:
+                        del self._armed[proc]
+                        proc.kill()
+                if self._armed:
+                    self._cond.wait(min([expiry for expiry, _token in
+                                self._armed.values()]) - now)
+                else:
+                    self._cond.wait()
+
+
+class Ranking(object):
+    '''Tracks the best count scores reported by the named filter, for
+    searches that return only the top-ranked objects.  Objects are
+    returned as they enter the top count, so the client must keep the
+    best count of the objects it receives.  The lowest of those scores
+    only rises, so an object that does not beat it can be dropped as
+    soon as the ranking filter has scored it.'''
+
+    def __init__(self, filter_name, count):
+        self.filter = filter_name
+        self.count = count
+        self.attr = ATTR_FILTER_SCORE % filter_name
+        self._lock = threading.Lock()
+        self._scores = []	# min-heap
+        # Lowest score in the full heap, or None.  Read without the lock.
+        self._floor = None
+
+    def may_place(self, score):
+        '''Return False if an object with this score cannot make the
+        cut.'''
+        floor = self._floor
+        return floor is None or score > floor
+
+    def place(self, score):
+        '''Return True if an object with this score is among the best
+        seen so far, recording its score.'''
+        with self._lock:
+            if len(self._scores) < self.count:
+                heapq.heappush(self._scores, score)
+            elif score > self._scores[0]:
+                heapq.heapreplace(self._scores, score)
+            else:
+                return False
+            if len(self._scores) == self.count:
+                self._floor = self._scores[0]
+            return True
+
+
 class Reference(object):
     '''When destroyed, calls the specified callback.'''
 
@@ -809,15 +1864,82 @@ class FilterStack(object):
     def __iter__(self):
         return iter(self._order)
 
-    def bind(self, state, name='Filter', cleanup=None):
+    def _get_last_readers(self):
+        '''Return a list giving, for each filter in execution order, the
+        position in the order of the last filter that may read its output
+        attributes.  A filter may read the outputs of the filters it
+        depends on, directly or indirectly, and the object data.'''
+        position = dict([(f, i) for i, f in enumerate(self._order)])
+        ancestors = dict()
+        last = range(len(self._order))
+        for i, f in enumerate(self._order):
+            deps = set()
+            for name in f.dependencies:
+                dep = self._filters[name]
+                deps.add(dep)
+                deps.update(ancestors[dep])
+            ancestors[f] = deps
+            for dep in deps:
+                last[position[dep]] = i
+        return last
+
+    def bind(self, state, name='Filter', cleanup=None, place=None,
+                scan=False, worker=None):
         '''Return a FilterStackRunner that can be used to process objects
-        with this filter stack.'''
-        fetcher = _ObjectFetcher(state)
-        runners = [fetcher] + [f.bind(state) for f in self._order]
-        return FilterStackRunner(state, runners, name, cleanup)
+        with this filter stack.  If specified, place is called from the
+        runner thread before it begins processing objects.  Runners for
+        the background scan (scan=True) release attributes once no later
+        filter or the client needs them, and observe the memory budget
+        and the search ranking, if any.  worker is the runner's number
+        for state.workers.'''
+        # Reexecution returns the object data, so only defer it in scans
+        fetcher = _ObjectFetcher(state, scan and state.config.lazy_data)
+        isolated = state.config.isolated_filters | state.config.debug_filters
+        hosted = [f for f in self._order if f.shared and
+                    f.name not in isolated and f.signature not in isolated]
+        common_host = hosted and _FilterHost(state, hosted) or None
+        runners = [fetcher]
+        for f in self._order:
+            if not f.shared:
+                host = None
+            elif f in hosted:
+                host = common_host
+            else:
+                host = _FilterHost(state, [f])
+            runners.append(f.bind(state, host))
+        last_readers = keep_attrs = ranking = memory = None
+        if scan:
+            ranking = state.ranking
+            memory = state.memory
+        if scan and state.blast.push_attrs is not None:
+            # Runner positions are offset by the fetcher, whose outputs
+            # (including the object data) any filter may read
+            last_readers = [None] + [i + 1 for i in self._get_last_readers()]
+            keep_attrs = state.blast.push_attrs
+        return FilterStackRunner(state, runners, name, cleanup, place,
+                                last_readers, keep_attrs, ranking, memory,
+                                worker)
 
     def start_threads(self, state, count):
-        '''Start count threads to process objects with this filter stack.'''
+        '''Start count threads to process objects with this filter stack.
+        If the configuration allows more, start that many and adjust how
+        many of them are active.'''
+        config = state.config
         cleanup = Reference(state.blast.close)
+        try:
+            placement = Placement(config)
+        except PlacementError, e:
+            _log.error('Not pinning worker threads: %s', e)
+            placement = None
+        if config.max_threads > count:
+            state.workers = WorkerController(state, config.min_threads,
+                                config.max_threads, count)
+            count = config.max_threads
         for i in xrange(count):
-            self.bind(state, 'Filter-%d' % i, cleanup).start()
+            place = None
+            if placement is not None and placement.mode != 'none':
+                place = partial(placement.apply, i)
+            self.bind(state, 'Filter-%d' % i, cleanup, place, scan=True,
+                                worker=i).start()
+        if state.workers is not None:
+            state.workers.start()
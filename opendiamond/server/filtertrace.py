@@ -0,0 +1,133 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2012 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''Filter session traces.
+
+A trace records the conversation between diamondd and one filter process
+so that diamond-filter-replay can later rerun the filter against the same
+inputs.  The trace file is gzip-compressed.  All integers are big-endian.
+
+    magic       4 bytes         'DFTR'
+    version     uint32          1
+    records
+
+Each record is:
+
+    kind        1 byte          one of the TRACE_* constants
+    time        uint64          ns since the trace was started
+    length      uint32          length of the payload
+    payload     length bytes
+
+A trace begins with a TRACE_ARGV record giving the filter command line,
+TRACE_BLOB records holding the blob arguments that the handshake names by
+path, and TRACE_SEND records containing the handshake.  Each object
+evaluation starts with a TRACE_OBJECT record and ends with a TRACE_RESULT
+record.  Between them, a TRACE_REQUEST record gives a filter request that
+needs a reply, and the following TRACE_SEND record contains the reply.
+Other TRACE_SEND records contain data sent without a request.
+'''
+
+import gzip
+import struct
+
+from opendiamond.server.statistics import monotonic_time
+
+MAGIC = 'DFTR'
+VERSION = 1
+
+# Payloads are NUL-separated lists except where noted
+TRACE_ARGV = 'A'		# Filter command line
+TRACE_BLOB = 'B'		# Path, file contents
+TRACE_SEND = 'S'		# Raw bytes written to the filter
+TRACE_OBJECT = 'O'		# Filter name, object ID
+TRACE_REQUEST = 'Q'		# Command, then its arguments
+TRACE_RESULT = 'R'		# Filter score
+
+_HEADER = struct.Struct('>4sI')
+_RECORD = struct.Struct('>cQI')
+
+class FilterTraceError(Exception):
+    '''Malformed filter trace.'''
+
+
+class FilterTraceWriter(object):
+    '''Writes a filter session trace.  Not thread-safe; a trace belongs to
+    a single filter process.'''
+
+    def __init__(self, path, argv):
+        self._start = monotonic_time()
+        # Favor speed over size; traces are written during searches
+        self._fh = gzip.GzipFile(path, 'wb', 1)
+        self._fh.write(_HEADER.pack(MAGIC, VERSION))
+        self._record(TRACE_ARGV, '\0'.join(argv))
+
+    def _record(self, kind, payload):
+        time = int((monotonic_time() - self._start) * 1e9)
+        self._fh.write(_RECORD.pack(kind, time, len(payload)))
+        self._fh.write(payload)
+
+    def blob(self, path):
+        '''Record the contents of a file that the filter will read.'''
+        fh = open(path, 'rb')
+        try:
+            self._record(TRACE_BLOB, path + '\0' + fh.read())
+        finally:
+            fh.close()
+
+    def send(self, *pieces):
+        '''Record data written to the filter.'''
+        self._record(TRACE_SEND, ''.join(pieces))
+
+    def begin(self, filter, obj):
+        '''Record the start of an object evaluation.'''
+        self._record(TRACE_OBJECT, '%s\0%s' % (filter, obj))
+
+    def request(self, *args):
+        '''Record a request whose reply will be sent next.'''
+        self._record(TRACE_REQUEST, '\0'.join([str(a) for a in args]))
+
+    def result(self, score):
+        '''Record the end of an object evaluation.  A score of None means
+        that the filter overran its deadline.'''
+        if score is None:
+            self._record(TRACE_RESULT, '')
+        else:
+            self._record(TRACE_RESULT, repr(score))
+
+    def close(self):
+        '''Finish the trace.'''
+        self._fh.close()
+
+
+def read_trace(path):
+    '''Yield (kind, time, payload) tuples for the records in a trace.'''
+    fh = gzip.GzipFile(path, 'rb')
+    try:
+        try:
+            magic, version = _HEADER.unpack(fh.read(_HEADER.size))
+            if magic != MAGIC or version != VERSION:
+                raise FilterTraceError('Bad trace header')
+            while True:
+                buf = fh.read(_RECORD.size)
+                if not buf:
+                    return
+                kind, time, length = _RECORD.unpack(buf)
+                payload = fh.read(length)
+                if len(payload) != length:
+                    raise FilterTraceError('Truncated trace')
+                yield kind, time, payload
+        except (struct.error, IOError, EOFError), e:
+            # Traces of searches that were killed are missing their gzip
+            # trailer
+            raise FilterTraceError('Truncated trace: %s' % e)
+    finally:
+        fh.close()
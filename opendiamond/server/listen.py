@@ -10,7 +10,8 @@
 #  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
 #
 
-'''Listening for new connections; pairing control and data connections.'''
+'''Listening for new connections; pairing control and data connections;
+answering work stealing lookups and filter pool requests.'''
 
 import binascii
 import errno
@@ -22,6 +23,8 @@ from weakref import WeakValueDictionary
 
 from opendiamond.helpers import connection_ok
 from opendiamond.protocol import PORT, NONCE_LEN, NULL_NONCE
+from opendiamond.server.pool import EXPIRE_INTERVAL
+from opendiamond.server.steal import lookup_port
 
 # Listen parameters
 BACKLOG = 16
@@ -92,12 +95,48 @@ class _PendingConn(object):
         return binascii.hexlify(self.nonce)
 
 
+class _PendingLookup(object):
+    '''A peer server asking which port one of our searches accepts work
+    stealing requests on.  The request is a search key terminated by a
+    newline; the reply is the port, or an empty line if there is no such
+    search.'''
+
+    def __init__(self, sock, peer, directory):
+        self.sock = sock
+        self.sock.setblocking(0)
+        self.peer = peer
+        self._directory = directory
+        self._buf = ''
+
+    def answer(self):
+        '''Try to read the request and answer it.  Returns True when done,
+        False if the caller should call back later.'''
+        data = self.sock.recv(64)
+        if len(data) == 0:
+            raise _ConnectionClosed()
+        self._buf += data
+        if '\n' not in self._buf:
+            if len(self._buf) > 64:
+                raise _ConnectionClosed()
+            return False
+        key = self._buf.split('\n', 1)[0].strip()
+        port = lookup_port(self._directory, key)
+        self.sock.setblocking(1)
+        try:
+            self.sock.sendall('%s\n' % (port or ''))
+        except socket.error:
+            raise _ConnectionClosed()
+        return True
+
+
 class _ListeningSocket(object):
     '''A wrapper class for a listening socket which is to be added to a
-    _PendingConnPollSet.'''
+    _PendingConnPollSet.  If steal_dir is specified, the socket accepts
+    work stealing lookups for the searches registered there.'''
 
-    def __init__(self, sock):
+    def __init__(self, sock, steal_dir=None):
         self.sock = sock
+        self.steal_dir = steal_dir
 
     def accept(self):
         return self.sock.accept()
@@ -125,12 +164,15 @@ class _PendingConnPollSet(object):
         self._pollset.unregister(fd)
         del self._fd_to_pconn[fd]
 
-    def poll(self):
+    def poll(self, timeout=None):
         '''Poll for events and return a list of (pconn, eventmask) pairs.
-        pconn will be None for events on the listening socket.'''
+        pconn will be None for events on the listening socket.  timeout
+        is in seconds; None waits indefinitely.'''
+        if timeout is not None:
+            timeout = int(timeout * 1000)
         while True:
             try:
-                items = self._pollset.poll()
+                items = self._pollset.poll(timeout)
             except select.error, e:
                 # If poll() was interrupted by a signal, retry.  If the
                 # signal was supposed to be fatal, the signal handler would
@@ -155,11 +197,29 @@ class _PendingConnPollSet(object):
 
 class ConnListener(object):
     '''Manager for listening socket and connections still in the matchmaking
-    process.'''
+    process.  If steal_port is specified, also answer work stealing lookups
+    on that port for the searches registered in steal_dir.  If pool is
+    specified, answer requests to the FilterPool and expire its processes
+    while waiting.'''
 
-    def __init__(self):
+    def __init__(self, port=PORT, steal_port=None, steal_dir=None,
+                pool=None):
+        self._poll = _PendingConnPollSet()
+        self._pool = pool
+        if pool is not None:
+            self._poll.register(pool, select.POLLIN)
+        for sock in self._bind(port):
+            self._poll.register(_ListeningSocket(sock), select.POLLIN)
+        if steal_port is not None:
+            for sock in self._bind(steal_port):
+                self._poll.register(_ListeningSocket(sock, steal_dir),
+                                    select.POLLIN)
+        self._nonce_to_pending = WeakValueDictionary()
+
+    def _bind(self, port):
+        '''Return a list of sockets listening on the port.'''
         # Get a list of potential bind addresses
-        addrs = socket.getaddrinfo(None, PORT, 0, socket.SOCK_STREAM, 0,
+        addrs = socket.getaddrinfo(None, port, 0, socket.SOCK_STREAM, 0,
                                     socket.AI_PASSIVE)
         # Try to bind to each address
         socks = []
@@ -181,11 +241,7 @@ class ConnListener(object):
         if not socks:
             # None of the addresses worked
             raise ListenError("Couldn't bind listening socket")
-
-        self._poll = _PendingConnPollSet()
-        for sock in socks:
-            self._poll.register(_ListeningSocket(sock), select.POLLIN)
-        self._nonce_to_pending = WeakValueDictionary()
+        return socks
 
     def _accept(self, lsock):
         '''Accept waiting connections and add them to the pollset.'''
@@ -195,7 +251,10 @@ class ConnListener(object):
                 sock.setsockopt(socket.SOL_SOCKET, socket.SO_KEEPALIVE, 1)
                 host = addr[0]
                 if connection_ok('diamondd', host):
-                    pconn = _PendingConn(sock, host)
+                    if lsock.steal_dir is not None:
+                        pconn = _PendingLookup(sock, host, lsock.steal_dir)
+                    else:
+                        pconn = _PendingConn(sock, host)
                     _log.debug('New connection from %s', pconn.peer)
                     self._poll.register(pconn, select.POLLIN)
                 else:
@@ -204,6 +263,14 @@ class ConnListener(object):
         except socket.error:
             pass
 
+    def _lookup(self, pconn):
+        '''Handle poll readiness events on the specified lookup.'''
+        try:
+            if pconn.answer():
+                self._poll.unregister(pconn)
+        except (_ConnectionClosed, socket.error):
+            self._poll.unregister(pconn)
+
     def _traffic(self, pconn):
         '''Handle poll readiness events on the specified pconn.'''
         try:
@@ -246,10 +313,20 @@ class ConnListener(object):
     def accept(self):
         '''Returns a new (control, data) connection pair.'''
         while True:
-            for pconn, _flags in self._poll.poll():
-                if hasattr(pconn, 'accept'):
+            if self._pool is not None:
+                self._pool.expire()
+                events = self._poll.poll(EXPIRE_INTERVAL)
+            else:
+                events = self._poll.poll()
+            for pconn, _flags in events:
+                if pconn is self._pool:
+                    self._pool.serve()
+                elif hasattr(pconn, 'accept'):
                     # Listening socket
                     self._accept(pconn)
+                elif hasattr(pconn, 'answer'):
+                    # Work stealing lookup
+                    self._lookup(pconn)
                 else:
                     # Traffic on a pending connection; attempt to pair it
                     ret = self._traffic(pconn)
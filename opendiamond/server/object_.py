@@ -18,6 +18,8 @@ from urlparse import urljoin
 import simplejson as json
 
 from opendiamond.helpers import md5, split_scheme
+from opendiamond.objectbatch import (BATCH_HEADER, ObjectBatchError,
+        decode as decode_batch)
 from opendiamond.protocol import XDR_attribute, XDR_object
 
 ATTR_HEADER_URL = 'x-attributes'
@@ -36,6 +38,23 @@ class ObjectLoadError(Exception):
     '''Object failed to load.'''
 
 
+def _get_header(headers, name):
+    '''Look up a header case-insensitively.'''
+    name = name.lower()
+    for key, value in headers.iteritems():
+        if key.lower() == name:
+            return value
+    return None
+
+
+def _get_strong_etag(headers):
+    '''Return the strong entity tag in the headers, or None.'''
+    etag = _get_header(headers, 'ETag')
+    if etag is None or etag.startswith('W/'):
+        return None
+    return etag
+
+
 class EmptyObject(object):
     '''An immutable Diamond object with no data and no attributes.'''
 
@@ -43,6 +62,21 @@ class EmptyObject(object):
         self._attrs = dict()
         self._signatures = dict()
         self._omit_attrs = set()
+        # Attributes whose values were released; the names are still sent
+        self._released = set()
+        # Attributes whose values are loaded when first read:
+        # name -> function that loads them into the object
+        self._deferred = dict()
+        # Deferred attributes known by a signature before they are loaded:
+        # name -> signature, which the value keeps once loaded
+        self._deferred_signatures = dict()
+        # Deferred attributes that can be read in part without loading
+        # them: name -> function that reads a range
+        self._range_loaders = dict()
+        # ObjectTrace if the object was sampled for tracing
+        self.trace = None
+        # Incremented whenever an attribute value is set
+        self.version = 0
 
     def __str__(self):
         return ''
@@ -55,18 +89,54 @@ class EmptyObject(object):
         return self._attrs.iterkeys()
 
     def __contains__(self, key):
-        return key in self._attrs
+        return key in self._attrs or key in self._deferred
 
     def __getitem__(self, key):
+        if key in self._deferred:
+            self.load_deferred(key)
         return self._attrs[key]
 
     def __setitem__(self, key, value):
         raise TypeError()
 
     def get_signature(self, key):
-        '''Return the MD5 hash of the attribute value.'''
+        '''Return the MD5 hash of the attribute value, or the signature by
+        which a deferred value was known.  Signatures remain available
+        after the value is released.'''
+        if key in self._deferred:
+            try:
+                return self._deferred_signatures[key]
+            except KeyError:
+                self.load_deferred(key)
         return self._signatures[key]
 
+    def get_range(self, key, offset, length):
+        '''Return up to length bytes of the attribute value starting at
+        offset.  If the value is deferred and can be read in part, only
+        that part is loaded.'''
+        if key in self._deferred and key in self._range_loaders:
+            return self._range_loaders[key](self, offset, length)
+        return self[key][offset:offset + length]
+
+    def is_deferred(self, key):
+        '''Return True if the attribute exists but has not been loaded.'''
+        return key in self._deferred
+
+    def load_deferred(self, key):
+        '''Load the value of a deferred attribute.  Raises ObjectLoadError
+        if the value cannot be loaded, after which the object behaves as
+        though the attribute were absent.'''
+        load = self._deferred.pop(key)
+        signature = self._deferred_signatures.pop(key, None)
+        self._range_loaders.pop(key, None)
+        load(self)
+        if signature is not None:
+            self._signatures[key] = signature
+
+    def data_size(self):
+        '''Return the total size of the attribute values.'''
+        return sum([len(v) for v in self._attrs.itervalues()])
+
     def omit(self, key):
         '''Record that the attribute is not to be returned to the client.'''
         if key in self:
@@ -81,7 +151,8 @@ class EmptyObject(object):
             send_keys = set([ATTR_OBJ_ID])
         else:
             # Don't encode any evidence of omit attributes.
-            send_keys = set(self._attrs.keys()) - self._omit_attrs
+            send_keys = ((set(self._attrs.keys()) | self._released |
+                        set(self._deferred.keys())) - self._omit_attrs)
         # If we have an output set, only send values for send_keys that are
         # in it.  Otherwise, send values for all send_keys.
         if output_set is not None:
@@ -94,7 +165,7 @@ class EmptyObject(object):
         # Serialize
         attrs = []
         for name in send_keys:
-            if name in send_values:
+            if name in send_values and name in self._attrs:
                 value = self._attrs[name]
             else:
                 value = ''
@@ -127,6 +198,38 @@ class Object(EmptyObject):
     def __setitem__(self, key, value):
         self._attrs[key] = value
         self._signatures[key] = md5(value).hexdigest()
+        self.version += 1
+        self._released.discard(key)
+        self._deferred.pop(key, None)
+        self._deferred_signatures.pop(key, None)
+        self._range_loaders.pop(key, None)
+
+    def defer(self, key, load, signature=None, load_range=None):
+        '''Record that the attribute exists, but that its value is only to
+        be loaded, by calling load(obj), when it is first read.  load()
+        must set the attribute or raise ObjectLoadError.  If signature is
+        specified, the value is known by it rather than by its hash, so
+        that it can be identified without loading it.  If load_range is
+        specified, load_range(obj, offset, length) reads part of the value
+        without loading it, or raises ObjectLoadError.'''
+        self._deferred[key] = load
+        if signature is not None:
+            self._deferred_signatures[key] = signature
+        if load_range is not None:
+            self._range_loaders[key] = load_range
+
+    def release(self, key):
+        '''Free the value of an attribute that will no longer be read or
+        returned to the client.  The object then behaves as though the
+        attribute were absent, except that its signature is retained and
+        its name is still reported to the client.'''
+        if self._deferred.pop(key, None) is None:
+            del self._attrs[key]
+        elif key in self._deferred_signatures:
+            self._signatures[key] = self._deferred_signatures[key]
+        self._deferred_signatures.pop(key, None)
+        self._range_loaders.pop(key, None)
+        self._released.add(key)
 
 
 class _HttpLoader(object):
@@ -145,14 +248,28 @@ class _HttpLoader(object):
         self._headers = {}
         self._body = StringIO()
 
-    def get(self, url):
-        '''Fetch the specified URL and return (header_dict, body).'''
+    def get(self, url, post_data=None, byte_range=None):
+        '''Fetch the specified URL and return (header_dict, body).  If
+        post_data is specified, POST it rather than making a GET
+        request.  If byte_range is specified, ask for only the
+        (first, last) bytes of the body; the server may send the whole
+        body instead.'''
         # Perform the fetch
         self._curl.setopt(curl.URL, url)
+        if post_data is not None:
+            self._curl.setopt(curl.POSTFIELDS, post_data)
+        if byte_range is not None:
+            self._curl.setopt(curl.RANGE, '%d-%d' % byte_range)
         try:
-            self._curl.perform()
-        except curl.error, e:
-            raise ObjectLoadError(e[1])
+            try:
+                self._curl.perform()
+            except curl.error, e:
+                raise ObjectLoadError(e[1])
+        finally:
+            if post_data is not None:
+                self._curl.setopt(curl.HTTPGET, 1)
+            if byte_range is not None:
+                self._curl.unsetopt(curl.RANGE)
         # Localize fetched data and release this object's copy
         headers = self._headers
         self._headers = {}
@@ -160,6 +277,17 @@ class _HttpLoader(object):
         self._body = StringIO()
         return (headers, body)
 
+    def head(self, url):
+        '''Make a HEAD request for the specified URL and return the header
+        dict.'''
+        self._curl.setopt(curl.NOBODY, 1)
+        try:
+            headers, _body = self.get(url)
+        finally:
+            self._curl.setopt(curl.NOBODY, 0)
+            self._curl.setopt(curl.HTTPGET, 1)
+        return headers
+
     def _handle_header(self, hdr):
         hdr = hdr.rstrip('\r\n')
         if hdr.startswith('HTTP/'):
@@ -177,11 +305,28 @@ class _HttpLoader(object):
 class ObjectLoader(object):
     '''A context for populating an Object from the dataretriever.  Allows
     network connections to be reused to fetch multiple objects.  Must not
-    be used by more than one thread.'''
+    be used by more than one thread.  If memory is specified, the data of
+    prefetched objects is charged to that MemoryBudget until the objects
+    are loaded.'''
 
-    def __init__(self, config, blob_cache):
+    def __init__(self, config, blob_cache, memory=None):
         self._http = _HttpLoader(config)
         self._blob_cache = blob_cache
+        self._batch_size = config.object_batch
+        self._memory = memory
+        self._batch_urls = set()	# Batch URLs advertised by retrievers
+        self._upcoming = []		# URLs of objects expected to be loaded
+        self._prefetched = {}		# URL -> (attrs, data)
+
+    def expect(self, objs):
+        '''Note objects that are likely to be loaded soon.  When one of
+        them is loaded from a dataretriever that supports batching, the
+        others from the same dataretriever are fetched in the same
+        request.  Objects prefetched for an earlier call, but not loaded,
+        are discarded.'''
+        self._upcoming = [str(obj) for obj in objs]
+        for url in self._prefetched.keys():
+            self._take_prefetched(url)
 
     def source_available(self, obj):
         '''Examine the Object and return whether we think we will be able
@@ -208,6 +353,72 @@ class ObjectLoader(object):
         if ATTR_DISPLAY_NAME not in obj:
             obj[ATTR_DISPLAY_NAME] = uri + '\0'
 
+    def load_attributes(self, obj):
+        '''Retrieve the initial attributes of the Object, but not its data
+        if that can be avoided.  Return None if the data was loaded.
+        Otherwise return the dataretriever's response headers; load_data()
+        must then be called before the data is read.'''
+        uri = str(obj)
+        scheme, _path = split_scheme(uri)
+        if scheme == self._blob_cache.digest:
+            # Local; nothing to save
+            self.load(obj)
+            return None
+        try:
+            headers = self._http.head(uri)
+        except ObjectLoadError:
+            # Some dataretrievers may not answer HEAD requests
+            self.load(obj)
+            return None
+        self._process_headers(obj, uri, headers)
+        if ATTR_DISPLAY_NAME not in obj:
+            obj[ATTR_DISPLAY_NAME] = uri + '\0'
+        return headers
+
+    def load_data(self, obj, headers):
+        '''Retrieve the data of an Object whose attributes were loaded by
+        load_attributes(), which returned headers.  Raises ObjectLoadError
+        if the data has changed since, so that it is not known by a stale
+        data_signature().'''
+        etag = _get_strong_etag(headers)
+        data_headers, body = self._http.get(str(obj))
+        if etag is not None and _get_header(data_headers, 'ETag') != etag:
+            raise ObjectLoadError('Object data changed')
+        obj[ATTR_DATA] = body
+
+    def data_signature(self, obj, headers):
+        '''Return a signature for the data of an Object whose attributes
+        were loaded by load_attributes(), which returned headers.  It is
+        derived from the strong entity tag of the data, so it identifies
+        the data without loading it, but differs from its hash.  Return
+        None if there is no strong entity tag.'''
+        etag = _get_strong_etag(headers)
+        if etag is None:
+            return None
+        return md5('etag %s %s' % (obj, etag)).hexdigest()
+
+    def load_range(self, obj, headers, offset, length):
+        '''Retrieve up to length bytes of the data of an Object whose
+        attributes were loaded by load_attributes(), which returned
+        headers, starting at offset.  Raises ObjectLoadError if the data
+        has changed since.'''
+        etag = _get_header(headers, 'ETag')
+        try:
+            length = min(length,
+                        int(_get_header(headers, 'Content-Length')) - offset)
+        except (TypeError, ValueError):
+            pass
+        if length <= 0:
+            return ''
+        range_headers, body = self._http.get(str(obj),
+                        byte_range=(offset, offset + length - 1))
+        if _get_header(range_headers, 'ETag') != etag:
+            raise ObjectLoadError('Object data changed')
+        if _get_header(range_headers, 'Content-Range') is None:
+            # The dataretriever doesn't serve ranges
+            body = body[offset:offset + length]
+        return body
+
     def _load_blobcache(self, obj, signature):
         # Load the object data
         try:
@@ -215,10 +426,35 @@ class ObjectLoader(object):
         except KeyError:
             raise ObjectLoadError('Object not in cache')
 
+    def _take_prefetched(self, url):
+        '''Remove and return the prefetched (attrs, data) of the object,
+        or None, returning its memory to the budget.'''
+        record = self._prefetched.pop(url, None)
+        if record is not None and self._memory is not None:
+            self._memory.charge(-len(record[1]))
+        return record
+
     def _load_dataretriever(self, obj, url):
+        record = self._take_prefetched(url)
+        if record is None and self._batch_size > 1:
+            record = self._load_batch(url)
+        if record is not None:
+            attrs, body = record
+            obj[ATTR_DATA] = body
+            for key, value in attrs:
+                obj[key] = value + '\0'
+            return
+
         headers, body = self._http.get(url)
         # Load the object data
         obj[ATTR_DATA] = body
+        self._process_headers(obj, url, headers)
+
+    def _process_headers(self, obj, url, headers):
+        # Remember where the dataretriever accepts batch requests
+        for key, value in headers.iteritems():
+            if key.lower() == BATCH_HEADER:
+                self._batch_urls.add(urljoin(url, value))
         # Process loose initial attributes
         for key, value in headers.iteritems():
             if key.lower().startswith(ATTR_HEADER_PREFIX):
@@ -229,6 +465,37 @@ class ObjectLoader(object):
             attr_url = urljoin(url, headers[ATTR_HEADER_URL])
             self._load_attributes(obj, attr_url)
 
+    def _load_batch(self, url):
+        '''Fetch the object together with the upcoming objects from the
+        same dataretriever, if it supports batching.  Return the
+        (attrs, data) of the object, or None if batching is unavailable.'''
+        for batch_url in self._batch_urls:
+            base = batch_url[:batch_url.rfind('/') + 1]
+            if url.startswith(base):
+                break
+        else:
+            return None
+        urls = [url] + [u for u in self._upcoming
+                if u != url and u.startswith(base)][:self._batch_size - 1]
+        self._upcoming = [u for u in self._upcoming if u not in urls]
+        _headers, body = self._http.get(batch_url,
+                '\n'.join([u[len(base):] for u in urls]))
+        try:
+            records = decode_batch(body)
+        except ObjectBatchError, e:
+            raise ObjectLoadError(str(e))
+        if len(records) != len(urls):
+            raise ObjectLoadError('Object batch has wrong number of records')
+        for u, record in zip(urls, records):
+            if record is not None:
+                self._prefetched[u] = record
+                if self._memory is not None:
+                    self._memory.charge(len(record[1]))
+        record = self._take_prefetched(url)
+        if record is None:
+            raise ObjectLoadError('Object not found')
+        return record
+
     # The return type of json.loads() confuses pylint
     # pylint: disable=E1103
     def _load_attributes(self, obj, url):
@@ -0,0 +1,200 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2012 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''Timelines of sampled objects through the search pipeline.
+
+The search statistics say how much time the workers spend in each stage
+on average, but not where a particular object waited.  When object
+tracing is enabled, the scope list loader marks one object in N for
+tracing, and each stage records a span of its work on that object: the
+dataretriever fetch, cache lookups and updates, each filter, and the
+transmission to the client.  Filters linked with libfilter report spans
+of their own for the evaluation and each attribute fetch, which nest
+within the filter's span.
+
+Spans are written in the Chrome trace event format, which can be loaded
+into chrome://tracing or Perfetto.  Each worker thread has a timeline of
+the stages it ran on sampled objects.  In addition, each object has an
+asynchronous "object" span from when it was queued by the scope list
+loader until the worker finished with it, containing a "queued" span for
+the time it spent waiting for a worker.  Timestamps come from
+CLOCK_MONOTONIC, which the filter processes share.
+
+Events are written when an object is finished, so the JSON array is not
+terminated until the tracer is closed; trace viewers accept unterminated
+files.
+'''
+
+from __future__ import with_statement
+import itertools
+import logging
+import os
+import simplejson as json
+import threading
+
+from opendiamond.server.statistics import monotonic_time
+
+_log = logging.getLogger(__name__)
+
+def _timestamp(seconds):
+    '''Convert monotonic_time() to trace event time in microseconds.'''
+    return seconds * 1e6
+
+
+class ObjectTrace(object):
+    '''The spans recorded for one object.  Each thread records the spans of
+    its own work on the object.'''
+
+    def __init__(self, tracer, obj, id):
+        self._tracer = tracer
+        self._id = id
+        self._object = str(obj)
+        self._queued = monotonic_time()
+        self._started = None
+        self._events = []
+        self._lock = threading.Lock()
+
+    def begin(self):
+        '''Return a start time for a span.'''
+        return monotonic_time()
+
+    def end(self, name, start, cat='pipeline', **args):
+        '''Record a span of the calling thread from start to now.'''
+        self.add(name, start, monotonic_time(), cat, args)
+
+    def add(self, name, start, end, cat='pipeline', args=None):
+        '''Record a span of the calling thread.  start and end are
+        monotonic_time() values.'''
+        event = {
+            'name': name,
+            'cat': cat,
+            'ph': 'X',
+            'ts': _timestamp(start),
+            'dur': _timestamp(end - start),
+            'tid': self._tracer.thread_id(),
+            'args': dict(args or {}, object=self._object),
+        }
+        with self._lock:
+            self._events.append(event)
+
+    def start(self):
+        '''Note that a worker has begun processing the object.'''
+        self._started = monotonic_time()
+
+    def finish(self, accepted):
+        '''Note that the worker has finished with the object, and write its
+        spans.'''
+        end = monotonic_time()
+        started = self._started or end
+        common = {'cat': 'object', 'id': self._id,
+                    'tid': self._tracer.thread_id()}
+        lifetime = []
+        for name, ph, ts, args in (
+                    ('object', 'b', self._queued, {'object': self._object}),
+                    ('queued', 'b', self._queued, {}),
+                    ('queued', 'e', started, {}),
+                    ('object', 'e', end, {'accepted': accepted})):
+            event = dict(common, name=name, ph=ph, ts=_timestamp(ts))
+            if args:
+                event['args'] = args
+            lifetime.append(event)
+        with self._lock:
+            events, self._events = self._events + lifetime, []
+        self._tracer.write(events)
+
+
+class ObjectTracer(object):
+    '''Samples objects for tracing and writes their spans to a file.'''
+
+    def __init__(self, path, interval):
+        self._interval = max(interval, 1)
+        self._count = itertools.count()
+        self._ids = itertools.count(1)
+        self._pid = os.getpid()
+        self._lock = threading.Lock()
+        self._local = threading.local()
+        self._tids = itertools.count(1)
+        self._fh = open(path, 'w')
+        self._fh.write('[')
+        self._separator = '\n'
+        self._write_event({'name': 'process_name', 'ph': 'M',
+                    'args': {'name': 'diamondd %d' % self._pid}})
+        self.path = path
+
+    @classmethod
+    def create(cls, config):
+        '''Return an ObjectTracer for the configuration, or None if object
+        tracing is disabled or the trace cannot be written.'''
+        if not config.object_trace:
+            return None
+        if not os.path.isdir(config.trace_dir):
+            try:
+                os.makedirs(config.trace_dir)
+            except OSError:
+                pass
+        path = os.path.join(config.trace_dir, 'objects-%d.json' %
+                                os.getpid())
+        try:
+            tracer = cls(path, config.object_trace)
+        except IOError, e:
+            _log.warning("Couldn't trace objects: %s", e)
+            return None
+        _log.info('Tracing one object in %d to %s', config.object_trace,
+                                path)
+        return tracer
+
+    def sample(self, obj):
+        '''Called for each object entering the pipeline.  Give every Nth
+        object an ObjectTrace.'''
+        if self._count.next() % self._interval == 0:
+            obj.trace = ObjectTrace(self, obj, self._ids.next())
+
+    def thread_id(self):
+        '''Return the trace thread ID of the calling thread, naming the
+        thread in the trace on first use.'''
+        tid = getattr(self._local, 'tid', None)
+        if tid is None:
+            tid = self._local.tid = self._tids.next()
+            self.write([{'name': 'thread_name', 'ph': 'M', 'tid': tid,
+                    'args': {'name': threading.currentThread().getName()}}])
+        return tid
+
+    def _write_event(self, event):
+        event['pid'] = self._pid
+        self._fh.write(self._separator + json.dumps(event))
+        self._separator = ',\n'
+
+    def write(self, events):
+        '''Write trace events.'''
+        with self._lock:
+            if self._fh is None:
+                return
+            try:
+                for event in events:
+                    self._write_event(event)
+                self._fh.flush()
+            except IOError, e:
+                _log.warning("Couldn't write object trace: %s", e)
+                self._fh.close()
+                self._fh = None
+
+    def close(self):
+        '''Terminate and close the trace file.'''
+        with self._lock:
+            if self._fh is None:
+                return
+            try:
+                self._fh.write('\n]\n')
+                self._fh.close()
+            except IOError:
+                pass
+            self._fh = None
@@ -0,0 +1,178 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2012 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''CPU and NUMA placement of worker threads.
+
+With placement enabled, each worker thread is pinned to a CPU set chosen
+round-robin from the configured sets.  Filter processes started by the
+thread inherit its CPU affinity.  In "node" mode the CPU sets are NUMA
+nodes, and filter processes are told the node number through the
+DIAMOND_NUMA_NODE environment variable so that libfilter can prefer
+node-local memory for attribute buffers.
+
+PLACEMENT none|core|node
+    Whether to pin workers and, if so, to what.  The default is none.
+PLACEMENTCPUS cpulist
+    May be given more than once; each occurrence defines one CPU set,
+    e.g. "0-5,12-17".  By default, "core" mode uses one set per CPU
+    available to the process and "node" mode uses the CPUs of each NUMA
+    node.
+'''
+
+from ctypes import (CDLL, c_int, c_size_t, c_ulong, c_void_p, get_errno,
+        sizeof)
+import logging
+import os
+import re
+import threading
+
+NUMA_NODE_ENV = 'DIAMOND_NUMA_NODE'
+_NODE_DIR = '/sys/devices/system/node'
+_MASK_WORDS = 16		# 1024 CPUs
+
+_log = logging.getLogger(__name__)
+
+class PlacementError(Exception):
+    '''Invalid placement configuration.'''
+
+
+def parse_cpulist(text):
+    '''Parse a Linux CPU list such as "0-3,8,10-11" into a sorted list of
+    CPU numbers.'''
+    cpus = set()
+    try:
+        for part in text.strip().split(','):
+            if part == '':
+                continue
+            if '-' in part:
+                first, last = part.split('-', 1)
+                cpus.update(range(int(first), int(last) + 1))
+            else:
+                cpus.add(int(part))
+    except ValueError:
+        raise PlacementError('Invalid CPU list: %s' % text)
+    return sorted(cpus)
+
+
+def _node_cpus():
+    '''Return a list of (node, [cpus]) for the NUMA nodes in the system.'''
+    nodes = []
+    try:
+        names = os.listdir(_NODE_DIR)
+    except OSError:
+        return nodes
+    for name in names:
+        match = re.match(r'^node(\d+)$', name)
+        if match is None:
+            continue
+        try:
+            cpulist = open(os.path.join(_NODE_DIR, name, 'cpulist')).read()
+        except IOError:
+            continue
+        cpus = parse_cpulist(cpulist)
+        if cpus:
+            nodes.append((int(match.group(1)), cpus))
+    return sorted(nodes)
+
+
+class _Affinity(object):
+    '''ctypes wrapper for sched_{get,set}affinity() on the calling
+    thread.'''
+
+    def __init__(self):
+        libc = CDLL('libc.so.6', use_errno=True)
+        self._get = libc.sched_getaffinity
+        self._set = libc.sched_setaffinity
+        for func in self._get, self._set:
+            func.argtypes = [c_int, c_size_t, c_void_p]
+            func.restype = c_int
+        self._bits = 8 * sizeof(c_ulong)
+
+    def get(self):
+        '''Return the CPUs the calling thread may run on.'''
+        mask = (c_ulong * _MASK_WORDS)()
+        if self._get(0, len(mask) * (self._bits // 8), mask):
+            raise OSError(get_errno(), 'sched_getaffinity() failed')
+        return [i for i in xrange(_MASK_WORDS * self._bits)
+                if mask[i // self._bits] & (1 << (i % self._bits))]
+
+    def set(self, cpus):
+        '''Restrict the calling thread to the specified CPUs.'''
+        mask = (c_ulong * _MASK_WORDS)()
+        for cpu in cpus:
+            if cpu >= _MASK_WORDS * self._bits:
+                raise PlacementError('CPU %d out of range' % cpu)
+            mask[cpu // self._bits] |= 1 << (cpu % self._bits)
+        if self._set(0, len(mask) * (self._bits // 8), mask):
+            raise OSError(get_errno(), 'sched_setaffinity() failed')
+
+
+_local = threading.local()
+
+def current_node():
+    '''Return the NUMA node the calling thread was placed on, or None.'''
+    return getattr(_local, 'node', None)
+
+
+class Placement(object):
+    '''Assigns worker threads to CPU sets according to the configuration.'''
+
+    def __init__(self, config):
+        self.mode = config.placement
+        self._slots = []		# [(cpus, node or None)]
+        if self.mode == 'none':
+            return
+        if self.mode not in ('core', 'node'):
+            raise PlacementError('Unknown placement mode: %s' % self.mode)
+        try:
+            self._affinity = _Affinity()
+            available = set(self._affinity.get())
+        except (OSError, AttributeError), e:
+            _log.warning('Thread placement unavailable: %s', e)
+            self.mode = 'none'
+            return
+
+        nodes = _node_cpus()
+        if config.placement_cpus:
+            cpusets = [parse_cpulist(text) for text in config.placement_cpus]
+        elif self.mode == 'node' and nodes:
+            cpusets = [cpus for _node, cpus in nodes]
+        else:
+            cpusets = [[cpu] for cpu in sorted(available)]
+        for cpus in cpusets:
+            cpus = [cpu for cpu in cpus if cpu in available]
+            if not cpus:
+                continue
+            node = None
+            if self.mode == 'node':
+                # The node containing the most CPUs of the set
+                counts = [(len(set(cpus) & set(ncpus)), n)
+                        for n, ncpus in nodes]
+                if counts and max(counts)[0] > 0:
+                    node = max(counts)[1]
+            self._slots.append((cpus, node))
+        if not self._slots:
+            raise PlacementError('No usable CPUs for placement')
+
+    def apply(self, index):
+        '''Pin the calling thread to the CPU set for worker number index.'''
+        if not self._slots:
+            return
+        cpus, node = self._slots[index % len(self._slots)]
+        try:
+            self._affinity.set(cpus)
+        except OSError, e:
+            _log.warning('Could not set CPU affinity: %s', e)
+            return
+        _local.node = node
+        _log.debug('Worker %d placed on CPUs %s, node %s', index,
+                        ','.join([str(c) for c in cpus]), node)
@@ -0,0 +1,336 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2012 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''Reuse of initialized filter processes across searches.
+
+When a search exits, it hands its idle filter processes to the supervisor
+("parks" them) rather than killing them.  A later search that needs a
+process with the same filter code, arguments, blob argument, and execution
+environment adopts a parked one, skipping the filter's startup and
+initialization.  Clients commonly rerun a search with small changes, so
+most filters of the new search can usually be adopted.
+
+Searches talk to the supervisor over a Unix socket in the pool directory,
+one connection per request:
+
+    PARK <key> <pid> <dir> <state>  followed by the process' stdin and
+                                    stdout descriptors; reply OK
+    ADOPT <key>                     reply PROC <pid> <dir> <state>,
+                                    followed by the descriptors, or NONE
+
+dir is the process' temporary directory and state is JSON describing the
+protocol state of the process, which the adopting search needs to
+continue the conversation.  The supervisor kills parked processes that
+stay unused for too long, and the least recently parked ones while the
+pool exceeds its memory limit.  Killing a process is safe at any time,
+since a parked process is idle.
+
+Each pooled process runs in a private temporary directory within the
+pool directory, so that its working directory survives the search that
+started it.
+'''
+
+from __future__ import with_statement
+from multiprocessing.reduction import send_handle, recv_handle
+import logging
+import os
+import select
+import shutil
+import signal
+import socket
+import threading
+import time
+from weakref import WeakKeyDictionary
+
+from opendiamond.helpers import md5
+
+SOCKET = 'socket'
+# Seconds to wait for the other end of a pool request
+TIMEOUT = 5
+# Seconds between checks for expired processes
+EXPIRE_INTERVAL = 10
+
+_log = logging.getLogger(__name__)
+
+def process_key(identity, environment):
+    '''Return the pool key of a filter process with the specified identity
+    and dict of extra environment variables.  The identity describes what
+    the process runs without referring to the blob cache paths of the
+    filter code and blob argument, which are private to each search: the
+    protocol version, any command prefix, and the name, code signature,
+    arguments, and blob signature of each filter.'''
+    return md5(repr((identity,
+                    sorted(environment.items())))).hexdigest()
+
+
+def _resident_size(pid):
+    '''Return the resident memory of the process in bytes, or 0 if it
+    cannot be determined.'''
+    try:
+        pages = int(open('/proc/%d/statm' % pid).read().split()[1])
+    except (IOError, IndexError, ValueError):
+        return 0
+    return pages * os.sysconf('SC_PAGE_SIZE')
+
+
+def _recv_line(sock):
+    '''Read a newline-terminated line without reading past it, since
+    descriptors may follow.'''
+    return sock.makefile('rb', 0).readline(65536).rstrip('\n')
+
+
+def _recv_fd(sock):
+    '''Receive a descriptor sent with send_handle().'''
+    # The socket has a timeout, so it is non-blocking underneath
+    readable, _w, _x = select.select([sock], [], [], TIMEOUT)
+    if not readable:
+        raise socket.error('Timed out')
+    return recv_handle(sock)
+
+
+class _ParkedProcess(object):
+    '''A filter process waiting in the supervisor for a new owner.'''
+
+    def __init__(self, key, pid, fds, state, tempdir):
+        self.key = key
+        self.pid = pid
+        self.fds = fds		# [stdin, stdout]
+        self.state = state
+        self.tempdir = tempdir
+        self.parked = time.time()
+        self.size = _resident_size(pid)
+
+    def alive(self):
+        '''Return True if the process is still running.  A standalone
+        filter may have written its first request for the next object, so
+        output waiting in its pipe is expected.'''
+        try:
+            os.kill(self.pid, 0)
+        except OSError:
+            return False
+        return True
+
+    def close(self):
+        '''Release our descriptors without affecting the process.'''
+        for fd in self.fds:
+            os.close(fd)
+
+    def kill(self):
+        '''Kill the process and clean up after it.'''
+        try:
+            os.kill(self.pid, signal.SIGKILL)
+        except OSError:
+            pass
+        self.close()
+        if self.tempdir is not None:
+            shutil.rmtree(self.tempdir, True)
+
+
+class FilterPool(object):
+    '''Holds filter processes parked by exiting searches.  Runs in the
+    supervisor, which calls serve() when the socket is readable and
+    expire() periodically.  If cgroupdir is specified, parked processes
+    are moved out of their search's control group, so that they survive
+    its cleanup.'''
+
+    def __init__(self, directory, idle_timeout, memory_limit,
+                cgroupdir=None):
+        self._idle_timeout = idle_timeout
+        self._memory_limit = memory_limit
+        self._cgroupdir = cgroupdir
+        self._parked = []	# Least recently parked first
+        # Processes from an earlier supervisor have lost their pipes and
+        # exited; remove their temporary directories
+        shutil.rmtree(directory, True)
+        os.mkdir(directory, 0700)
+        self._directory = directory
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.bind(os.path.join(directory, SOCKET))
+        self.sock.listen(16)
+        self.sock.setblocking(0)
+
+    def serve(self):
+        '''Answer a waiting pool request.'''
+        try:
+            sock, _addr = self.sock.accept()
+        except socket.error:
+            return
+        try:
+            sock.setblocking(1)
+            sock.settimeout(TIMEOUT)
+            self._serve(sock)
+        except (socket.error, OSError, ValueError), e:
+            _log.warning('Filter pool request failed: %s', e)
+        finally:
+            sock.close()
+
+    def _serve(self, sock):
+        words = _recv_line(sock).split(' ', 4)
+        if words[0] == 'ADOPT' and len(words) == 2:
+            self._adopt(sock, words[1])
+        elif words[0] == 'PARK' and len(words) == 5:
+            _cmd, key, pid, tempdir, state = words
+            fds = [_recv_fd(sock)]
+            try:
+                fds.append(_recv_fd(sock))
+                pid = int(pid)
+            except:
+                for fd in fds:
+                    os.close(fd)
+                raise
+            tempdir = os.path.join(self._directory,
+                                os.path.basename(tempdir))
+            self._park(_ParkedProcess(key, pid, fds, state, tempdir))
+            sock.sendall('OK\n')
+        else:
+            raise ValueError('Bad request')
+
+    def _park(self, proc):
+        if self._cgroupdir is not None:
+            try:
+                fh = open(os.path.join(self._cgroupdir, 'tasks'), 'w')
+                fh.write('%d\n' % proc.pid)
+                fh.close()
+            except IOError, e:
+                _log.warning("Couldn't move pooled filter %d out of its "
+                                'search: %s', proc.pid, e)
+                proc.kill()
+                return
+        self._parked.append(proc)
+        _log.debug('Parked filter process %d', proc.pid)
+        self._enforce_limit()
+
+    def _adopt(self, sock, key):
+        for proc in reversed(self._parked):
+            if proc.key == key:
+                self._parked.remove(proc)
+                if not proc.alive():
+                    proc.kill()
+                    continue
+                try:
+                    sock.sendall('PROC %d %s %s\n' % (proc.pid,
+                                os.path.basename(proc.tempdir), proc.state))
+                    for fd in proc.fds:
+                        send_handle(sock, fd, None)
+                except socket.error:
+                    proc.kill()
+                    raise
+                proc.close()
+                _log.debug('Filter process %d adopted', proc.pid)
+                return
+        sock.sendall('NONE\n')
+
+    def _enforce_limit(self):
+        '''Kill the least recently parked processes until the pool fits
+        in its memory limit.'''
+        total = sum([p.size for p in self._parked])
+        while self._parked and total > self._memory_limit:
+            proc = self._parked.pop(0)
+            total -= proc.size
+            proc.kill()
+
+    def expire(self):
+        '''Kill processes that have been parked too long.'''
+        threshold = time.time() - self._idle_timeout
+        for proc in list(self._parked):
+            if proc.parked < threshold or not proc.alive():
+                self._parked.remove(proc)
+                proc.kill()
+        # Parked processes may have grown
+        for proc in self._parked:
+            proc.size = _resident_size(proc.pid)
+        self._enforce_limit()
+
+    def forget(self):
+        '''Close our descriptors without killing the processes.  Called in
+        forked search processes.'''
+        for proc in self._parked:
+            proc.close()
+        self._parked = []
+        self.sock.close()
+
+    def close(self):
+        '''Kill all parked processes.'''
+        for proc in self._parked:
+            proc.kill()
+        self._parked = []
+        self.sock.close()
+
+
+class PoolClient(object):
+    '''The search's connection to the supervisor's FilterPool.  Filter
+    processes register themselves so that they can be parked when the
+    search exits.'''
+
+    def __init__(self, directory):
+        self.directory = directory
+        self._path = os.path.join(directory, SOCKET)
+        self._procs = WeakKeyDictionary()
+        self._lock = threading.Lock()
+
+    def _connect(self):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.settimeout(TIMEOUT)
+        sock.connect(self._path)
+        return sock
+
+    def register(self, proc):
+        '''Park proc when the search exits, if it is idle.'''
+        with self._lock:
+            self._procs[proc] = True
+
+    def adopt(self, key):
+        '''Return (pid, stdin fd, stdout fd, temporary directory, state) of
+        a parked process with the specified key, or None if there is
+        none.'''
+        try:
+            sock = self._connect()
+            try:
+                sock.sendall('ADOPT %s\n' % key)
+                words = _recv_line(sock).split(' ', 3)
+                if words[0] != 'PROC' or len(words) != 4:
+                    return None
+                fds = (_recv_fd(sock), _recv_fd(sock))
+            finally:
+                sock.close()
+        except (socket.error, OSError), e:
+            _log.warning("Couldn't adopt pooled filter: %s", e)
+            return None
+        _cmd, pid, tempdir, state = words
+        return (int(pid), fds[0], fds[1],
+                    os.path.join(self.directory, tempdir), state)
+
+    def park_all(self):
+        '''Hand the idle registered processes to the supervisor.  Processes
+        that are busy are left to die with the search.'''
+        with self._lock:
+            procs = self._procs.keys()
+        for proc in procs:
+            state = proc.park_state()
+            if state is None:
+                continue
+            try:
+                sock = self._connect()
+                try:
+                    sock.sendall('PARK %s %d %s %s\n' % (proc.pool_key,
+                                proc.pid, os.path.basename(proc.tempdir),
+                                state))
+                    for fd in proc.filenos():
+                        send_handle(sock, fd, None)
+                    if _recv_line(sock) != 'OK':
+                        raise socket.error('Not acknowledged')
+                finally:
+                    sock.close()
+            except (socket.error, OSError), e:
+                _log.warning("Couldn't park filter %s: %s", proc, e)
+                continue
+            proc.detach()
@@ -14,15 +14,27 @@
 
 from __future__ import with_statement
 import logging
+from collections import deque
+from functools import partial
+from Queue import Queue, Empty
+import random
+import socket
+import time
 import urllib2
 from urlparse import urljoin
 import threading
 from xml.sax import make_parser, SAXParseException
 from xml.sax.handler import ContentHandler
 
+from opendiamond.scopeindex import (MIME_TYPE as SCOPE_INDEX_MIME_TYPE,
+        CHUNK_OBJECTS, ScopeIndexParser, ScopeIndexError)
 from opendiamond.server.object_ import Object
+from opendiamond.server.steal import StealServer, steal, WAIT, NONE
 
 BASE_URL = 'http://localhost:5873/'
+STEAL_RETRY = 0.1	# seconds between rounds of WAIT replies
+
+_END = object()		# queued after the last Object
 
 _log = logging.getLogger(__name__)
 
@@ -51,26 +63,122 @@ class _ScopeListHandler(ContentHandler):
 
 class ScopeListLoader(object):
     '''Iterator over the objects in the scope lists referenced by the scope
-    cookies.'''
+    cookies.
+
+    Scope lists are fetched and parsed by up to config.scope_fetchers
+    producer threads, which are started by the first call to next() and
+    fill a bounded queue shared by the worker threads.  Objects from a
+    single scope list are returned in order, but objects from different
+    scope lists are interleaved.
+
+    If share() is called, scope indexes are fetched in config.steal_parts
+    parts, which peer servers running the same search may steal once they
+    have finished their own.  In turn, once our parts are exhausted, we
+    steal from them.'''
 
     def __init__(self, config, server_id, cookies):
         self.server_id = server_id
         self.cookies = cookies
         self._config = config
         self._lock = threading.Lock()
-        self._handler = _ScopeListHandler()
-        self._generator = self._generator_func()
+        self._started = False
+        # Work items are (scope list URL, part, parts, probe).  A probe
+        # fetches the first part and queues the others, or the entire list
+        # if it is not a splittable index.  part is None if not splitting.
+        self._work = deque()
+        for cookie in cookies:
+            for scope_url in cookie:
+                self._work.append((urljoin(BASE_URL, scope_url), None, None,
+                                False))
+        self._handlers = []		# one per producer, for get_count()
+        self._producers = 0		# number still running
+        self._queue = Queue(max(config.scope_queue, 1))
+        # ObjectTracer that samples the queued objects, if any
+        self.tracer = None
+        # Work stealing
+        self._steal_key = None
+        self._steal_server = None
+        self._peers = []
+        self._probing = 0		# probes not yet finished
+        self._giving = 0		# parts given but not acknowledged
+
+    def share(self, key):
+        '''Cooperate with the other servers running the search with the
+        specified key (see opendiamond.server.steal).  Must be called
+        before the first call to next().'''
+        config = self._config
+        try:
+            self._steal_server = StealServer(config.steal_dir, key, self)
+        except (socket.error, IOError, OSError), e:
+            _log.warning('Not sharing scope: %s', e)
+            return
+        parts = max(config.steal_parts, 1)
+        self._work = deque([(url, 0, parts, True)
+                                for url, _p, _n, _probe in self._work])
+        self._probing = len(self._work)
+        if config.steal_peers:
+            peers = config.steal_peers
+        else:
+            peers = [s for cookie in self.cookies for s in cookie.servers
+                                if s not in config.serverids]
+        self._peers = sorted(set(peers))
+        self._steal_key = key
+        self._steal_server.start()
+        _log.info('Sharing scope with %s', ', '.join(self._peers) or
+                                '<no peers>')
+
+    def close(self):
+        '''Stop sharing the scope with peers.'''
+        if self._steal_server is not None:
+            self._steal_server.close()
 
     def __iter__(self):
         return self
 
     def next(self):
         '''Return the next Object.'''
+        if not self._started:
+            self._start()
+        obj = self._queue.get()
+        if obj is _END:
+            # Leave the marker for the other consumers
+            self._queue.put(obj)
+            raise StopIteration()
+        return obj
+
+    def take(self, count):
+        '''Return a list of up to count Objects, waiting only for the
+        first.  Raise StopIteration if there are no more Objects.'''
+        objs = [self.next()]
+        while len(objs) < count:
+            try:
+                obj = self._queue.get_nowait()
+            except Empty:
+                break
+            if obj is _END:
+                self._queue.put(obj)
+                break
+            objs.append(obj)
+        return objs
+
+    def _start(self):
+        '''Start the producer threads.'''
         with self._lock:
-            return self._generator.next()
+            if self._started:
+                return
+            self._producers = max(self._config.scope_fetchers, 1)
+            if self._steal_key is None:
+                self._producers = min(self._producers, len(self._work))
+            if self._producers == 0:
+                self._queue.put(_END)
+            for i in xrange(self._producers):
+                thread = threading.Thread(target=self._produce,
+                        name='scope-%d' % i)
+                thread.setDaemon(True)
+                thread.start()
+            self._started = True
 
-    def _generator_func(self):
-        # Build URL opener
+    def _build_opener(self):
         handlers = []
         if self._config.http_proxy is not None:
             handlers.append(urllib2.ProxyHandler({
@@ -78,48 +186,190 @@ class ScopeListLoader(object):
                 'https': self._config.http_proxy,
             }))
         opener = urllib2.build_opener(*handlers)
-        opener.addheaders = [('User-Agent', self._config.user_agent)]
-        # Build XML parser
-        parser = make_parser()
-        parser.setContentHandler(self._handler)
-        # Walk scope URLs
-        for cookie in self.cookies:
-            for scope_url in cookie:
-                scope_url = urljoin(BASE_URL, scope_url)
+        # Dataretrievers that support the binary scope index will return
+        # it in preference to XML.
+        opener.addheaders = [('User-Agent', self._config.user_agent),
+                ('Accept', '%s, text/xml;q=0.5' % SCOPE_INDEX_MIME_TYPE)]
+        return opener
+
+    def _produce(self):
+        '''Producer thread function.  Fetch and parse scope lists until
+        none remain, queueing their Objects.'''
+        try:
+            opener = self._build_opener()
+            handler = _ScopeListHandler()
+            parser = make_parser()
+            parser.setContentHandler(handler)
+            with self._lock:
+                self._handlers.append(handler)
+            while True:
+                with self._lock:
+                    if self._work:
+                        item = self._work.popleft()
+                    else:
+                        item = None
+                if item is None and self._steal_key is not None:
+                    item = self._steal()
+                if item is None:
+                    break
                 try:
-                    # We use urllib2 here because different parts of a single
-                    # HTTP response will be handled from different threads.
-                    # pycurl does not support this.
-                    fh = opener.open(scope_url)
-                    # Read the scope list in 4 KB chunks
-                    while True:
-                        buf = fh.read(4096)
-                        if len(buf) == 0:
-                            break
-                        parser.feed(buf)
-                        while len(self._handler.pending_objects) > 0:
-                            url = self._handler.pending_objects.pop(0)
-                            yield Object(self.server_id,
-                                            urljoin(scope_url, url))
-                except urllib2.URLError, e:
-                    _log.warning('Fetching %s: %s', scope_url, e)
-                except SAXParseException, e:
-                    _log.warning('Parsing %s: %s', scope_url, e)
+                    self._fetch(opener, parser, handler, *item)
                 finally:
-                    try:
-                        parser.close()
-                    except SAXParseException:
-                        # Received malformed XML, such as XML with missing
-                        # closing tags.  This is likely caused by a
-                        # prematurely-terminated connection.
-                        _log.warning('Parsing %s: incomplete scope list',
-                                        scope_url)
-                    parser.reset()
-        # Log successful completion
-        _log.info('End of scope list')
+                    if item[3]:
+                        with self._lock:
+                            self._probing -= 1
+        except Exception:
+            _log.exception('Scope list thread exception')
+        finally:
+            with self._lock:
+                self._producers -= 1
+                last = self._producers == 0
+            if last:
+                # Log successful completion
+                _log.info('End of scope list')
+                self._queue.put(_END)
+
+    def _fetch(self, opener, parser, handler, scope_url, part, parts, probe):
+        '''Fetch and parse a work item, queueing its Objects.'''
+        url = scope_url
+        if part is not None:
+            url += '%spart=%d&parts=%d' % ('?' in url and '&' or '?', part,
+                                parts)
+        try:
+            fh = opener.open(url)
+        except urllib2.URLError, e:
+            _log.warning('Fetching %s: %s', url, e)
+            return
+        if fh.info().gettype() == SCOPE_INDEX_MIME_TYPE:
+            split = None
+            if probe:
+                split = partial(self._split, scope_url, parts)
+            objects = self._parse_index(fh, scope_url, handler, split)
+        else:
+            # Not splittable; we have the whole list
+            objects = self._parse_xml(fh, scope_url, parser, handler)
+        tracer = self.tracer
+        for obj in objects:
+            if tracer is not None:
+                tracer.sample(obj)
+            self._queue.put(obj)
+
+    def _split(self, scope_url, parts, header):
+        '''Queue the remaining nonempty parts of the index whose first part
+        has the specified header.'''
+        # As in ScopeIndexHeader.chunk_range() for the complete index
+        nchunks = (header.total + CHUNK_OBJECTS - 1) // CHUNK_OBJECTS
+        with self._lock:
+            for part in xrange(1, parts):
+                if part * nchunks // parts < (part + 1) * nchunks // parts:
+                    self._work.append((scope_url, part, parts, False))
+
+    def _steal(self):
+        '''Return a work item taken from a peer, or from our own queue if
+        one has appeared in the meantime, or None if no work remains.'''
+        while True:
+            waiting = False
+            peers = list(self._peers)
+            random.shuffle(peers)
+            for peer in peers:
+                reply = steal(peer, self._config.steal_port, self._steal_key)
+                if reply == WAIT:
+                    waiting = True
+                elif reply != NONE:
+                    scope_url, part, parts = reply
+                    _log.info('Stole part %d/%d of %s from %s', part, parts,
+                                scope_url, peer)
+                    return (scope_url, part, parts, False)
+            with self._lock:
+                if self._work:
+                    return self._work.popleft()
+                # Our probes may yet produce parts, and unacknowledged
+                # parts may be returned to us
+                if not waiting and not self._probing and not self._giving:
+                    return None
+            time.sleep(STEAL_RETRY)
+
+    def give(self):
+        '''Remove a part from our queue for a peer and return its (scope
+        list URL, part, parts) with the URL made reachable from the peer;
+        or WAIT or NONE if there is nothing to give.  The caller must call
+        settle().'''
+        with self._lock:
+            if self._work and not self._work[-1][3]:
+                scope_url, part, parts, _probe = self._work.pop()
+                self._giving += 1
+            elif self._probing:
+                return WAIT
+            else:
+                return NONE
+        retriever = self._config.steal_retriever
+        if retriever is None:
+            retriever = 'http://%s:5873/' % self.server_id
+        if scope_url.startswith(BASE_URL):
+            scope_url = urljoin(retriever, scope_url[len(BASE_URL):])
+        return (scope_url, part, parts)
+
+    def settle(self, item, taken):
+        '''Finish giving a part returned by give().  If the peer did not
+        take it, requeue it.'''
+        with self._lock:
+            self._giving -= 1
+            if not taken:
+                scope_url, part, parts = item
+                self._work.append((scope_url, part, parts, False))
+
+    def _parse_xml(self, fh, scope_url, parser, handler):
+        '''Generator yielding Objects from an XML scope list.'''
+        try:
+            # Read the scope list in 4 KB chunks
+            while True:
+                buf = fh.read(4096)
+                if len(buf) == 0:
+                    break
+                parser.feed(buf)
+                while len(handler.pending_objects) > 0:
+                    url = handler.pending_objects.pop(0)
+                    yield Object(self.server_id, urljoin(scope_url, url))
+        except urllib2.URLError, e:
+            _log.warning('Fetching %s: %s', scope_url, e)
+        except SAXParseException, e:
+            _log.warning('Parsing %s: %s', scope_url, e)
+        finally:
+            try:
+                parser.close()
+            except SAXParseException:
+                # Received malformed XML, such as XML with missing
+                # closing tags.  This is likely caused by a
+                # prematurely-terminated connection.
+                _log.warning('Parsing %s: incomplete scope list', scope_url)
+            parser.reset()
+
+    def _parse_index(self, fh, scope_url, handler, header_callback=None):
+        '''Generator yielding Objects from a binary scope index.  If
+        specified, header_callback is called with the index header once
+        it has been parsed.'''
+        parser = ScopeIndexParser()
+        try:
+            while True:
+                buf = fh.read(65536)
+                if len(buf) == 0:
+                    break
+                had_header = parser.header is not None
+                urls = parser.feed(buf)
+                if not had_header and parser.header is not None:
+                    handler.count += parser.header.count
+                    if header_callback is not None:
+                        header_callback(parser.header)
+                for url in urls:
+                    yield Object(self.server_id, urljoin(scope_url, url))
+            parser.close()
+        except urllib2.URLError, e:
+            _log.warning('Fetching %s: %s', scope_url, e)
+        except ScopeIndexError, e:
+            _log.warning('Parsing %s: %s', scope_url, e)
 
     def get_count(self):
         '''Return our current understanding of the number of objects in
         scope.'''
         with self._lock:
-            return self._handler.count
+            return sum([handler.count for handler in self._handlers])
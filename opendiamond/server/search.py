@@ -12,8 +12,11 @@
 
 '''Search state; control and blast channel handling.'''
 
+from __future__ import with_statement
 from functools import wraps
 import logging
+import os
+import simplejson as json
 
 from opendiamond import protocol
 from opendiamond.blobcache import BlobCache
@@ -21,12 +24,17 @@ from opendiamond.protocol import (DiamondRPCFailure, DiamondRPCFCacheMiss,
         DiamondRPCCookieExpired, DiamondRPCSchemeNotSupported)
 from opendiamond.rpc import RPCHandlers, RPCError, RPCProcedureUnavailable
 from opendiamond.scope import ScopeCookie, ScopeError, ScopeCookieExpired
+from opendiamond.server.cachekeys import CacheKeyFilter
 from opendiamond.server.filter import (FilterStack, Filter,
-        FilterDependencyError, FilterUnsupportedSource)
+        FilterDependencyError, FilterUnsupportedSource, MemoryBudget,
+        PriorityGate, Ranking, Watchdog)
 from opendiamond.server.object_ import EmptyObject, Object, ObjectLoader
+from opendiamond.server.objecttrace import ObjectTracer
+from opendiamond.server.pool import PoolClient
 from opendiamond.server.scopelist import ScopeListLoader
 from opendiamond.server.sessionvars import SessionVariables
-from opendiamond.server.statistics import SearchStatistics
+from opendiamond.server.steal import search_key
+from opendiamond.server.statistics import SearchStatistics, Timer
 
 _log = logging.getLogger(__name__)
 
@@ -39,6 +47,24 @@ class SearchState(object):
         self.stats = SearchStatistics()
         self.scope = None
         self.blast = None
+        # Ranking for top-K searches, or None to return every result
+        self.ranking = None
+        # Held by reexecution to pause the scan workers
+        self.priority = PriorityGate()
+        # Attribute memory of objects being scanned
+        self.memory = MemoryBudget(config.memory_budget_mb << 20)
+        # Kills filters that overrun the deadline
+        self.watchdog = Watchdog(config.filter_deadline_ms)
+        # Keys known to be in the Redis cache, or None to look up every key
+        self.cache_keys = None
+        # Records the progress of sampled objects, or None
+        self.tracer = None
+        # Adjusts the number of active workers, or None if all are active
+        self.workers = None
+        # Supervisor's pool of filter processes, or None
+        self.pool = None
+        if config.filter_pool:
+            self.pool = PoolClient(config.filter_pool_dir)
 
 
 class Search(RPCHandlers):
@@ -53,15 +79,49 @@ class Search(RPCHandlers):
         self._blast_conn = blast_conn
         self._state = SearchState(config)
         self._filters = FilterStack()
+        self._ranking = None	# XDR_ranking
         self._running = False
+        # Persistent FilterStackRunner for reexecution, so its filter
+        # processes stay initialized between requests
+        self._reexec_runner = None
 
     def shutdown(self):
         '''Clean up the search before the process exits.'''
+        if self._state.scope is not None:
+            self._state.scope.close()
+        # Let later searches reuse our idle filter processes
+        if self._state.pool is not None:
+            self._state.pool.park_all()
+        if self._state.tracer is not None:
+            self._state.tracer.close()
+        # Give later searches the cache keys we know of
+        if self._state.cache_keys is not None:
+            self._state.cache_keys.save()
         # Log search statistics
         if self._running:
             self._state.stats.log()
             for filter in self._filters:
                 filter.stats.log()
+            if self._state.config.stats_file is not None:
+                self._write_stats(self._state.config.stats_file)
+
+    def _write_stats(self, path):
+        '''Append the search statistics to path as a line of JSON.'''
+        record = {
+            'pid': os.getpid(),
+            'threads': self._state.config.threads,
+            'search': self._state.stats.summary(),
+            'filters': dict([(f.name, f.stats.summary())
+                    for f in self._filters]),
+        }
+        try:
+            fh = open(path, 'a')
+            try:
+                fh.write(json.dumps(record) + '\n')
+            finally:
+                fh.close()
+        except IOError, e:
+            _log.warning("Couldn't write statistics to %s: %s", path, e)
 
     # This is not a static method: it's only called when initializing the
     # class, and the staticmethod() decorator does not create a callable.
@@ -162,6 +222,7 @@ class Search(RPCHandlers):
 
         # Commit
         self._filters = filters
+        self._reexec_runner = None
         self._state.scope = scope
         return protocol.XDR_blob_list(missing)
 
@@ -174,6 +235,16 @@ class Search(RPCHandlers):
         for blob in params.blobs:
             self._state.blob_cache.add(blob)
 
+    @RPCHandlers.handler(28, protocol.XDR_ranking)
+    @running(False)
+    def set_ranking(self, params):
+        '''Return only the top-scoring results, as ranked by the specified
+        filter.  A count of 0 returns all results.'''
+        if params.count:
+            self._ranking = params
+        else:
+            self._ranking = None
+
     @RPCHandlers.handler(27, protocol.XDR_start)
     @running(False)
     def start(self, params):
@@ -183,6 +254,15 @@ class Search(RPCHandlers):
         except RPCError, e:
             _log.warning('Cannot start search: %s', str(e))
             raise
+        if self._ranking is not None:
+            name = self._ranking.filter
+            if name not in [f.name for f in self._filters]:
+                _log.warning('Cannot start search: no ranking filter %s',
+                                name)
+                raise DiamondRPCFailure('No such filter: ' + name)
+            self._state.ranking = Ranking(name, self._ranking.count)
+            _log.info('Returning top %d results by %s',
+                                self._ranking.count, name)
         if params.attrs is not None:
             push_attrs = set(params.attrs)
         else:
@@ -190,9 +270,30 @@ class Search(RPCHandlers):
             push_attrs = None
         self._state.blast = BlastChannel(self._blast_conn, params.search_id,
                                 push_attrs)
+        if self._state.config.steal:
+            self._state.scope.share(search_key(self._state.scope.cookies,
+                                params.search_id,
+                                [f.signature for f in self._filters]))
+        config = self._state.config
+        self._state.tracer = ObjectTracer.create(config)
+        self._state.scope.tracer = self._state.tracer
+        if config.cache_server is not None and config.cache_key_filter:
+            self._state.cache_keys = CacheKeyFilter(config)
+            self._state.cache_keys.load()
         self._running = True
         _log.info('Starting search %d', params.search_id)
         self._filters.start_threads(self._state, self._state.config.threads)
+        if config.reexecute_prestart:
+            # Have reexecution filters ready before the first request
+            self._get_reexecution_runner().prestart()
+
+    def _get_reexecution_runner(self):
+        '''Return the reexecution runner, creating it if necessary.  The
+        caller must have called _check_runnable().'''
+        if self._reexec_runner is None:
+            self._reexec_runner = self._filters.bind(self._state,
+                                'Reexecution')
+        return self._reexec_runner
 
     @RPCHandlers.handler(21, protocol.XDR_reexecute,
                              protocol.XDR_attribute_list)
@@ -204,12 +305,22 @@ class Search(RPCHandlers):
             _log.warning('Cannot reexecute filters: %s', str(e))
             raise
         _log.info('Reexecuting on object %s', params.object_id)
-        runner = self._filters.bind(self._state)
+        runner = self._get_reexecution_runner()
         obj = Object(self._server_id, params.object_id)
         loader = ObjectLoader(self._state.config, self._state.blob_cache)
         if not loader.source_available(obj):
             raise DiamondRPCFCacheMiss()
-        drop = not runner.evaluate(obj)
+        timer = Timer()
+        with self._state.priority:
+            drop = not runner.evaluate(obj)
+        elapsed = timer.elapsed
+        target = self._state.config.reexecute_target_ms
+        late = target > 0 and elapsed > target * 1000000
+        self._state.stats.update('objs_reexecuted', reexecute_ns=elapsed,
+                                reexecute_late=int(late))
+        if late:
+            _log.warning('Reexecution on %s took %d ms, target %d ms',
+                                params.object_id, elapsed // 1000000, target)
         if len(params.attrs):
             output_attrs = set(params.attrs)
         else:
@@ -273,11 +384,11 @@ class BlastChannel(object):
     def __init__(self, conn, search_id, push_attrs):
         self._conn = conn
         self._search_id = search_id
-        self._push_attrs = push_attrs
+        self.push_attrs = push_attrs	# None to send all attributes
 
     def send(self, obj):
         '''Send the specified Object on the blast channel.'''
-        xdr = obj.xdr(self._search_id, self._push_attrs)
+        xdr = obj.xdr(self._search_id, self.push_attrs)
         _BlastChannelSender(xdr).send(self._conn)
 
     def close(self):
@@ -10,10 +10,19 @@
 #  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
 #
 
-'''Statistics tracking.'''
+'''Statistics tracking.
+
+Statistics are updated on every object by every worker thread, so each
+thread accumulates into its own shard and the shards are only merged when
+the statistics are read.  Updates therefore take no locks.  Latency
+statistics are additionally recorded in log-linear histograms so that
+percentiles can be reported.
+'''
 
 from __future__ import with_statement
+import ctypes
 import logging
+import math
 import threading
 import time
 
@@ -21,33 +30,151 @@ from opendiamond.protocol import XDR_search_stats, XDR_filter_stats
 
 _log = logging.getLogger(__name__)
 
+class LatencyHistogram(object):
+    '''A log-linear histogram of non-negative integer values, in the style
+    of HdrHistogram.  Each power of two is divided into 2**SUB_BITS
+    buckets, bounding the relative error of a reported value by
+    2**-SUB_BITS.'''
+
+    SUB_BITS = 5
+    MAX_BITS = 44		# ~4.9 hours in ns
+    _SUB_COUNT = 1 << SUB_BITS
+    _BUCKETS = (MAX_BITS - SUB_BITS + 1) * _SUB_COUNT
+    _MAX_VALUE = (1 << MAX_BITS) - 1
+
+    def __init__(self):
+        self.counts = [0] * self._BUCKETS
+
+    @classmethod
+    def _bucket(cls, value):
+        '''Return the bucket index for the value.'''
+        if value < cls._SUB_COUNT:
+            return value
+        # frexp() gives the bit length, even on Python < 2.7
+        shift = math.frexp(value)[1] - cls.SUB_BITS - 1
+        return shift * cls._SUB_COUNT + (value >> shift)
+
+    @classmethod
+    def _bucket_value(cls, bucket):
+        '''Return the largest value that falls into the bucket.'''
+        if bucket < 2 * cls._SUB_COUNT:
+            return bucket
+        shift = bucket // cls._SUB_COUNT - 1
+        sub = bucket % cls._SUB_COUNT + cls._SUB_COUNT
+        return ((sub + 1) << shift) - 1
+
+    def record(self, value):
+        '''Add a value to the histogram.  Not thread-safe.'''
+        value = min(max(int(value), 0), self._MAX_VALUE)
+        self.counts[self._bucket(value)] += 1
+
+    def merge(self, other):
+        '''Add the values in other to this histogram.'''
+        self.counts = [a + b for a, b in zip(self.counts, other.counts)]
+
+    @property
+    def count(self):
+        '''The number of recorded values.'''
+        return sum(self.counts)
+
+    def percentile(self, pct):
+        '''Return an upper bound for the specified percentile of the
+        recorded values, or 0 if there are none.'''
+        total = self.count
+        if total == 0:
+            return 0
+        threshold = max(int(math.ceil(total * pct / 100.0)), 1)
+        seen = 0
+        for bucket, count in enumerate(self.counts):
+            seen += count
+            if seen >= threshold:
+                return self._bucket_value(bucket)
+        return self._MAX_VALUE
+
+
 class _Statistics(object):
     '''Base class for server statistics.'''
 
     label = 'Unconfigured statistics'
     attrs = ()
+    # Statistics whose individual updates are also recorded in a histogram
+    histograms = ()
+    percentiles = (50, 99, 99.9)
 
     def __init__(self):
-        self._lock = threading.Lock()
-        self._stats = dict([(name, 0) for name, _desc in self.attrs])
+        self._lock = threading.Lock()	# Protects self._shards
+        self._shards = []		# [(stats dict, histogram dict)]
+        self._local = threading.local()
 
     def __getattr__(self, key):
-        return self._stats[key]
+        if key.startswith('_'):
+            raise AttributeError(key)
+        try:
+            return self._merge(False)[0][key]
+        except KeyError:
+            raise AttributeError(key)
 
-    def update(self, *args, **kwargs):
-        '''Atomically add 1 to the statistics listed in *args and add the
-        values specified in **kwargs to the corresponding statistics.'''
+    def _get_shard(self):
+        '''Return the shard belonging to the current thread.'''
+        try:
+            return self._local.shard
+        except AttributeError:
+            shard = (dict([(name, 0) for name, _desc in self.attrs]),
+                    dict([(name, LatencyHistogram())
+                    for name in self.histograms]))
+            with self._lock:
+                self._shards.append(shard)
+            self._local.shard = shard
+            return shard
+
+    def _merge(self, histograms=True):
+        '''Return a (stats dict, histogram dict) merged from all shards.
+        Updates concurrent with the merge may be partially included.'''
+        stats = dict([(name, 0) for name, _desc in self.attrs])
+        hists = dict()
+        if histograms:
+            hists = dict([(name, LatencyHistogram())
+                    for name in self.histograms])
         with self._lock:
-            for name in args:
-                self._stats[name] += 1
-            for name, value in kwargs.iteritems():
-                self._stats[name] += value
+            shards = list(self._shards)
+        for shard_stats, shard_hists in shards:
+            for name, value in shard_stats.items():
+                stats[name] += value
+            for name, hist in hists.items():
+                hist.merge(shard_hists[name])
+        return stats, hists
+
+    def update(self, *args, **kwargs):
+        '''Add 1 to the statistics listed in *args and add the values
+        specified in **kwargs to the corresponding statistics.  Values of
+        statistics with histograms are also recorded in the histogram.'''
+        stats, hists = self._get_shard()
+        for name in args:
+            stats[name] += 1
+        for name, value in kwargs.iteritems():
+            stats[name] += value
+            if name in hists:
+                hists[name].record(value)
+
+    def summary(self):
+        '''Return a dict of all statistics, plus percentiles of those with
+        histograms as e.g. "execution_ns_p99".'''
+        stats, hists = self._merge()
+        for name, hist in hists.iteritems():
+            for pct in self.percentiles:
+                stats['%s_p%s' % (name, pct)] = hist.percentile(pct)
+        return stats
 
     def log(self):
         '''Dump all statistics to the log.'''
+        stats, hists = self._merge()
         _log.info('%s:', self.label)
         for name, desc in self.attrs:
-            _log.info('  %s: %d', desc, self._stats[name])
+            _log.info('  %s: %d', desc, stats[name])
+            if name in hists:
+                _log.info('    %s', ', '.join(['p%s %d' %
+                        (pct, hists[name].percentile(pct))
+                        for pct in self.percentiles]))
 
 
 class SearchStatistics(_Statistics):
@@ -58,23 +185,37 @@ class SearchStatistics(_Statistics):
             ('objs_dropped', 'Objects dropped'),
             ('objs_passed', 'Objects passed'),
             ('objs_unloadable', 'Objects failing to load'),
-            ('execution_ns', 'Total object examination time (ns)'))
+            ('objs_outranked', 'Objects dropped by top-K ranking'),
+            ('execution_ns', 'Total object examination time (ns)'),
+            ('scope_ns', 'Time waiting for the scope list (ns)'),
+            ('fetch_ns', 'Object fetch time (ns)'),
+            ('cache_ns', 'Cache lookup and update time (ns)'),
+            ('cache_filter_misses', 'Cache lookups skipped by key filter'),
+            ('cache_filter_hits', 'Key filter lookups found in cache'),
+            ('cache_filter_false_positives',
+                                'Key filter lookups missing from cache'),
+            ('filter_ns', 'Filter execution time (ns)'),
+            ('blast_ns', 'Time sending results (ns)'),
+            ('objs_reexecuted', 'Objects reexecuted'),
+            ('reexecute_ns', 'Total reexecution time (ns)'),
+            ('reexecute_late', 'Reexecutions exceeding latency target'))
+    histograms = ('execution_ns', 'reexecute_ns')
 
     def xdr(self, objs_total, filter_stats):
         '''Return an XDR statistics structure for these statistics.'''
-        with self._lock:
-            try:
-                avg_obj_time = self.execution_ns / self.objs_processed
-            except ZeroDivisionError:
-                avg_obj_time = 0
-            return XDR_search_stats(
-                objs_total=objs_total,
-                objs_processed=self.objs_processed,
-                objs_dropped=self.objs_dropped,
-                objs_nproc=self.objs_passed,
-                avg_obj_time=avg_obj_time,
-                filter_stats=[s.xdr() for s in filter_stats],
-            )
+        stats, _hists = self._merge(False)
+        try:
+            avg_obj_time = stats['execution_ns'] / stats['objs_processed']
+        except ZeroDivisionError:
+            avg_obj_time = 0
+        return XDR_search_stats(
+            objs_total=objs_total,
+            objs_processed=stats['objs_processed'],
+            objs_dropped=stats['objs_dropped'],
+            objs_nproc=stats['objs_passed'],
+            avg_obj_time=avg_obj_time,
+            filter_stats=[s.xdr() for s in filter_stats],
+        )
 
 
 class FilterStatistics(_Statistics):
@@ -86,7 +227,9 @@ class FilterStatistics(_Statistics):
             ('objs_cache_passed', 'Objects skipped by cache'),
             ('objs_compute', 'Objects examined by filter'),
             ('objs_terminate', 'Objects causing filter to terminate'),
+            ('objs_timeout', 'Objects exceeding the deadline'),
             ('execution_ns', 'Filter execution time (ns)'))
+    histograms = ('execution_ns',)
 
     def __init__(self, name):
         _Statistics.__init__(self)
@@ -95,31 +238,60 @@ class FilterStatistics(_Statistics):
 
     def xdr(self):
         '''Return an XDR statistics structure for these statistics.'''
-        with self._lock:
-            try:
-                avg_exec_time = self.execution_ns / self.objs_processed
-            except ZeroDivisionError:
-                avg_exec_time = 0
-            return XDR_filter_stats(self.name,
-                objs_processed=self.objs_processed,
-                objs_dropped=self.objs_dropped,
-                objs_cache_dropped=self.objs_cache_dropped,
-                objs_cache_passed=self.objs_cache_passed,
-                objs_compute=self.objs_compute,
-                avg_exec_time=avg_exec_time,
-            )
+        stats, _hists = self._merge(False)
+        try:
+            avg_exec_time = stats['execution_ns'] / stats['objs_processed']
+        except ZeroDivisionError:
+            avg_exec_time = 0
+        return XDR_filter_stats(self.name,
+            objs_processed=stats['objs_processed'],
+            objs_dropped=stats['objs_dropped'],
+            objs_cache_dropped=stats['objs_cache_dropped'],
+            objs_cache_passed=stats['objs_cache_passed'],
+            objs_compute=stats['objs_compute'],
+            avg_exec_time=avg_exec_time,
+        )
+
+
+class _Timespec(ctypes.Structure):
+    _fields_ = [('tv_sec', ctypes.c_long), ('tv_nsec', ctypes.c_long)]
+
+
+def _get_monotonic_clock():
+    '''Return a function returning the value of a monotonic clock in
+    seconds, falling back to time.time() if none is available.'''
+    CLOCK_MONOTONIC = 1
+    for libname in 'librt.so.1', 'libc.so.6':
+        try:
+            clock_gettime = ctypes.CDLL(libname, use_errno=True).clock_gettime
+        except (OSError, AttributeError):
+            continue
+        clock_gettime.argtypes = [ctypes.c_int, ctypes.POINTER(_Timespec)]
+        clock_gettime.restype = ctypes.c_int
+        break
+    else:
+        _log.warning('No monotonic clock; using wall clock time')
+        return time.time
+
+    def monotonic():
+        ts = _Timespec()
+        if clock_gettime(CLOCK_MONOTONIC, ctypes.byref(ts)):
+            raise OSError(ctypes.get_errno(), 'clock_gettime() failed')
+        return ts.tv_sec + ts.tv_nsec * 1e-9
+    return monotonic
+monotonic_time = _get_monotonic_clock()
 
 
 class Timer(object):
     '''Tracks the elapsed time since the Timer object was created.'''
 
     def __init__(self):
-        self._start = time.time()
+        self._start = monotonic_time()
 
     @property
     def elapsed_seconds(self):
         '''Elapsed time in seconds.'''
-        return time.time() - self._start
+        return monotonic_time() - self._start
 
     @property
     def elapsed(self):
@@ -0,0 +1,225 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2012 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''Work stealing between the servers of a search.
+
+When stealing is enabled, each server fetches the scope indexes it
+enumerates in parts (see opendiamond.scopeindex), and a server that has
+run out of parts asks its peers for one of theirs.  The peer protocol is
+line-based:
+
+1.  The thief connects to the steal port of the peer's supervisor and sends
+    the search key.  The key is derived from the scope cookies, the search
+    ID, and the filter signatures, so it is the same on every server
+    running the search.  The supervisor replies with the port on which
+    that search accepts steal requests, or with an empty line if it has no
+    such search.
+
+2.  The thief connects to that port and sends the search key.  The search
+    replies with one of:
+
+        PART <part> <parts> <scope list URL>
+        WAIT            no parts now, but there may be soon
+        NONE            no parts left to give
+
+    After a PART, the thief replies OK to ask for ownership of it.  If
+    the OK arrives in time, the search records the part as given away and
+    replies TAKEN; otherwise the part is returned to the search's queue.
+    The thief scans the part only once it has received TAKEN.
+
+A part is handed out at most once, so each object is still evaluated by
+exactly one server, and the statistics and session variables that the
+client sums across servers remain correct.
+'''
+
+import errno
+import logging
+import os
+import re
+import socket
+import threading
+
+from opendiamond.helpers import connection_ok, md5
+
+# Replies to a steal request
+WAIT = 'WAIT'
+NONE = 'NONE'
+
+# Seconds to wait for a peer before giving up on it
+TIMEOUT = 5
+# Seconds the thief waits for TAKEN.  Longer than the search waits for OK,
+# so that a part is only lost if the connection fails after the search
+# has given it away.
+TAKEN_TIMEOUT = 2 * TIMEOUT
+BACKLOG = 16
+
+_KEY_RE = re.compile('^[0-9a-f]{32}$')
+
+_log = logging.getLogger(__name__)
+
+def search_key(cookies, search_id, signatures):
+    '''Return the key identifying a search across servers.'''
+    digest = md5('steal %d' % search_id)
+    items = sorted([str(c.serial) for c in cookies]) + sorted(signatures)
+    for item in items:
+        digest.update(' ' + item)
+    return digest.hexdigest()
+
+
+def lookup_port(directory, key):
+    '''Return the port on which the search with the specified key accepts
+    steal requests, or None if there is no such search.  Called by the
+    supervisor.'''
+    if not _KEY_RE.match(key):
+        return None
+    path = os.path.join(directory, key)
+    try:
+        port, pid = open(path).read().split()
+        port, pid = int(port), int(pid)
+    except (IOError, ValueError):
+        return None
+    try:
+        os.kill(pid, 0)
+    except OSError, e:
+        if e.errno == errno.ESRCH:
+            # The search died without unregistering
+            try:
+                os.unlink(path)
+            except OSError:
+                pass
+            return None
+    return port
+
+
+class StealServer(threading.Thread):
+    '''Answers steal requests from the peers of a search.  queue must have
+    give() and settle() methods; give() returns a (scope list URL, part,
+    parts) tuple, WAIT, or NONE, and settle(part, taken) is then called
+    with the tuple and whether the peer acknowledged it.'''
+
+    def __init__(self, directory, key, queue):
+        threading.Thread.__init__(self, name='steal')
+        self.setDaemon(True)
+        self._key = key
+        self._queue = queue
+        self._sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self._sock.bind(('', 0))
+        self._sock.listen(BACKLOG)
+        # Register with the supervisor
+        self._path = os.path.join(directory, key)
+        tmp = self._path + '.tmp'
+        fh = open(tmp, 'w')
+        fh.write('%d %d\n' % (self._sock.getsockname()[1], os.getpid()))
+        fh.close()
+        os.rename(tmp, self._path)
+
+    def run(self):
+        while True:
+            try:
+                sock, addr = self._sock.accept()
+            except socket.error:
+                if self._path is None:
+                    # Closed
+                    return
+                continue
+            try:
+                try:
+                    self._serve(sock, addr[0])
+                except socket.error, e:
+                    _log.warning('Steal request from %s: %s', addr[0], e)
+            finally:
+                sock.close()
+
+    def _serve(self, sock, host):
+        if not connection_ok('diamondd', host):
+            _log.info('Rejected steal request from %s', host)
+            return
+        sock.settimeout(TIMEOUT)
+        fh = sock.makefile('rb', 0)
+        if fh.readline(64).strip() != self._key:
+            sock.sendall(NONE + '\n')
+            return
+        reply = self._queue.give()
+        if reply in (WAIT, NONE):
+            sock.sendall(reply + '\n')
+            return
+        url, part, parts = reply
+        taken = False
+        try:
+            sock.sendall('PART %d %d %s\n' % (part, parts, url))
+            if fh.readline(8).strip() != 'OK':
+                raise socket.error('No acknowledgment')
+            taken = True
+        finally:
+            self._queue.settle(reply, taken)
+        # The thief scans the part only after this confirmation
+        sock.sendall('TAKEN\n')
+        _log.info('Gave part %d/%d of %s to %s', part, parts, url, host)
+
+    def close(self):
+        '''Unregister and stop answering requests.'''
+        if self._path is not None:
+            try:
+                os.unlink(self._path)
+            except OSError:
+                pass
+            self._path = None
+            try:
+                self._sock.shutdown(socket.SHUT_RDWR)
+            except socket.error:
+                pass
+            self._sock.close()
+
+
+def _request(host, port, line):
+    '''Connect to the port, send the line, and return the socket and a file
+    object for reading the reply.'''
+    sock = socket.create_connection((host, port), TIMEOUT)
+    sock.sendall(line + '\n')
+    return sock, sock.makefile('rb', 0)
+
+
+def steal(peer, default_port, key):
+    '''Ask the peer, given as host or host:port of its supervisor, for a
+    part of the scope of the search with the specified key.  Return a
+    (scope list URL, part, parts) tuple, WAIT, or NONE if the peer has
+    nothing to give or cannot be reached.'''
+    host, port = peer, default_port
+    if ':' in peer:
+        host, port = peer.rsplit(':', 1)
+    try:
+        sock, fh = _request(host, int(port), key)
+        try:
+            search_port = fh.readline(16).strip()
+        finally:
+            sock.close()
+        if not search_port:
+            return NONE
+        sock, fh = _request(host, int(search_port), key)
+        try:
+            words = fh.readline(4096).rstrip('\n').split(' ', 3)
+            if words[0] == WAIT:
+                return WAIT
+            elif words[0] == 'PART' and len(words) == 4:
+                part = (words[3], int(words[1]), int(words[2]))
+                sock.sendall('OK\n')
+                # Until the peer confirms, it may still scan the part
+                # itself
+                sock.settimeout(TAKEN_TIMEOUT)
+                if fh.readline(8).strip() == 'TAKEN':
+                    return part
+            return NONE
+        finally:
+            sock.close()
+    except (socket.error, ValueError), e:
+        _log.debug('Stealing from %s: %s', peer, e)
+        return NONE
@@ -0,0 +1,225 @@
+#
+#  The OpenDiamond Platform for Interactive Search
+#
+#  Copyright (c) 2012 Carnegie Mellon University
+#  All rights reserved.
+#
+#  This software is distributed under the terms of the Eclipse Public
+#  License, Version 1.0 which can be found in the file named LICENSE.
+#  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+#  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+#
+
+'''Adaptive control of the number of active worker threads.
+
+The best number of workers depends on the search.  Scans against a slow
+dataretriever spend most of their time waiting for objects and want more
+of them in flight than there are CPUs, while filter stacks that use a lot
+of memory thrash with one worker per CPU.  A search with adaptive workers
+starts all of its worker threads, lets only some of them process objects,
+and periodically adjusts how many by hill climbing on throughput:
+
+- While memory is short, it deactivates workers, which also kills their
+  filter processes.
+- While the workers are mostly waiting for the scope list to produce
+  objects, more of them cannot help, so the number is held.
+- Otherwise, if the last change improved throughput, it makes another
+  change in the same direction; if it hurt, or added workers for no gain,
+  it reverts it and holds for a while.  Otherwise it adds workers only if
+  the CPUs have capacity to spare or the workers are mostly waiting on
+  I/O.
+
+Workers are sampled through the search statistics, which already account
+where each worker spends its time, and the machine through /proc.
+'''
+
+from __future__ import with_statement
+import logging
+import threading
+
+from opendiamond.server.statistics import monotonic_time
+
+# Seconds between adjustments
+INTERVAL = 2
+# Relative change in throughput that counts as an improvement or loss
+THRESHOLD = 0.05
+# Intervals to hold after a change that reduced throughput
+HOLD = 5
+# Fraction of CPU time in use above which the CPUs have no capacity to spare
+CPU_BUSY = 0.9
+# Fraction of memory available below which memory is short
+MEMORY_LOW = 0.1
+# Fraction of worker time spent waiting for objects, or for the cache and
+# the client, above which the workers are starved or I/O-bound
+STARVED = 0.5
+IO_BOUND = 0.5
+
+# Worker time statistics, by kind
+_IO_STATS = ('fetch_ns', 'cache_ns', 'blast_ns')
+_WAIT_STATS = ('scope_ns',)
+_WORK_STATS = _IO_STATS + _WAIT_STATS + ('filter_ns',)
+
+_log = logging.getLogger(__name__)
+
+def _cpu_times():
+    '''Return (busy, total) CPU time of the machine in clock ticks, or
+    None if unavailable.'''
+    try:
+        fields = open('/proc/stat').readline().split()
+        ticks = [int(f) for f in fields[1:9]]
+    except (IOError, ValueError):
+        return None
+    # idle and iowait
+    return sum(ticks) - ticks[3] - ticks[4], sum(ticks)
+
+
+def _memory_available():
+    '''Return the fraction of memory available for new allocations, or
+    None if unknown.'''
+    info = {}
+    try:
+        for line in open('/proc/meminfo'):
+            key, value = line.split(':', 1)
+            info[key] = int(value.split()[0])
+        return float(info['MemAvailable']) / info['MemTotal']
+    except (IOError, ValueError, KeyError, ZeroDivisionError):
+        return None
+
+
+class WorkerController(threading.Thread):
+    '''Decides how many of a search's worker threads are active.  Workers
+    call admit() before taking objects from the scope, and finish() when
+    the scope is exhausted.  Worker numbers below the active count are
+    active.'''
+
+    def __init__(self, state, minimum, maximum, initial):
+        threading.Thread.__init__(self, name='workers')
+        self.setDaemon(True)
+        self._state = state
+        self._min = max(minimum, 1)
+        self._max = max(maximum, self._min)
+        self._cond = threading.Condition()
+        self._active = min(max(initial, self._min), self._max)
+        self._release = False	# Inactive workers kill their filters
+        self._finished = False
+        # Control state
+        self._last_step = 0
+        self._last_rate = None
+        self._hold = 0
+
+    @property
+    def active(self):
+        return self._active
+
+    def admit(self, worker, release):
+        '''Block while the worker is inactive.  release is called to kill
+        the worker's filter processes if it is deactivated because memory
+        is short.'''
+        # Unlocked fast path, since this is called for every group of
+        # objects
+        if worker < self._active:
+            return
+        released = False
+        with self._cond:
+            while worker >= self._active:
+                if self._release and not released:
+                    # Drop the lock while killing processes
+                    self._cond.release()
+                    try:
+                        release()
+                    finally:
+                        self._cond.acquire()
+                    released = True
+                    continue
+                self._cond.wait()
+
+    def finish(self):
+        '''Activate all workers so that they see the end of the scope, and
+        stop adjusting.'''
+        with self._cond:
+            self._finished = True
+            self._active = self._max
+            self._cond.notify_all()
+
+    def _set_active(self, count, reason, release=False):
+        count = min(max(count, self._min), self._max)
+        with self._cond:
+            if self._finished or count == self._active:
+                return False
+            _log.info('Active workers: %d -> %d (%s)', self._active, count,
+                                reason)
+            self._active = count
+            self._release = release
+            self._cond.notify_all()
+        return True
+
+    def _sample(self):
+        stats = self._state.stats.summary()
+        return (monotonic_time(), stats['objs_processed'],
+                    dict([(k, stats[k]) for k in _WORK_STATS]),
+                    _cpu_times())
+
+    def run(self):
+        try:
+            prev = self._sample()
+            while not self._finished:
+                with self._cond:
+                    self._cond.wait(INTERVAL)
+                cur = self._sample()
+                self._adjust(prev, cur)
+                prev = cur
+        except Exception:
+            _log.exception('Worker controller exception')
+
+    def _adjust(self, prev, cur):
+        '''Decide on a change in the number of active workers from two
+        samples.'''
+        elapsed = cur[0] - prev[0]
+        if elapsed <= 0:
+            return
+        rate = (cur[1] - prev[1]) / elapsed
+        spent = dict([(k, cur[2][k] - prev[2][k]) for k in _WORK_STATS])
+        work = float(sum(spent.values())) or 1
+        io = sum([spent[k] for k in _IO_STATS]) / work
+        waiting = sum([spent[k] for k in _WAIT_STATS]) / work
+        cpu = None
+        if prev[3] is not None and cur[3] is not None:
+            total = cur[3][1] - prev[3][1]
+            if total > 0:
+                cpu = float(cur[3][0] - prev[3][0]) / total
+        memory = _memory_available()
+
+        last_step, last_rate = self._last_step, self._last_rate
+        self._last_step, self._last_rate = 0, rate
+        # Change by about a quarter, so that the effect of a step stands
+        # out from noise
+        step = max(self._active // 4, 1)
+        if memory is not None and memory < MEMORY_LOW:
+            self._change(-step, 'memory short', True)
+            return
+        if waiting > STARVED:
+            # Waiting on the scope list; don't judge the last change
+            self._last_step, self._last_rate = last_step, last_rate
+            return
+        if last_step and last_rate:
+            change = (rate - last_rate) / last_rate
+            if change > THRESHOLD:
+                self._change(last_step, 'throughput rose')
+                return
+            if change < -THRESHOLD or last_step > 0:
+                # A loss, or workers added for no gain
+                self._change(-last_step, 'no improvement', record=False)
+                self._hold = HOLD
+                return
+        if self._hold:
+            self._hold -= 1
+            return
+        if (cpu is not None and cpu < CPU_BUSY) or io > IO_BOUND:
+            self._change(step, 'capacity available')
+
+    def _change(self, step, reason, release=False, record=True):
+        '''Change the number of active workers by step.  If record is
+        True, the effect of the change is judged at the next adjustment.'''
+        before = self._active
+        if self._set_active(before + step, reason, release) and record:
+            self._last_step = self._active - before
@@ -12,14 +12,41 @@
 
 import base64
 import binascii
+import os
+import shutil
+import signal
+import simplejson as json
+import socket
+import subprocess
+import sys
+from cStringIO import StringIO
 from datetime import datetime, timedelta
 from dateutil.tz import tzutc
 from M2Crypto import EVP
 import unittest
 import uuid
+import tempfile
 import textwrap
+import time
 
 from opendiamond.scope import ScopeCookie, ScopeError
+from opendiamond import objectbatch, scopeindex, xdr
+from opendiamond.blobcache import BlobCache
+from opendiamond.protocol import XDR_attribute, XDR_object
+from opendiamond.server import cachekeys
+from opendiamond.server.cachekeys import BloomFilter, CacheKeyFilter
+from opendiamond.server.filter import (Filter, FilterStack, MemoryBudget,
+        Ranking, Watchdog, _FilterHost)
+from opendiamond.server.filtertrace import (FilterTraceWriter,
+        FilterTraceError, read_trace)
+from opendiamond.server.listen import ConnListener
+from opendiamond.server.object_ import Object, ObjectLoader, ObjectLoadError
+from opendiamond.server.objecttrace import ObjectTracer
+from opendiamond.server.pool import FilterPool, PoolClient, process_key
+from opendiamond.server.statistics import LatencyHistogram, FilterStatistics
+from opendiamond.server.steal import StealServer, steal, NONE
+from opendiamond.server import workers
+import threading
 
 # unittest uses Java-style naming conventions
 # pylint: disable=C0103
@@ -279,5 +306,805 @@ class TestCookieBadSignature(_TestHandGeneratedCookie):
     verify_exc = ScopeError
 
 
+class TestScopeIndex(unittest.TestCase):
+    '''Round-trip a scope index and split it into parts.'''
+    count = 3 * scopeindex.CHUNK_OBJECTS + 17
+
+    def setUp(self):
+        self.urls = ['obj/%d' % i for i in xrange(self.count)]
+        self.index = StringIO()
+        scopeindex.write_index(self.index, self.urls)
+
+    def parse(self, data, piece=7):
+        parser = scopeindex.ScopeIndexParser()
+        urls = []
+        for i in xrange(0, len(data), piece):
+            urls.extend(parser.feed(data[i:i + piece]))
+        parser.close()
+        return parser.header, urls
+
+    def test_round_trip(self):
+        hdr, urls = self.parse(self.index.getvalue())
+        self.assertEqual(hdr.count, self.count)
+        self.assertEqual(hdr.total, self.count)
+        self.assertEqual(urls, self.urls)
+
+    def test_parts(self):
+        for parts in 1, 2, 3, 5, 8:
+            urls = []
+            for part in xrange(parts):
+                data = ''.join(scopeindex.iter_part(self.index, part, parts))
+                hdr, part_urls = self.parse(data)
+                self.assertEqual(hdr.count, len(part_urls))
+                self.assertEqual(hdr.total, self.count)
+                self.assertEqual(hdr.first, len(urls))
+                urls.extend(part_urls)
+            self.assertEqual(urls, self.urls)
+
+    def test_truncated(self):
+        parser = scopeindex.ScopeIndexParser()
+        parser.feed(self.index.getvalue()[:-3])
+        self.assertRaises(scopeindex.ScopeIndexError, parser.close)
+
+
+class TestObjectBatch(unittest.TestCase):
+    '''Round-trip an object batch.'''
+
+    def setUp(self):
+        self.records = [([('a', '1'), ('bb', '')], 'data'), None,
+                ([], ''), ([], '\0' * 70000)]
+        parts = [objectbatch.encode_header()]
+        for record in self.records:
+            if record is None:
+                parts.append(objectbatch.encode_missing())
+            else:
+                attrs, data = record
+                parts.extend([objectbatch.encode_record(attrs, len(data)),
+                        data])
+        self.data = ''.join(parts)
+
+    def test_round_trip(self):
+        self.assertEqual(objectbatch.decode(self.data), self.records)
+
+    def test_truncated(self):
+        for length in 3, 20, len(self.data) - 1:
+            self.assertRaises(objectbatch.ObjectBatchError,
+                    objectbatch.decode, self.data[:length])
+
+
+class TestXDRObjectVector(unittest.TestCase):
+    '''Check that vector encoding of XDR_object matches encode().'''
+
+    def setUp(self):
+        self.obj = XDR_object(7, [XDR_attribute(name, value)
+                for name, value in (('', 'abcde'), ('_ObjectID', 'obj/1'),
+                ('x', ''), ('long-name', 'z' * 4099), ('tail', '\0\1'))])
+
+    def check(self, obj):
+        self.assertEqual(''.join(obj.encode_vector()), obj.encode())
+
+    def test_encode(self):
+        self.check(self.obj)
+        self.check(XDR_object(1, []))
+
+    def test_encode_pure_python(self):
+        saved = xdr._diamondxdr
+        xdr._diamondxdr = None
+        try:
+            self.check(self.obj)
+            self.check(XDR_object(1, []))
+        finally:
+            xdr._diamondxdr = saved
+
+    def test_name_too_long(self):
+        obj = XDR_object(1, [XDR_attribute('n' * 257, '')])
+        self.assertRaises(xdr.XDREncodingError, obj.encode_vector)
+
+    def test_send_timeout(self):
+        a, b = socket.socketpair()
+        try:
+            a.settimeout(0.2)
+            # Nobody reads, so this fills the socket buffers
+            self.assertRaises(socket.timeout, xdr.send_vector, a,
+                    ['x' * 1000000] * 20)
+        finally:
+            a.close()
+            b.close()
+
+
+class TestLatencyHistogram(unittest.TestCase):
+    '''Check histogram percentiles and sharded statistics.'''
+
+    def test_percentiles(self):
+        hist = LatencyHistogram()
+        for value in xrange(1, 100001):
+            hist.record(value * 1000)
+        self.assertEqual(hist.count, 100000)
+        for pct in 50, 99, 99.9:
+            exact = pct * 1000 * 1000
+            value = hist.percentile(pct)
+            self.assertTrue(exact <= value <= exact * (1 + 2.0 **
+                    -LatencyHistogram.SUB_BITS), (pct, value))
+        self.assertEqual(LatencyHistogram().percentile(50), 0)
+
+    def test_small_values(self):
+        hist = LatencyHistogram()
+        for value in xrange(64):
+            hist.record(value)
+        self.assertEqual(hist.percentile(100), 63)
+
+    def test_shards(self):
+        stats = FilterStatistics('test')
+        def work():
+            for _i in xrange(1000):
+                stats.update('objs_processed', execution_ns=5)
+        threads = [threading.Thread(target=work) for _i in xrange(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        xdr = stats.xdr()
+        self.assertEqual(xdr.objs_processed, 4000)
+        self.assertEqual(xdr.avg_exec_time, 5)
+        self.assertEqual(stats.execution_ns, 20000)
+
+
+class TestAttributeLiveness(unittest.TestCase):
+    '''Check the last-reader analysis and attribute release.'''
+
+    class _Struct(object):
+        def __init__(self, **kwargs):
+            self.__dict__.update(kwargs)
+
+    class _Http(object):
+        def __init__(self, etag):
+            self.etag = etag
+
+        def get(self, url, post_data=None, byte_range=None):
+            return ({'ETag': self.etag}, 'data')
+
+    def _filter(self, name, *deps):
+        return Filter(name, '', '', 0, 1, [], list(deps))
+
+    def test_last_readers(self):
+        # rgb <- thumb, rgb <- edges <- faces; unrelated stands alone
+        stack = FilterStack([self._filter('faces', 'edges'),
+                self._filter('edges', 'rgb'), self._filter('rgb'),
+                self._filter('unrelated'), self._filter('thumb', 'rgb')])
+        names = [f.name for f in stack]
+        last = dict(zip(names, [names[i]
+                for i in stack._get_last_readers()]))
+        self.assertEqual(last['rgb'], max(['faces', 'thumb'],
+                key=names.index))
+        self.assertEqual(last['edges'], 'faces')
+        self.assertEqual(last['faces'], 'faces')
+        self.assertEqual(last['unrelated'], 'unrelated')
+
+    def test_release(self):
+        obj = Object('server', 'obj/1')
+        obj['rgb'] = 'x' * 100
+        sig = obj.get_signature('rgb')
+        size = obj.data_size()
+        obj.release('rgb')
+        self.assertFalse('rgb' in obj)
+        self.assertEqual(obj.get_signature('rgb'), sig)
+        self.assertEqual(obj.data_size(), size - 100)
+        attrs = dict([(a.name, a.value) for a in obj.xdr_attributes()])
+        self.assertEqual(attrs['rgb'], '')
+        obj['rgb'] = 'y'
+        self.assertEqual(obj['rgb'], 'y')
+
+    def test_deferred(self):
+        obj = Object('server', 'obj/1')
+        loads = []
+        def load(o):
+            loads.append(o)
+            o[''] = 'data'
+        obj.defer('', load)
+        self.assertTrue('' in obj)
+        self.assertTrue(obj.is_deferred(''))
+        self.assertTrue('' in [a.name for a in obj.xdr_attributes()])
+        self.assertEqual(obj[''], 'data')
+        self.assertEqual(obj[''], 'data')
+        self.assertEqual(loads, [obj])
+        self.assertFalse(obj.is_deferred(''))
+
+    def test_deferred_range(self):
+        obj = Object('server', 'obj/1')
+        loads = []
+        def load(o):
+            loads.append(o)
+            o[''] = 'header+body'
+        def load_range(o, offset, length):
+            return 'header+body'[offset:offset + length]
+        obj.defer('', load, 'etag-sig', load_range)
+        self.assertEqual(obj.get_signature(''), 'etag-sig')
+        self.assertEqual(obj.get_range('', 0, 6), 'header')
+        self.assertTrue(obj.is_deferred(''))
+        self.assertEqual(loads, [])
+        # Once loaded, the data keeps the signature it was known by
+        self.assertEqual(obj[''], 'header+body')
+        self.assertEqual(obj.get_signature(''), 'etag-sig')
+        self.assertEqual(obj.get_range('', 7, 100), 'body')
+        obj[''] = 'changed'
+        self.assertNotEqual(obj.get_signature(''), 'etag-sig')
+
+    def test_deferred_changed(self):
+        config = self._Struct(user_agent='test', http_proxy=None,
+                                object_batch=1)
+        loader = ObjectLoader(config, None)
+        headers = {'ETag': '"1"'}
+        obj = Object('server', 'obj/1')
+        obj.defer('', lambda o: loader.load_data(o, headers),
+                                loader.data_signature(obj, headers))
+        # The data changed after the HEAD request
+        loader._http = self._Http('"2"')
+        self.assertRaises(ObjectLoadError, obj.load_deferred, '')
+        self.assertFalse('' in obj)
+        loader._http = self._Http('"1"')
+        loader.load_data(obj, headers)
+        self.assertEqual(obj[''], 'data')
+
+
+class TestFilterHost(unittest.TestCase):
+    '''Check when hosted filters share an object handle.'''
+
+    class _Process(object):
+        sequence = 0
+
+        def send(self, index, sequence):
+            self.sent = sequence
+
+    def test_sequence(self):
+        host = _FilterHost(None, ['a', 'b'])
+        host._proc = self._Process()
+        obj = Object('server', 'obj/1')
+        host.begin('a', obj)
+        obj['a'] = 'set by a'
+        host.end(obj)
+        host.begin('b', obj)
+        self.assertEqual(host._proc.sent, 1)
+        host.end(obj)
+        # Set outside the host, e.g. by the attribute cache
+        obj['c'] = 'stale in the host'
+        host.begin('b', obj)
+        self.assertEqual(host._proc.sent, 2)
+        host.end(obj)
+        host.done(obj)
+        host.begin('a', obj)
+        self.assertEqual(host._proc.sent, 3)
+
+
+class TestMemoryBudget(unittest.TestCase):
+    '''Check that scan workers charge in-flight objects to the budget.'''
+
+    class _Struct(object):
+        def __init__(self, **kwargs):
+            self.__dict__.update(kwargs)
+
+    def test_admit(self):
+        # No attributes are released, since the client wants them all
+        config = self._Struct(lazy_data=False, isolated_filters=set(),
+                                debug_filters=set(),
+                                cache_content_addressed=False,
+                                user_agent='test', http_proxy=None,
+                                object_batch=1)
+        state = self._Struct(config=config, blob_cache=None, ranking=None,
+                                blast=self._Struct(push_attrs=None),
+                                memory=MemoryBudget(100))
+        runner = FilterStack([]).bind(state, scan=True)
+        obj = Object('server', 'obj/1')
+        obj['rgb'] = 'x' * 200
+        runner._charge(obj)
+        thread = threading.Thread(target=state.memory.admit)
+        thread.setDaemon(True)
+        thread.start()
+        thread.join(0.2)
+        self.assertTrue(thread.isAlive())
+        runner._discharge()
+        thread.join(5)
+        self.assertFalse(thread.isAlive())
+
+    class _Http(object):
+        def get(self, url, post_data=None, byte_range=None):
+            parts = [objectbatch.encode_header()]
+            for _path in post_data.split('\n'):
+                parts.extend([objectbatch.encode_record([], 100), 'x' * 100])
+            return ({}, ''.join(parts))
+
+    def test_prefetch(self):
+        config = self._Struct(user_agent='test', http_proxy=None,
+                                object_batch=4)
+        memory = MemoryBudget(1000)
+        loader = ObjectLoader(config, self._Struct(digest='md5'), memory)
+        loader._http = self._Http()
+        loader._batch_urls.add('http://retriever/batch')
+        objs = [Object('server', 'http://retriever/obj/%d' % i)
+                                for i in range(3)]
+        loader.expect(objs)
+        loader.load(objs[0])
+        # The other objects' data is charged until they are loaded
+        self.assertEqual(memory._used, 200)
+        loader.load(objs[1])
+        self.assertEqual(memory._used, 100)
+        loader.expect([])
+        self.assertEqual(memory._used, 0)
+
+
+class TestWatchdog(unittest.TestCase):
+    '''Check that the watchdog kills only overrunning evaluations.'''
+
+    class _Process(object):
+        timed_out = False
+
+        def kill(self):
+            self.timed_out = True
+
+    def test_generation(self):
+        watchdog = Watchdog(10)
+        proc = self._Process()
+        first = watchdog.arm(proc)
+        self.assertTrue(watchdog.disarm(proc, first))
+        second = watchdog.arm(proc)
+        # A stale disarm leaves the next evaluation armed
+        self.assertTrue(watchdog.disarm(proc, first))
+        for _i in range(500):
+            if proc.timed_out:
+                break
+            time.sleep(0.01)
+        self.assertTrue(proc.timed_out)
+        self.assertFalse(watchdog.disarm(proc, second))
+
+    def test_disabled(self):
+        watchdog = Watchdog(0)
+        proc = self._Process()
+        self.assertTrue(watchdog.disarm(proc, watchdog.arm(proc)))
+
+
+class TestRanking(unittest.TestCase):
+    '''Check top-K ranking.'''
+
+    def test_place(self):
+        ranking = Ranking('faces', 3)
+        self.assertEqual(ranking.attr, '_filter.faces_score')
+        placed = [s for s in (5, 1, 3, 2, 4, 3, 6, 0)
+                if ranking.may_place(s) and ranking.place(s)]
+        self.assertEqual(placed, [5, 1, 3, 2, 4, 6])
+        self.assertFalse(ranking.may_place(4))
+        self.assertTrue(ranking.may_place(4.5))
+        self.assertEqual(sorted(placed)[-3:], [4, 5, 6])
+
+
+class TestBloomFilter(unittest.TestCase):
+    '''Check the cache key filter's Bloom filter.'''
+
+    def test_membership(self):
+        bloom = BloomFilter(1000, 0.01)
+        keys = ['result:%d' % i for i in range(1000)]
+        for key in keys:
+            bloom.add(key)
+        for key in keys:
+            self.assertTrue(key in bloom)
+        false = len([i for i in range(10000) if 'other:%d' % i in bloom])
+        self.assertTrue(false < 300, false)
+
+    class _Config(object):
+        cache_server = ('localhost', 6379)
+        cache_database = 0
+        cache_key_filter = 1000
+
+    def test_save(self):
+        config = self._Config()
+        config.cachedir = tempfile.mkdtemp(prefix='cache-keys-test-')
+        try:
+            keys = CacheKeyFilter(config)
+            keys.save()
+            self.assertFalse(CacheKeyFilter(config)._restore())
+            keys.ready = True
+            keys._scanned = time.time()
+            keys.add(['result:1'])
+            keys.save()
+            saved = CacheKeyFilter(config)
+            self.assertTrue(saved._restore())
+            saved.ready = True
+            self.assertTrue('result:1' in saved)
+            self.assertFalse('result:2' in saved)
+            # A filter for another database or size is not reused
+            config.cache_database = 1
+            self.assertFalse(CacheKeyFilter(config)._restore())
+            config.cache_database = 0
+            config.cache_key_filter = 2000
+            self.assertFalse(CacheKeyFilter(config)._restore())
+        finally:
+            shutil.rmtree(config.cachedir)
+
+    class _Redis(object):
+        keys = ['result:%d' % i for i in range(10)]
+
+        def __init__(self, **_kwargs):
+            pass
+
+        def dbsize(self):
+            return len(self.keys)
+
+        def scan_iter(self, count):
+            return iter(self.keys)
+
+    def test_capacity(self):
+        config = self._Config()
+        config.cache_password = None
+        config.cachedir = tempfile.mkdtemp(prefix='cache-keys-test-')
+        saved = cachekeys.Redis
+        cachekeys.Redis = self._Redis
+        try:
+            keys = CacheKeyFilter(config)
+            keys._load()
+            self.assertTrue(keys.ready)
+            self.assertFalse('result:10' in keys)
+            # Too many keys for the filter to be useful
+            config.cache_key_filter = 5
+            keys = CacheKeyFilter(config)
+            keys._load()
+            self.assertFalse(keys.ready)
+            self.assertTrue('result:10' in keys)
+        finally:
+            cachekeys.Redis = saved
+            shutil.rmtree(config.cachedir)
+
+
+class TestFilterTrace(unittest.TestCase):
+    '''Check that filter traces round-trip.'''
+
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp()
+        os.close(fd)
+
+    def tearDown(self):
+        os.unlink(self.path)
+
+    def test_round_trip(self):
+        trace = FilterTraceWriter(self.path, ['/bin/filter', 'arg'])
+        trace.send('1\n1\n', '\n')
+        trace.begin('faces', 'obj/1')
+        trace.request('get-attribute', 'rgb')
+        trace.send('3\n\x00\x01\x02\n')
+        trace.result(0.25)
+        trace.close()
+        records = list(read_trace(self.path))
+        self.assertEqual([(k, p) for k, _t, p in records], [
+                ('A', '/bin/filter\0arg'), ('S', '1\n1\n\n'),
+                ('O', 'faces\0obj/1'), ('Q', 'get-attribute\0rgb'),
+                ('S', '3\n\x00\x01\x02\n'), ('R', '0.25')])
+        times = [t for _k, t, _p in records]
+        self.assertEqual(times, sorted(times))
+
+    def test_truncated(self):
+        trace = FilterTraceWriter(self.path, ['/bin/filter'])
+        trace.send('x' * 1000)
+        trace.close()
+        data = open(self.path, 'rb').read()
+        open(self.path, 'wb').write(data[:len(data) // 2])
+        self.assertRaises(FilterTraceError, list, read_trace(self.path))
+
+
+class TestWorkStealing(unittest.TestCase):
+    '''Check the work stealing peer protocol.'''
+
+    class _Queue(object):
+        def __init__(self, parts):
+            self.parts = parts
+            self.settled = []
+
+        def give(self):
+            if self.parts:
+                return self.parts.pop()
+            return NONE
+
+        def settle(self, part, taken):
+            self.settled.append((part, taken))
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+        sock = socket.socket()
+        sock.bind(('127.0.0.1', 0))
+        self.port = sock.getsockname()[1]
+        sock.close()
+        listener = ConnListener(0, self.port, self.dir)
+        thread = threading.Thread(target=listener.accept)
+        thread.setDaemon(True)
+        thread.start()
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def test_steal(self):
+        key = '0123456789abcdef' * 2
+        parts = [('http://a/scope', 1, 4), ('http://a/scope', 2, 4)]
+        queue = self._Queue(list(parts))
+        server = StealServer(self.dir, key, queue)
+        server.start()
+        peer = '127.0.0.1:%d' % self.port
+        try:
+            self.assertEqual(steal(peer, 0, 'f' * 32), NONE)
+            got = [steal(peer, 0, key) for _i in range(3)]
+        finally:
+            server.close()
+        self.assertEqual(got, parts[::-1] + [NONE])
+        self.assertEqual(queue.settled, [(p, True) for p in parts[::-1]])
+        self.assertEqual(steal(peer, 0, key), NONE)
+
+    def test_unconfirmed(self):
+        # A search that takes the part back rather than confirming it
+        key = '0123456789abcdef' * 2
+        sock = socket.socket()
+        sock.bind(('127.0.0.1', 0))
+        sock.listen(1)
+        fh = open(os.path.join(self.dir, key), 'w')
+        fh.write('%d %d\n' % (sock.getsockname()[1], os.getpid()))
+        fh.close()
+        def victim():
+            conn, _addr = sock.accept()
+            conn_fh = conn.makefile('rb', 0)
+            conn_fh.readline()
+            conn.sendall('PART 1 4 http://a/scope\n')
+            conn_fh.readline()
+            conn.close()
+        thread = threading.Thread(target=victim)
+        thread.setDaemon(True)
+        thread.start()
+        try:
+            self.assertEqual(steal('127.0.0.1:%d' % self.port, 0, key), NONE)
+        finally:
+            sock.close()
+
+
+class TestFilterPool(unittest.TestCase):
+    '''Check parking and adoption of filter processes.'''
+
+    class _Process(object):
+        def __init__(self, tempdir):
+            self.proc = subprocess.Popen(['cat'], stdin=subprocess.PIPE,
+                                stdout=subprocess.PIPE)
+            self.pid = self.proc.pid
+            self.pool_key = process_key(['filter'], {})
+            self.tempdir = tempdir
+
+        def park_state(self):
+            return '{"sequence": 3}'
+
+        def filenos(self):
+            return [self.proc.stdin.fileno(), self.proc.stdout.fileno()]
+
+        def detach(self):
+            self.proc.stdin.close()
+            self.proc.stdout.close()
+
+    def setUp(self):
+        self.dir = os.path.join(tempfile.mkdtemp(), 'pool')
+        self.pool = FilterPool(self.dir, 300, 1 << 30)
+        listener = ConnListener(0, pool=self.pool)
+        thread = threading.Thread(target=listener.accept)
+        thread.setDaemon(True)
+        thread.start()
+
+    def tearDown(self):
+        shutil.rmtree(os.path.dirname(self.dir))
+
+    def test_adopt(self):
+        client = PoolClient(self.dir)
+        proc = self._Process(tempfile.mkdtemp(dir=self.dir))
+        try:
+            client.register(proc)
+            client.park_all()
+            self.assertTrue(proc.proc.stdin.closed)
+            self.assertEqual(client.adopt(process_key(['other'], {})),
+                                None)
+            pid, stdin, stdout, tempdir, state = client.adopt(proc.pool_key)
+            self.assertEqual(client.adopt(proc.pool_key), None)
+            # The descriptors are the pipes of the parked process
+            os.write(stdin, 'ping')
+            self.assertEqual(os.read(stdout, 4), 'ping')
+            os.close(stdin)
+            os.close(stdout)
+        finally:
+            os.kill(proc.pid, signal.SIGKILL)
+            proc.proc.wait()
+        self.assertEqual(pid, proc.pid)
+        self.assertEqual(tempdir, proc.tempdir)
+        self.assertEqual(state, '{"sequence": 3}')
+
+    class _Config(object):
+        debug_filters = debug_command = trace_filters = ()
+        filter_deadline_ms = 0
+
+    class _State(object):
+        pass
+
+    class _Pool(object):
+        def __init__(self, directory):
+            self.directory = directory
+
+        def adopt(self, key):
+            return None
+
+        def register(self, proc):
+            pass
+
+    def _start_filter(self, cachedir, code, blob):
+        '''Start a filter in a new search and return its process.'''
+        tmpdir = os.environ.get('TMPDIR')
+        os.environ['TMPDIR'] = tempfile.mkdtemp(dir=self.dir)
+        try:
+            cache = BlobCache(cachedir)
+        finally:
+            if tmpdir is None:
+                del os.environ['TMPDIR']
+            else:
+                os.environ['TMPDIR'] = tmpdir
+        state = self._State()
+        state.config = self._Config()
+        state.blob_cache = cache
+        state.pool = self._Pool(self.dir)
+        state.tracer = None
+        filter = Filter('f', 'md5:' + cache.add(code),
+                                'md5:' + cache.add(blob), 0, 100, ['a'], [])
+        filter.resolve(state)
+        runner = filter.bind(state)
+        runner.prestart()
+        return runner._proc, filter.code_path
+
+    def test_key(self):
+        cachedir = tempfile.mkdtemp(dir=self.dir)
+        code = '#!/bin/sh\nexec cat > /dev/null\n'
+        proc1, path1 = self._start_filter(cachedir, code, 'blob')
+        proc2, path2 = self._start_filter(cachedir, code, 'blob')
+        proc3, _path = self._start_filter(cachedir, code, 'other blob')
+        # Searches run the code from different paths
+        self.assertNotEqual(path1, path2)
+        self.assertEqual(proc1.pool_key, proc2.pool_key)
+        self.assertNotEqual(proc1.pool_key, proc3.pool_key)
+
+
+class TestObjectTracer(unittest.TestCase):
+    '''Check sampling and the trace file of object tracing.'''
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def test_trace(self):
+        tracer = ObjectTracer(os.path.join(self.dir, 'trace.json'), 2)
+        objs = [Object('server', 'obj%d' % i) for i in range(4)]
+        for obj in objs:
+            tracer.sample(obj)
+        self.assertEqual([o.trace is not None for o in objs],
+                                [True, False, True, False])
+        trace = objs[2].trace
+        trace.start()
+        start = trace.begin()
+        trace.add('eval', start, start + 0.001, 'libfilter')
+        trace.end('filter', start)
+        trace.finish(False)
+        tracer.close()
+        events = json.load(open(tracer.path))
+        spans = [e for e in events if e['ph'] == 'X']
+        self.assertEqual([e['name'] for e in spans], ['eval', 'filter'])
+        self.assertAlmostEqual(spans[0]['dur'], 1000, 3)
+        self.assertEqual(spans[0]['args']['object'], 'obj2')
+        lifetime = [(e['name'], e['ph']) for e in events
+                                if e.get('cat') == 'object']
+        self.assertEqual(lifetime, [('object', 'b'), ('queued', 'b'),
+                                ('queued', 'e'), ('object', 'e')])
+
+
+class TestFilterSpans(unittest.TestCase):
+    '''Check that tracing doesn't disturb filters which don't report
+    spans.'''
+
+    FILTER = textwrap.dedent('''\
+        #!%s
+        import sys
+        sys.path.insert(0, %r)
+        from opendiamond.filter import Filter
+
+        class CheckFilter(Filter):
+            def __call__(self, obj):
+                return obj.get_string('name') == 'wanted'
+
+        CheckFilter.run()
+    ''')
+
+    class _Struct(object):
+        def __init__(self, **kwargs):
+            self.__dict__.update(kwargs)
+
+        def update(self, *args, **kwargs):
+            pass
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def test_python_filter(self):
+        cache = BlobCache(self.dir)
+        code = self.FILTER % (sys.executable,
+                                os.path.dirname(os.path.dirname(
+                                os.path.abspath(__file__))))
+        config = self._Struct(debug_filters=(), debug_command=(),
+                                trace_filters=(), filter_deadline_ms=0)
+        tracer = ObjectTracer(os.path.join(self.dir, 'trace.json'), 1)
+        state = self._Struct(config=config, blob_cache=cache, pool=None,
+                                tracer=tracer, watchdog=Watchdog(0),
+                                stats=self._Struct())
+        filter = Filter('f', 'md5:' + cache.add(code),
+                                'md5:' + cache.add(''), 1, 1, [], [])
+        filter.resolve(state)
+        runner = filter.bind(state)
+        try:
+            for name in ('wanted', 'other', 'wanted'):
+                obj = Object('server', 'obj/' + name)
+                obj['name'] = name + '\0'
+                tracer.sample(obj)
+                obj.trace.start()
+                result = runner.evaluate(obj)
+                self.assertEqual(result.score, int(name == 'wanted'))
+            self.assertFalse(runner._proc.reports_spans)
+        finally:
+            runner._proc.kill()
+            runner.release()
+            tracer.close()
+
+class TestWorkerController(unittest.TestCase):
+    '''Check activation of workers and hill climbing on throughput.'''
+
+    def setUp(self):
+        self.controller = workers.WorkerController(None, 1, 8, 4)
+        self._memory = workers._memory_available
+        workers._memory_available = lambda: 0.5
+
+    def tearDown(self):
+        workers._memory_available = self._memory
+
+    def _sample(self, time, objs, cpu):
+        stats = dict([(k, 0) for k in workers._WORK_STATS])
+        stats['filter_ns'] = 1000
+        return (time, objs, stats, (int(cpu * 100 * time), 100 * time))
+
+    def test_admit(self):
+        released = []
+        self.controller.admit(3, None)
+        self.controller._set_active(2, 'test', True)
+        thread = threading.Thread(target=self.controller.admit,
+                                args=(3, lambda: released.append(True)))
+        thread.setDaemon(True)
+        thread.start()
+        thread.join(0.2)
+        self.assertTrue(thread.isAlive())
+        self.assertEqual(released, [True])
+        self.controller.finish()
+        thread.join(5)
+        self.assertFalse(thread.isAlive())
+
+    def test_adjust(self):
+        c = self.controller
+        # Idle CPUs: add a worker; a gain: add another
+        c._adjust(self._sample(0, 0, 0.5), self._sample(1, 100, 0.5))
+        self.assertEqual(c.active, 5)
+        c._adjust(self._sample(1, 100, 0.5), self._sample(2, 300, 0.5))
+        self.assertEqual(c.active, 6)
+        # No gain: revert and hold
+        c._adjust(self._sample(2, 300, 0.5), self._sample(3, 500, 0.5))
+        self.assertEqual(c.active, 5)
+        c._adjust(self._sample(3, 500, 0.5), self._sample(4, 700, 0.5))
+        self.assertEqual(c.active, 5)
+        # Memory short: shrink
+        workers._memory_available = lambda: 0.01
+        c._adjust(self._sample(4, 700, 1), self._sample(5, 900, 1))
+        self.assertEqual(c.active, 4)
+
 if __name__ == '__main__':
     unittest.main()
@@ -12,9 +12,16 @@
 
 '''XDR encoding helpers.'''
 
+import errno
+import socket
 import struct
 from xdrlib import Packer, Unpacker, Error as XDRError
 
+try:
+    import _diamondxdr
+except ImportError:
+    _diamondxdr = None
+
 class XDREncodingError(Exception):
     pass
 
@@ -214,6 +221,12 @@ class XDRStruct(object):
             self.encode_xdr(xdr)
             return xdr.get_buffer()
 
+    def encode_vector(self):
+        '''Return a list of strings whose concatenation is the serialized
+        object.  Subclasses can override this to avoid copying large
+        members.'''
+        return [self.encode()]
+
     @classmethod
     def decode(cls, data):
         '''Deserialize the data and return an object.'''
@@ -241,3 +254,63 @@ class XDRStruct(object):
             if attr is not None:
                 kwargs[attr] = value
         return cls(**kwargs)
+
+
+def _xdr_pad(length):
+    return '\0' * ((4 - length % 4) % 4)
+
+
+def _encode_attributes(head, attrs, max_name_length=-1):
+    '''Pure-Python equivalent of _diamondxdr.encode_attributes().'''
+    pieces = []
+    pending = [head, struct.pack('>I', len(attrs))]
+    for attr in attrs:
+        name, value = attr.name, attr.value
+        if not isinstance(name, str) or not isinstance(value, str):
+            raise ValueError('Attribute name and value must be strings')
+        if max_name_length >= 0 and len(name) > max_name_length:
+            raise ValueError('Attribute name too long')
+        pending.extend((struct.pack('>I', len(name)), name,
+                _xdr_pad(len(name)), struct.pack('>I', len(value))))
+        pieces.append(''.join(pending))
+        if value:
+            pieces.append(value)
+        pending = [_xdr_pad(len(value))]
+    tail = ''.join(pending)
+    if tail:
+        pieces.append(tail)
+    return pieces
+
+
+def encode_attribute_vector(head, attrs, max_name_length=None):
+    '''Return a list of strings containing the bytes of head followed by
+    an XDR array of (string name, opaque value) structs, taken from the
+    name and value attributes of each element of attrs.  The values are
+    referenced by the list rather than copied.'''
+    if max_name_length is None:
+        max_name_length = -1
+    try:
+        if _diamondxdr is not None:
+            return _diamondxdr.encode_attributes(head, attrs, max_name_length)
+        else:
+            return _encode_attributes(head, attrs, max_name_length)
+    except (ValueError, TypeError, AttributeError):
+        raise XDREncodingError()
+
+
+def send_vector(sock, pieces):
+    '''Send the concatenation of pieces on the socket, with a single
+    writev() if the native helpers are available.  Honors the socket
+    timeout as sendall() does.'''
+    if _diamondxdr is not None:
+        timeout = sock.gettimeout()
+        if timeout is None:
+            timeout = -1
+        try:
+            _diamondxdr.sendv(sock.fileno(), pieces, timeout)
+        except OSError, e:
+            if e.errno == errno.ETIMEDOUT:
+                raise socket.timeout('timed out')
+            raise socket.error(e.errno, e.strerror)
+    else:
+        sock.sendall(''.join(pieces))
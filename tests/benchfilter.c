@@ -0,0 +1,130 @@
+/*
+ *  The OpenDiamond Platform for Interactive Search
+ *
+ *  Copyright (c) 2012 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  This software is distributed under the terms of the Eclipse Public
+ *  License, Version 1.0 which can be found in the file named LICENSE.
+ *  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+ *  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+ */
+
+/*
+ * Synthetic filter for search-bench.  Takes two arguments:
+ *
+ *   cpu ROUNDS     hash the object data ROUNDS times; passes everything
+ *   attr BYTES     write a BYTES-long attribute derived from the data
+ *   drop PERCENT   drop about PERCENT% of objects, chosen by data hash
+ *
+ * Accepted objects score 1 and dropped objects score 0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+
+#include "lib_filter.h"
+
+enum bench_mode {
+    BENCH_CPU,
+    BENCH_ATTR,
+    BENCH_DROP,
+};
+
+struct bench {
+    enum bench_mode mode;
+    long param;
+    char *attr_name;
+    void *buf;
+};
+
+/* 32-bit FNV-1a */
+static uint32_t hash_data(const unsigned char *data, size_t len, uint32_t h)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	h = (h ^ data[i]) * 16777619U;
+    }
+    return h;
+}
+
+static int f_init_bench(int num_arg, const char * const *args, int bloblen,
+			const void *blob_data, const char *filt_name,
+			void **filter_args)
+{
+    struct bench *bench;
+    char *end;
+
+    if (num_arg != 2) {
+	lf_log(LOGL_ERR, "Expected two arguments");
+	return 1;
+    }
+
+    bench = g_new0(struct bench, 1);
+    if (!strcmp(args[0], "cpu")) {
+	bench->mode = BENCH_CPU;
+    } else if (!strcmp(args[0], "attr")) {
+	bench->mode = BENCH_ATTR;
+    } else if (!strcmp(args[0], "drop")) {
+	bench->mode = BENCH_DROP;
+    } else {
+	lf_log(LOGL_ERR, "Unknown mode %s", args[0]);
+	g_free(bench);
+	return 1;
+    }
+    bench->param = strtol(args[1], &end, 10);
+    if (*args[1] == 0 || *end != 0 || bench->param < 0) {
+	lf_log(LOGL_ERR, "Bad parameter %s", args[1]);
+	g_free(bench);
+	return 1;
+    }
+    if (bench->mode == BENCH_ATTR) {
+	bench->attr_name = g_strdup_printf("bench.%s", filt_name);
+	bench->buf = g_malloc0(bench->param);
+    }
+
+    *filter_args = bench;
+    return 0;
+}
+
+static double f_eval_bench(lf_obj_handle_t ohandle, void *filter_args)
+{
+    struct bench *bench = filter_args;
+    const void *data;
+    size_t len;
+    uint32_t h = 2166136261U;
+    long i;
+
+    if (lf_ref_attr(ohandle, "", &len, &data)) {
+	lf_log(LOGL_ERR, "Couldn't read object data");
+	return 0;
+    }
+
+    switch (bench->mode) {
+    case BENCH_CPU:
+	for (i = 0; i < bench->param; i++) {
+	    h = hash_data(data, len, h);
+	}
+	return 1;
+
+    case BENCH_ATTR:
+	h = hash_data(data, len, h);
+	for (i = 0; i + 4 <= bench->param; i += 4) {
+	    memcpy((char *) bench->buf + i, &h, 4);
+	    h = h * 16777619U + 1;
+	}
+	lf_write_attr(ohandle, bench->attr_name, bench->param, bench->buf);
+	return 1;
+
+    case BENCH_DROP:
+	h = hash_data(data, len, h);
+	return (h % 100) >= (uint32_t) bench->param ? 1 : 0;
+    }
+    return 0;
+}
+
+LF_MAIN(f_init_bench, f_eval_bench)
@@ -0,0 +1,156 @@
+/*
+ *  The OpenDiamond Platform for Interactive Search
+ *
+ *  Copyright (c) 2012 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  This software is distributed under the terms of the Eclipse Public
+ *  License, Version 1.0 which can be found in the file named LICENSE.
+ *  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+ *  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+ */
+
+/*
+ * Microbenchmark for the libdiamondfilter kernels.  Runs each kernel with
+ * each implementation supported by this CPU and prints the time per call
+ * and the speedup over the scalar implementation.
+ *
+ *   kernel-bench [WIDTH HEIGHT [DIM COUNT]]
+ *
+ * The image defaults to 1024x768 and the vector set to 1000 vectors of
+ * 128 elements.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+
+#include "lib_filter.h"
+
+static const char *const isas[] = {"scalar", "sse4.2", "avx2"};
+
+static size_t width = 1024, height = 768, dim = 128, count = 1000;
+static uint8_t *pixels;
+static uint32_t *hist;
+static uint32_t *sums;
+static float *query;
+static float *vectors;
+static float *out;
+
+static void run_histogram(void) {
+  lf_rgb_histogram(pixels, width * height, 16, hist);
+}
+
+static void run_count_in_range(void) {
+  static const uint8_t lo[3] = {64, 32, 0};
+  static const uint8_t hi[3] = {192, 224, 128};
+  volatile size_t n = lf_count_in_range(pixels, width * height, lo, hi);
+  (void) n;
+}
+
+static void run_window_sums(void) {
+  lf_window_sums(pixels, width, height, 4 * width, 1, 16, 16, sums);
+}
+
+static void run_l2(void) {
+  lf_l2_distances(query, vectors, count, dim, out);
+}
+
+static void run_cosine(void) {
+  lf_cosine_similarities(query, vectors, count, dim, out);
+}
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} kernels[] = {
+  {"rgb_histogram", run_histogram},
+  {"count_in_range", run_count_in_range},
+  {"window_sums", run_window_sums},
+  {"l2_distances", run_l2},
+  {"cosine_similarities", run_cosine},
+};
+
+/* Return the mean time per call in microseconds. */
+static double time_kernel(void (*run)(void)) {
+  GTimer *timer = g_timer_new();
+  unsigned calls = 0;
+  double elapsed;
+
+  run();
+  g_timer_start(timer);
+  do {
+    run();
+    calls++;
+  } while ((elapsed = g_timer_elapsed(timer, NULL)) < 0.5);
+  g_timer_destroy(timer);
+  return elapsed * 1e6 / calls;
+}
+
+int main(int argc, char **argv) {
+  GRand *rand = g_rand_new_with_seed(1);
+  unsigned i, j;
+
+  if (argc != 1 && argc != 3 && argc != 5) {
+    fprintf(stderr, "Usage: %s [WIDTH HEIGHT [DIM COUNT]]\n", argv[0]);
+    return 1;
+  }
+  if (argc >= 3) {
+    width = strtoul(argv[1], NULL, 10);
+    height = strtoul(argv[2], NULL, 10);
+  }
+  if (argc == 5) {
+    dim = strtoul(argv[3], NULL, 10);
+    count = strtoul(argv[4], NULL, 10);
+  }
+  if (width < 16 || height < 16 || dim == 0 || count == 0) {
+    fprintf(stderr, "Image must be at least 16x16\n");
+    return 1;
+  }
+
+  pixels = g_malloc(4 * width * height);
+  for (i = 0; i < 4 * width * height; i++) {
+    pixels[i] = g_rand_int_range(rand, 0, 256);
+  }
+  hist = g_new0(uint32_t, 16 * 16 * 16);
+  sums = g_new(uint32_t, (width - 15) * (height - 15));
+  query = g_new(float, dim);
+  vectors = g_new(float, dim * count);
+  out = g_new(float, count);
+  for (i = 0; i < dim; i++) {
+    query[i] = g_rand_double(rand);
+  }
+  for (i = 0; i < dim * count; i++) {
+    vectors[i] = g_rand_double(rand);
+  }
+
+  printf("%-20s %-8s %12s %8s\n", "kernel", "isa", "usec/call", "speedup");
+  for (i = 0; i < G_N_ELEMENTS(kernels); i++) {
+    double scalar = 0;
+
+    for (j = 0; j < G_N_ELEMENTS(isas); j++) {
+      double usec;
+
+      if (lf_kernel_select(isas[j])) {
+	continue;
+      }
+      usec = time_kernel(kernels[i].run);
+      if (j == 0) {
+	scalar = usec;
+      }
+      printf("%-20s %-8s %12.1f %7.2fx\n", kernels[i].name, isas[j], usec,
+	     scalar / usec);
+    }
+  }
+
+  g_free(out);
+  g_free(vectors);
+  g_free(query);
+  g_free(sums);
+  g_free(hist);
+  g_free(pixels);
+  g_rand_free(rand);
+  return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ *  The OpenDiamond Platform for Interactive Search
+ *
+ *  Copyright (c) 2012 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  This software is distributed under the terms of the Eclipse Public
+ *  License, Version 1.0 which can be found in the file named LICENSE.
+ *  ANY USE, REPRODUCTION OR DISTRIBUTION OF THIS SOFTWARE CONSTITUTES
+ *  RECIPIENT'S ACCEPTANCE OF THIS AGREEMENT
+ */
+
+/*
+ * Check every kernel implementation supported by this CPU against
+ * straightforward reference code.  Sizes are chosen so that both the
+ * vector loops and their scalar tails are exercised.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <glib.h>
+
+#include "lib_filter.h"
+
+static const char *const isas[] = {"scalar", "sse4.2", "avx2"};
+
+static int failures;
+
+#define CHECK(cond, ...) do {						\
+    if (!(cond)) {							\
+      printf("%s: ", lf_kernel_isa());					\
+      printf(__VA_ARGS__);						\
+      printf("\n");							\
+      failures++;							\
+    }									\
+  } while (0)
+
+static uint8_t *random_pixels(GRand *rand, size_t count) {
+  uint8_t *pixels = g_malloc(4 * count);
+  size_t i;
+
+  for (i = 0; i < 4 * count; i++) {
+    pixels[i] = g_rand_int_range(rand, 0, 256);
+  }
+  return pixels;
+}
+
+static float *random_floats(GRand *rand, size_t count) {
+  float *values = g_new(float, count);
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    values[i] = g_rand_double_range(rand, -1, 1);
+  }
+  return values;
+}
+
+static bool close_enough(float a, float b) {
+  return fabsf(a - b) <= 1e-4 * MAX(1, fabsf(b));
+}
+
+static void test_histogram(GRand *rand) {
+  const size_t count = 1001;
+  uint8_t *pixels = random_pixels(rand, count);
+  unsigned bins;
+
+  for (bins = 1; bins <= 256; bins *= 2) {
+    unsigned bits = g_bit_storage(bins) - 1;
+    uint32_t *hist = g_new0(uint32_t, bins * bins * bins);
+    uint32_t *expected = g_new0(uint32_t, bins * bins * bins);
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+      const uint8_t *p = pixels + 4 * i;
+      unsigned r = p[0] >> (8 - bits);
+      unsigned g = p[1] >> (8 - bits);
+      unsigned b = p[2] >> (8 - bits);
+      expected[(r * bins + g) * bins + b]++;
+    }
+    CHECK(lf_rgb_histogram(pixels, count, bins, hist) == 0,
+	  "histogram failed with %u bins", bins);
+    CHECK(!memcmp(hist, expected, bins * bins * bins * sizeof(*hist)),
+	  "histogram mismatch with %u bins", bins);
+    g_free(expected);
+    g_free(hist);
+  }
+  CHECK(lf_rgb_histogram(pixels, count, 3, NULL) == EINVAL,
+	"histogram accepted 3 bins");
+  CHECK(lf_rgb_histogram(pixels, count, 512, NULL) == EINVAL,
+	"histogram accepted 512 bins");
+  g_free(pixels);
+}
+
+static void test_count_in_range(GRand *rand) {
+  const size_t count = 1003;
+  uint8_t *pixels = random_pixels(rand, count);
+  const uint8_t lo[3] = {40, 0, 100};
+  const uint8_t hi[3] = {200, 255, 100};
+  size_t expected = 0;
+  size_t i;
+
+  /* Make sure some pixels match, including at the boundaries */
+  for (i = 0; i < count; i += 3) {
+    pixels[4 * i] = i % 2 ? 40 : 200;
+    pixels[4 * i + 2] = 100;
+  }
+  for (i = 0; i < count; i++) {
+    const uint8_t *p = pixels + 4 * i;
+    expected += p[0] >= lo[0] && p[0] <= hi[0] &&
+      p[1] >= lo[1] && p[1] <= hi[1] && p[2] >= lo[2] && p[2] <= hi[2];
+  }
+  CHECK(lf_count_in_range(pixels, count, lo, hi) == expected,
+	"count mismatch");
+  g_free(pixels);
+}
+
+static void test_window_sums(GRand *rand) {
+  const size_t width = 37, height = 23, stride = 4 * width + 8;
+  const size_t wins[][2] = {{1, 1}, {3, 5}, {37, 1}, {1, 23}, {37, 23}};
+  uint8_t *pixels = random_pixels(rand, stride * height / 4);
+  unsigned w;
+
+  for (w = 0; w < G_N_ELEMENTS(wins); w++) {
+    size_t ww = wins[w][0], wh = wins[w][1];
+    size_t ow = width - ww + 1, oh = height - wh + 1;
+    uint32_t *out = g_new(uint32_t, ow * oh);
+    unsigned channel = w % 3;
+    bool ok = true;
+    size_t x, y, i, j;
+
+    CHECK(lf_window_sums(pixels, width, height, stride, channel, ww, wh,
+			 out) == 0, "window sums failed");
+    for (y = 0; y < oh; y++) {
+      for (x = 0; x < ow; x++) {
+	uint32_t sum = 0;
+	for (j = y; j < y + wh; j++) {
+	  for (i = x; i < x + ww; i++) {
+	    sum += pixels[j * stride + 4 * i + channel];
+	  }
+	}
+	ok = ok && out[y * ow + x] == sum;
+      }
+    }
+    CHECK(ok, "window sum mismatch for %zux%zu window", ww, wh);
+    g_free(out);
+  }
+  CHECK(lf_window_sums(pixels, width, height, stride, 3, 1, 1, NULL) ==
+	EINVAL, "window sums accepted channel 3");
+  CHECK(lf_window_sums(pixels, width, height, stride, 0, width + 1, 1,
+		       NULL) == EINVAL, "window sums accepted a wide window");
+  g_free(pixels);
+}
+
+static void test_distances(GRand *rand) {
+  const size_t count = 7, dim = 131;
+  float *query = random_floats(rand, dim);
+  float *vectors = random_floats(rand, count * dim);
+  float out[7];
+  size_t i, j;
+
+  memset(vectors + 3 * dim, 0, dim * sizeof(*vectors));
+  lf_l2_distances(query, vectors, count, dim, out);
+  for (i = 0; i < count; i++) {
+    double sum = 0;
+    for (j = 0; j < dim; j++) {
+      double d = query[j] - vectors[i * dim + j];
+      sum += d * d;
+    }
+    CHECK(close_enough(out[i], sum), "L2 mismatch: %g != %g", out[i], sum);
+  }
+
+  lf_cosine_similarities(query, vectors, count, dim, out);
+  for (i = 0; i < count; i++) {
+    double dot = 0, qq = 0, vv = 0, expected;
+    for (j = 0; j < dim; j++) {
+      dot += query[j] * vectors[i * dim + j];
+      qq += query[j] * query[j];
+      vv += vectors[i * dim + j] * vectors[i * dim + j];
+    }
+    expected = vv > 0 ? dot / sqrt(qq * vv) : 0;
+    CHECK(close_enough(out[i], expected), "cosine mismatch: %g != %g",
+	  out[i], expected);
+  }
+  g_free(vectors);
+  g_free(query);
+}
+
+int main(void) {
+  GRand *rand = g_rand_new_with_seed(1);
+  unsigned i;
+
+  for (i = 0; i < G_N_ELEMENTS(isas); i++) {
+    if (lf_kernel_select(isas[i])) {
+      printf("%s: not supported, skipping\n", isas[i]);
+      continue;
+    }
+    test_histogram(rand);
+    test_count_in_range(rand);
+    test_window_sums(rand);
+    test_distances(rand);
+  }
+  CHECK(lf_kernel_select("mmx") == ENOTSUP, "selected unknown ISA");
+  g_rand_free(rand);
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}